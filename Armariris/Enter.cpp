@@ -6,24 +6,107 @@
 #include "Transforms/Obfuscation/StringObfuscation.h"
 #include "Transforms/Obfuscation/Substitution.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 using namespace llvm;
 
-static void registerArmaririsModulePass(const PassManagerBuilder &,
+static bool isArmaririsPhase(const PassManagerBuilder &Builder);
+
+static void registerArmaririsModulePass(const PassManagerBuilder &Builder,
                               legacy::PassManagerBase &PM) {
+    if (!isArmaririsPhase(Builder)) {
+        return;
+    }
     PM.add(createStringObfuscation(true));
 }
 
 static void registerArmaririsFunctionPass(const PassManagerBuilder &,
                               legacy::PassManagerBase &PM) {
-#if LLVM_VERSION_MAJOR >= 9
-    PM.add(createLowerSwitchPass());
-#endif
     PM.add(createFlattening(true));
     PM.add(createSubstitution(true));
 }
 
+enum ObfuscationExtensionPoint {
+    EP_Early,
+    EP_ScalarLate,
+    EP_Last,
+    EP_LTOLate
+};
+static cl::opt<ObfuscationExtensionPoint> ArmaririsExtensionPoint(
+        "armariris-ep", cl::init(EP_Early),
+        cl::desc("[Armariris]Where the function obfuscation passes run"),
+        cl::values(
+                clEnumValN(EP_Early, "early",
+                           "Before any optimization, so the optimizer can "
+                           "undo some of it (default)"),
+                clEnumValN(EP_ScalarLate, "scalar-late",
+                           "After the scalar optimizations, before "
+                           "vectorization and unrolling"),
+                clEnumValN(EP_Last, "optimizer-last",
+                           "After the whole per-TU optimization pipeline"),
+                clEnumValN(EP_LTOLate, "lto-late",
+                           "At the end of full LTO, nothing runs per TU")));
+
+enum ObfuscationThinLTOPhase {
+    Phase_PreLink,
+    Phase_Backend
+};
+static cl::opt<ObfuscationThinLTOPhase> ArmaririsThinLTOPhase(
+        "armariris-thinlto", cl::init(Phase_PreLink),
+        cl::desc("[Armariris]Where ThinLTO builds are obfuscated"),
+        cl::values(
+                clEnumValN(Phase_PreLink, "prelink",
+                           "When each TU is compiled (default)"),
+                clEnumValN(Phase_Backend, "backend",
+                           "In the ThinLTO backends, after importing. The "
+                           "plugin has to be loaded by the linker")));
+
+// Both ThinLTO phases reach most extension points, so without this check
+// the passes would run twice. Builds without ThinLTO have one phase.
+static bool isArmaririsPhase(const PassManagerBuilder &Builder) {
+    if (Builder.PrepareForThinLTO) {
+        return ArmaririsThinLTOPhase == Phase_PreLink;
+    }
+    if (Builder.PerformThinLTO) {
+        return ArmaririsThinLTOPhase == Phase_Backend;
+    }
+    return true;
+}
+
+// Registered at every candidate extension point, only the selected one adds
+// the passes. Options are parsed by the time the pipeline is populated.
+template <ObfuscationExtensionPoint EP>
+static void registerArmaririsFunctionPassAt(const PassManagerBuilder &Builder,
+                              legacy::PassManagerBase &PM) {
+    if (ArmaririsExtensionPoint == EP && isArmaririsPhase(Builder)) {
+        registerArmaririsFunctionPass(Builder, PM);
+    }
+}
+
+// ThinLTO backends don't run EP_EarlyAsPossible, the module optimizer is
+// the earliest point after importing
+static bool isEarlyInBackend(const PassManagerBuilder &Builder) {
+    return Builder.PerformThinLTO && ArmaririsExtensionPoint == EP_Early;
+}
+
+static void registerArmaririsFunctionPassThinLTOEarly(const PassManagerBuilder &Builder,
+                              legacy::PassManagerBase &PM) {
+    if (isEarlyInBackend(Builder) && isArmaririsPhase(Builder)) {
+        registerArmaririsFunctionPass(Builder, PM);
+    }
+}
+
+// -O0 pipelines only run EP_EarlyAsPossible and EP_EnabledOnOptLevel0
+static void registerArmaririsFunctionPassO0(const PassManagerBuilder &Builder,
+                              legacy::PassManagerBase &PM) {
+    if ((ArmaririsExtensionPoint == EP_ScalarLate ||
+         ArmaririsExtensionPoint == EP_Last || isEarlyInBackend(Builder)) &&
+        isArmaririsPhase(Builder)) {
+        registerArmaririsFunctionPass(Builder, PM);
+    }
+}
+
 static RegisterStandardPasses
         RegisterMyPass(PassManagerBuilder::EP_EnabledOnOptLevel0,
                        registerArmaririsModulePass);
@@ -32,4 +115,180 @@ static RegisterStandardPasses
                         registerArmaririsModulePass);
 static RegisterStandardPasses
         RegisterMyPass1(PassManagerBuilder::EP_EarlyAsPossible,
-                        registerArmaririsFunctionPass);
\ No newline at end of file
+                       registerArmaririsFunctionPassAt<EP_Early>);
+static RegisterStandardPasses
+        RegisterMyPass2(PassManagerBuilder::EP_ScalarOptimizerLate,
+                        registerArmaririsFunctionPassAt<EP_ScalarLate>);
+static RegisterStandardPasses
+        RegisterMyPass3(PassManagerBuilder::EP_OptimizerLast,
+                        registerArmaririsFunctionPassAt<EP_Last>);
+static RegisterStandardPasses
+        RegisterMyPass4(PassManagerBuilder::EP_FullLinkTimeOptimizationLast,
+                        registerArmaririsFunctionPassAt<EP_LTOLate>);
+static RegisterStandardPasses
+        RegisterMyPass5(PassManagerBuilder::EP_EnabledOnOptLevel0,
+                        registerArmaririsFunctionPassO0);
+static RegisterStandardPasses
+        RegisterMyPass6(PassManagerBuilder::EP_ModuleOptimizerEarly,
+                        registerArmaririsFunctionPassThinLTOEarly);
+
+#if __has_include("llvm/Passes/PassPlugin.h")
+// New pass manager entry point, used with -fpass-plugin / opt -load-pass-plugin
+#include "Transforms/Obfuscation/NewPassManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+struct FlatteningPass : ObfuscationFunctionPass<FlatteningPass> {
+    FlatteningPass()
+        : ObfuscationFunctionPass(
+              static_cast<FunctionPass *>(createFlattening(true)), false) {}
+};
+struct SubstitutionPass : ObfuscationFunctionPass<SubstitutionPass> {
+    SubstitutionPass()
+        : ObfuscationFunctionPass(
+              static_cast<FunctionPass *>(createSubstitution(true)), true) {}
+};
+struct StringObfuscationPass : ObfuscationModulePass<StringObfuscationPass> {
+    StringObfuscationPass()
+        : ObfuscationModulePass(
+              static_cast<ModulePass *>(createStringObfuscation(true))) {}
+};
+} // namespace
+
+// Same passes and order as registerArmaririsFunctionPass
+static void addArmaririsFunctionPasses(FunctionPassManager &FPM) {
+    FPM.addPass(FlatteningPass());
+    FPM.addPass(SubstitutionPass());
+}
+
+// -armariris-thinlto for the new pass manager, see ThinLTOPhaseGate
+static bool isArmaririsPhase(ThinLTOPhase Phase) {
+    if (Phase == ThinLTOPhase::PreLink) {
+        return ArmaririsThinLTOPhase == Phase_PreLink;
+    }
+    if (Phase == ThinLTOPhase::Backend) {
+        return ArmaririsThinLTOPhase == Phase_Backend;
+    }
+    return true;
+}
+
+// ThinLTO backends don't run PipelineStart, early simplification is the
+// earliest point after importing
+static bool isEarlyInBackend(ThinLTOPhase Phase) {
+    return Phase == ThinLTOPhase::Backend &&
+           ArmaririsThinLTOPhase == Phase_Backend;
+}
+
+static void addArmaririsFunctionPassesAt(ModulePassManager &MPM,
+                                         bool (*Filter)(ThinLTOPhase)) {
+    FunctionPassManager FPM;
+    addArmaririsFunctionPasses(FPM);
+    ModulePassManager Passes;
+    Passes.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+    MPM.addPass(ThinLTOPhaseGate<Module>(std::move(Passes), Filter));
+}
+
+#if LLVM_VERSION_MAJOR < 15
+// The new pass manager has no full LTO extension point before LLVM 15.
+// lto-late runs the passes at optimizer-last there instead of leaving every
+// function unobfuscated
+static bool fallBackFromLTOLate() {
+    if (ArmaririsExtensionPoint != EP_LTOLate) {
+        return false;
+    }
+    static bool Warned = false;
+    if (!Warned) {
+        errs() << "warning: -armariris-ep=lto-late needs LLVM 15 with the new "
+                  "pass manager, running the passes at optimizer-last\n";
+        Warned = true;
+    }
+    return true;
+}
+#endif
+
+static void registerArmaririsPassBuilderCallbacks(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, FunctionPassManager &FPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "armariris-fla") {
+                FPM.addPass(FlatteningPass());
+            } else if (Name == "armariris-sub") {
+                FPM.addPass(SubstitutionPass());
+            } else {
+                return false;
+            }
+            return true;
+        });
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "armariris-str") {
+                MPM.addPass(StringObfuscationPass());
+                return true;
+            }
+            return false;
+        });
+#if LLVM_VERSION_MAJOR >= 12
+    PB.registerPipelineStartEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+#else
+    PB.registerPipelineStartEPCallback([](ModulePassManager &MPM) {
+#endif
+            startThinLTOPipeline();
+            if (ArmaririsExtensionPoint == EP_Early) {
+                addArmaririsFunctionPassesAt(MPM, isArmaririsPhase);
+            }
+        });
+#if LLVM_VERSION_MAJOR >= 12
+    PB.registerPipelineEarlySimplificationEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+            if (ArmaririsExtensionPoint == EP_Early) {
+                addArmaririsFunctionPassesAt(MPM, isEarlyInBackend);
+            }
+        });
+#endif
+    PB.registerScalarOptimizerLateEPCallback(
+        [](FunctionPassManager &FPM, ObfuscationOptLevel) {
+            if (ArmaririsExtensionPoint == EP_ScalarLate) {
+                FunctionPassManager Passes;
+                addArmaririsFunctionPasses(Passes);
+                FPM.addPass(ThinLTOPhaseGate<Function>(std::move(Passes),
+                                                       isArmaririsPhase));
+            }
+        });
+    PB.registerVectorizerStartEPCallback(
+        [](FunctionPassManager &, ObfuscationOptLevel) {
+            getThinLTOPipeline()->SawVectorizer = true;
+        });
+    PB.registerOptimizerLastEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+#if LLVM_VERSION_MAJOR >= 15
+            if (ArmaririsExtensionPoint == EP_Last) {
+#else
+            if (ArmaririsExtensionPoint == EP_Last || fallBackFromLTOLate()) {
+#endif
+                addArmaririsFunctionPassesAt(MPM, isArmaririsPhase);
+            }
+            ModulePassManager Passes;
+            Passes.addPass(StringObfuscationPass());
+            MPM.addPass(ThinLTOPhaseGate<Module>(std::move(Passes),
+                                                 isArmaririsPhase));
+            endThinLTOPipeline();
+        });
+#if LLVM_VERSION_MAJOR >= 15
+    PB.registerFullLinkTimeOptimizationLastEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+            if (ArmaririsExtensionPoint == EP_LTOLate) {
+                FunctionPassManager FPM;
+                addArmaririsFunctionPasses(FPM);
+                MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+            }
+        });
+#endif
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "Armariris", LLVM_VERSION_STRING,
+            registerArmaririsPassBuilderCallbacks};
+}
+#endif
@@ -1,5 +1,7 @@
 #include "Transforms/Obfuscation/Flattening.h"
+#include "Transforms/Obfuscation/FlattenSwitch.h"
 #include "Transforms/Obfuscation/Utils.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/CryptoUtils.h"
 
@@ -59,6 +61,7 @@ bool Flattening::runOnFunction(Function &F) {
     if(flatten(tmp)) {
     //  errs()<<"Function: "<<tmp->getName()<<"\n";
       ++Flattened;
+      return true;
     }
   }
 
@@ -78,14 +81,6 @@ bool Flattening::flatten(Function *f) {
   llvm::cryptoutils->get_bytes(scrambling_key, 16);
   // END OF SCRAMBLER
 
-  // Lower switch
-#if LLVM_VERSION_MAJOR >= 9
-    // >=9.0, LowerSwitchPass depends on LazyValueInfoWrapperPass, which cause AssertError.
-    // So I move LowerSwitchPass into register function, just before FlatteningPass.
-#else
-  FunctionPass *lower = createLowerSwitchPass();
-  lower->runOnFunction(*f);
-#endif
   // Save all original BB
   //errs()<<"Flatten: "<<f->getName()<<"\n";
   for (Function::iterator i = f->begin(); i != f->end(); ++i) {
@@ -194,6 +189,19 @@ bool Flattening::flatten(Function *f) {
     switchI->addCase(numCase, i);
   }
 
+  // State of the dispatcher case that jumps to BB
+  auto stateOf = [&](BasicBlock *BB) {
+    ConstantInt *numCase = switchI->findCaseDest(BB);
+    // If next case == default case (switchDefault)
+    if (numCase == NULL) {
+      numCase = cast<ConstantInt>(
+          ConstantInt::get(switchI->getCondition()->getType(),
+                           llvm::cryptoutils->scramble32(
+                               switchI->getNumCases() - 1, scrambling_key)));
+    }
+    return numCase;
+  };
+
   // Recalculate switchVar
   //errs()<<"Function: "<<f->getName()<<"\n";
   for (vector<BasicBlock *>::iterator b = origBB.begin(); b != origBB.end();
@@ -248,6 +256,14 @@ bool Flattening::flatten(Function *f) {
       continue;
     }
 
+    // Switches map each case to its state without being lowered
+    if (SwitchInst *SI = dyn_cast<SwitchInst>(i->getTerminator())) {
+      flattenSwitch(
+          SI, load->getPointerOperand(),
+          [&](BasicBlock *) { return loopEnd; }, stateOf);
+      continue;
+    }
+
     // If it's a non-conditional jump
     if (i->getTerminator()->getNumSuccessors() == 1) {
       // Get successor and delete terminator
@@ -147,6 +147,7 @@ bool Substitution::runOnFunction(Function &F) {
     for(auto I = B->begin(); I != B->end(); I++)
       now++;
   //errs() << original << " " << now << " sub\n";
+  return true;
   }
   return false;
 }
@@ -0,0 +1,162 @@
+#ifndef _OBFUSCATION_NEW_PASS_MANAGER_H_
+#define _OBFUSCATION_NEW_PASS_MANAGER_H_
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/Compiler.h"
+#if __has_include("llvm/Passes/OptimizationLevel.h")
+#include "llvm/Passes/OptimizationLevel.h"
+#endif
+#include <memory>
+using namespace std;
+using namespace llvm;
+
+/*
+  New pass manager variants of the obfuscation passes.
+  Each variant owns one legacy pass object for the lifetime of the pipeline
+  and reports what it actually invalidated: functions a pass skips keep all
+  their analyses, and passes that don't touch the CFG keep DominatorTree,
+  LoopInfo and the other CFG analyses alive for the following passes.
+*/
+namespace llvm {
+#if LLVM_VERSION_MAJOR >= 14
+typedef OptimizationLevel ObfuscationOptLevel;
+#else
+typedef PassBuilder::OptimizationLevel ObfuscationOptLevel;
+#endif
+
+// ThinLTO builds reach most extension points in both the pre-link and the
+// backend pipeline, and the callbacks aren't told which one is being built.
+// The callbacks a pipeline invokes tell them apart: the pre-link pipeline has
+// PipelineStart but no VectorizerStart, the backend VectorizerStart but no
+// PipelineStart, and a pipeline without ThinLTO (or at -O0) has both.
+// OptimizerLast is the last of them, so the passes the callbacks add are
+// gated on the phase, which is known by the time the pipeline runs.
+enum class ThinLTOPhase { None, PreLink, Backend };
+
+struct ThinLTOPipeline : ThreadSafeRefCountedBase<ThinLTOPipeline> {
+  bool SawStart = false;
+  bool SawVectorizer = false;
+  ThinLTOPhase getPhase() const {
+    if (SawStart == SawVectorizer) {
+      return ThinLTOPhase::None;
+    }
+    return SawStart ? ThinLTOPhase::PreLink : ThinLTOPhase::Backend;
+  }
+};
+
+// The pipeline being built on this thread. Static, so each plugin only sees
+// its own callbacks
+static inline ThinLTOPipeline *&currentThinLTOPipeline() {
+  static LLVM_THREAD_LOCAL ThinLTOPipeline *Current = nullptr;
+  return Current;
+}
+static inline IntrusiveRefCntPtr<ThinLTOPipeline> getThinLTOPipeline() {
+  ThinLTOPipeline *&Current = currentThinLTOPipeline();
+  if (!Current) {
+    Current = new ThinLTOPipeline();
+    Current->Retain();
+  }
+  return Current;
+}
+// Called from OptimizerLast, the next callback belongs to a new pipeline
+static inline void endThinLTOPipeline() {
+  ThinLTOPipeline *&Current = currentThinLTOPipeline();
+  if (Current) {
+    Current->Release();
+    Current = nullptr;
+  }
+}
+// Called from PipelineStart, which only the first callback of a pipeline is
+static inline void startThinLTOPipeline() {
+  endThinLTOPipeline();
+  getThinLTOPipeline()->SawStart = true;
+}
+
+// Runs its passes only if Filter accepts the phase of the pipeline it was
+// added to
+template <typename IRUnitT>
+class ThinLTOPhaseGate : public PassInfoMixin<ThinLTOPhaseGate<IRUnitT>> {
+public:
+  ThinLTOPhaseGate(PassManager<IRUnitT> PM, bool (*Filter)(ThinLTOPhase))
+      : PM(std::move(PM)), Filter(Filter), Pipeline(getThinLTOPipeline()) {}
+  PreservedAnalyses run(IRUnitT &IR, AnalysisManager<IRUnitT> &AM) {
+    if (!Filter(Pipeline->getPhase())) {
+      return PreservedAnalyses::all();
+    }
+    return PM.run(IR, AM);
+  }
+
+private:
+  PassManager<IRUnitT> PM;
+  bool (*Filter)(ThinLTOPhase);
+  IntrusiveRefCntPtr<ThinLTOPipeline> Pipeline;
+};
+
+template <typename DerivedT>
+class ObfuscationFunctionPass : public PassInfoMixin<DerivedT> {
+public:
+  ObfuscationFunctionPass(FunctionPass *Impl, bool PreservesCFG)
+      : Impl(Impl), PreservesCFG(PreservesCFG), InitializedModule(nullptr) {}
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+    if (F.isDeclaration()) {
+      return PreservedAnalyses::all();
+    }
+    // The legacy PM calls doInitialization once per module
+    if (InitializedModule != F.getParent()) {
+      Impl->doInitialization(*F.getParent());
+      InitializedModule = F.getParent();
+    }
+    bool Changed = Impl->runOnFunction(F);
+    // The legacy PM calls doFinalization once it ran on the last function
+    if (isLastDefinition(F)) {
+      Impl->doFinalization(*F.getParent());
+      InitializedModule = nullptr;
+    }
+    if (!Changed) {
+      return PreservedAnalyses::all();
+    }
+    PreservedAnalyses PA;
+    if (PreservesCFG) {
+      PA.preserveSet<CFGAnalyses>();
+    }
+    return PA;
+  }
+
+private:
+  shared_ptr<FunctionPass> Impl;
+  static bool isLastDefinition(Function &F) {
+    for (Module::iterator Next = std::next(F.getIterator()),
+                          End = F.getParent()->end();
+         Next != End; ++Next) {
+      if (!Next->isDeclaration()) {
+        return false;
+      }
+    }
+    return true;
+  }
+  bool PreservesCFG;
+  const Module *InitializedModule;
+};
+
+template <typename DerivedT>
+class ObfuscationModulePass : public PassInfoMixin<DerivedT> {
+public:
+  ObfuscationModulePass(ModulePass *Impl) : Impl(Impl) {}
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+    bool Changed = Impl->doInitialization(M);
+    Changed |= Impl->runOnModule(M);
+    Changed |= Impl->doFinalization(M);
+    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+
+private:
+  shared_ptr<ModulePass> Impl;
+};
+} // namespace llvm
+#endif
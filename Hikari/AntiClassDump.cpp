@@ -28,6 +28,8 @@
   This pass only provides thin mode
 */
 
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/Triple.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
@@ -43,7 +45,6 @@
 #include <algorithm>
 #include <cassert>
 #include <cstdlib>
-#include <deque>
 #include <iostream>
 #include <string>
 using namespace llvm;
@@ -51,12 +52,19 @@ using namespace std;
 static cl::opt<bool>
     UseInitialize("acd-use-initialize", cl::init(true), cl::NotHidden,
                   cl::desc("[AntiClassDump]Inject codes to +initialize"));
+static cl::opt<bool> UseMethodTable(
+    "acd-method-table", cl::init(false), cl::NotHidden,
+    cl::desc("[AntiClassDump]Register methods by walking a constant method "
+             "table instead of emitting one runtime call sequence per method"));
 namespace llvm {
 struct AntiClassDump : public ModulePass {
   static char ID;
-  AntiClassDump() : ModulePass(ID) {}
+  Function *MethodTableWalker; // Shared loop used by -acd-method-table
+  AntiClassDump() : ModulePass(ID) { this->MethodTableWalker = NULL; }
   StringRef getPassName() const override { return StringRef("AntiClassDump"); }
   virtual bool doInitialization(Module &M) override {
+    // The walker of a module this object ran on before
+    MethodTableWalker = NULL;
     // Basic Defs
     Triple tri(M.getTargetTriple());
     if (tri.getVendor() != Triple::VendorType::Apple) {
@@ -142,6 +150,7 @@ struct AntiClassDump : public ModulePass {
   }
   bool runOnModule(Module &M) override {
     errs() << "Running AntiClassDump On " << M.getSourceFileName() << "\n";
+    ObfuscationTimeScope Scope("AntiClassDump", M);
     GlobalVariable *OLCGV = M.getGlobalVariable("OBJC_LABEL_CLASS_$", true);
     if (OLCGV == NULL) {
       errs() << "No ObjC Class Found in :" << M.getSourceFileName() << "\n";
@@ -165,12 +174,11 @@ struct AntiClassDump : public ModulePass {
     assert(OBJC_LABEL_CLASS_CDS &&
            "OBJC_LABEL_CLASS_$ Not ConstantArray.Is the target using "
            "unsupported legacy runtime?");
-    vector<string> readyclses; // This is for storing classes that can be used
-                               // in handleClass()
-    deque<string> tmpclses;    // This is temporary storage for classes
-    map<string /*class*/, string /*super class*/> dependency;
-    map<string /*Class*/, GlobalVariable *>
-        GVMapping; // Map ClassName to corresponding GV
+    // Class names are interned as indexes into Classes. Names are StringRefs
+    // into the GV names, which stay alive for the whole pass
+    vector<GlobalVariable *> Classes;
+    StringMap<unsigned> ClassIndex;
+    vector<StringRef> SuperClassNames;
     for (unsigned i = 0; i < OBJC_LABEL_CLASS_CDS->getNumOperands(); i++) {
       ConstantExpr *clsEXPR =
           dyn_cast<ConstantExpr>(OBJC_LABEL_CLASS_CDS->getOperand(i));
@@ -185,47 +193,60 @@ struct AntiClassDump : public ModulePass {
           (clsCS->getOperand(1) == NULL)
               ? NULL
               : dyn_cast<GlobalVariable>(clsCS->getOperand(1));
-      string supclsName = "";
-      string clsName = CEGV->getName().str();
-      clsName.replace(clsName.find("OBJC_CLASS_$_"), strlen("OBJC_CLASS_$_"),
-                      "");
-
-      if (SuperClassGV !=
-          NULL) { // We need to handle Classed that doesn't have a base
-        supclsName = SuperClassGV->getName().str();
-        supclsName.replace(supclsName.find("OBJC_CLASS_$_"),
-                           strlen("OBJC_CLASS_$_"), "");
-      }
-      dependency[clsName] = supclsName;
-      GVMapping[clsName] = CEGV;
-      if (supclsName == "" /*NULL Super Class*/ ||
-          (SuperClassGV != NULL &&
-           !SuperClassGV->hasInitializer() /*External Super Class*/)) {
-        readyclses.push_back(clsName);
-      } else {
-        tmpclses.push_back(clsName);
+      StringRef clsName = CEGV->getName();
+      clsName = clsName.substr(clsName.find("OBJC_CLASS_$_") +
+                               strlen("OBJC_CLASS_$_"));
+      StringRef supclsName = "";
+      // Classes without a base or with an external base don't depend on
+      // anything in this module
+      if (SuperClassGV != NULL && SuperClassGV->hasInitializer()) {
+        supclsName = SuperClassGV->getName();
+        supclsName = supclsName.substr(supclsName.find("OBJC_CLASS_$_") +
+                                       strlen("OBJC_CLASS_$_"));
       }
+      ClassIndex[clsName] = Classes.size();
+      Classes.push_back(CEGV);
+      SuperClassNames.push_back(supclsName);
     }
     // Sort Initialize Sequence Based On Dependency
-    while (tmpclses.size() > 0) {
-      string clstmp = tmpclses.front();
-      tmpclses.pop_front();
-      string SuperClassName = dependency[clstmp];
-      if (SuperClassName != "" &&
-          std::find(readyclses.begin(), readyclses.end(), SuperClassName) ==
-              readyclses.end()) {
-        // SuperClass is unintialized non-null class.Push back and waiting until
-        // baseclass is allocated
-        tmpclses.push_back(clstmp);
+    // Kahn's algorithm: a class becomes ready once its superclass is handled
+    vector<SmallVector<unsigned, 2>> SubClasses(Classes.size());
+    vector<unsigned> readyclses;
+    readyclses.reserve(Classes.size());
+    for (unsigned i = 0; i < Classes.size(); i++) {
+      StringMap<unsigned>::iterator Super =
+          SuperClassNames[i].empty() ? ClassIndex.end()
+                                     : ClassIndex.find(SuperClassNames[i]);
+      if (Super == ClassIndex.end()) {
+        readyclses.push_back(i);
       } else {
-        // BaseClass Ready. Push into ReadyClasses
-        readyclses.push_back(clstmp);
+        SubClasses[Super->second].push_back(i);
+      }
+    }
+    for (unsigned i = 0; i < readyclses.size(); i++) {
+      for (unsigned SubClass : SubClasses[readyclses[i]]) {
+        readyclses.push_back(SubClass);
       }
     }
+    // Classes on a superclass cycle never become ready, the runtime would
+    // reject them anyway
+    if (readyclses.size() != Classes.size()) {
+      vector<bool> Ready(Classes.size(), false);
+      for (unsigned Index : readyclses) {
+        Ready[Index] = true;
+      }
+      errs() << "Circular ObjC Class Hierarchy, AntiClassDump skips:";
+      for (unsigned i = 0; i < Classes.size(); i++) {
+        if (!Ready[i]) {
+          errs() << " " << Classes[i]->getName();
+        }
+      }
+      errs() << "\n";
+    }
 
     // Now run handleClass for each class
-    for (string className : readyclses) {
-      handleClass(GVMapping[className], &M);
+    for (unsigned Index : readyclses) {
+      handleClass(Classes[Index], &M);
     }
     return true;
   } // runOnModule
@@ -521,6 +542,15 @@ struct AntiClassDump : public ModulePass {
         }
         ConstantArray *methodList =
             cast<ConstantArray>(methodListStruct->getOperand(2));
+        if (UseMethodTable) {
+          Value *Target = Class;
+          if (isMetaClass) {
+            CallInst *className = IRB->CreateCall(class_getName, {Class});
+            Target = IRB->CreateCall(objc_getMetaClass, {className});
+          }
+          EmitMethodTable(methodList, IRB, M, Target);
+          continue;
+        }
         for (unsigned i = 0; i < methodList->getNumOperands(); i++) {
           ConstantStruct *methodStruct =
               cast<ConstantStruct>(methodList->getOperand(i));
@@ -552,6 +582,79 @@ struct AntiClassDump : public ModulePass {
       }
     }
   }
+  // Copy methodList into a private constant table and register it with one
+  // call to the shared walker, so code size stays constant per method list
+  void EmitMethodTable(ConstantArray *methodList, IRBuilder<> *IRB, Module *M,
+                       Value *Class) {
+    ArrayType *TableType = methodList->getType();
+    StructType *objc_method_type =
+        cast<StructType>(TableType->getElementType());
+    GlobalVariable *Table = new GlobalVariable(
+        *M, TableType, true, GlobalValue::LinkageTypes::PrivateLinkage,
+        methodList, "ACDMethodTable");
+    Constant *Zero = ConstantInt::get(Type::getInt32Ty(M->getContext()), 0);
+    Constant *TablePtr = ConstantExpr::getInBoundsGetElementPtr(
+        TableType, Table, ArrayRef<Constant *>({Zero, Zero}));
+    Constant *Count = ConstantInt::get(Type::getInt32Ty(M->getContext()),
+                                       TableType->getNumElements());
+    IRB->CreateCall(GetMethodTableWalker(M, objc_method_type),
+                    {Class, TablePtr, Count});
+  }
+  /*
+    void ACDMethodTableWalker(Class cls, objc_method *table, int count) {
+      for (int i = 0; i < count; i++)
+        class_replaceMethod(cls, sel_registerName(table[i].name),
+                            table[i].imp, table[i].types);
+    }
+  */
+  Function *GetMethodTableWalker(Module *M, StructType *objc_method_type) {
+    if (MethodTableWalker != NULL) {
+      return MethodTableWalker;
+    }
+    Function *sel_registerName = M->getFunction("sel_registerName");
+    Function *class_replaceMethod = M->getFunction("class_replaceMethod");
+    Type *Int8PtrTy = Type::getInt8PtrTy(M->getContext());
+    Type *Int32Ty = Type::getInt32Ty(M->getContext());
+    FunctionType *WalkerType = FunctionType::get(
+        Type::getVoidTy(M->getContext()),
+        {Int8PtrTy, objc_method_type->getPointerTo(), Int32Ty}, false);
+    MethodTableWalker =
+        Function::Create(WalkerType, GlobalValue::LinkageTypes::PrivateLinkage,
+                         "ACDMethodTableWalker", M);
+    Function::arg_iterator Args = MethodTableWalker->arg_begin();
+    Value *Class = &*Args++;
+    Value *Table = &*Args++;
+    Value *Count = &*Args++;
+    BasicBlock *Entry =
+        BasicBlock::Create(M->getContext(), "", MethodTableWalker);
+    BasicBlock *Loop =
+        BasicBlock::Create(M->getContext(), "", MethodTableWalker);
+    BasicBlock *Exit =
+        BasicBlock::Create(M->getContext(), "", MethodTableWalker);
+    IRBuilder<> IRB(Entry);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Count, ConstantInt::get(Int32Ty, 0)),
+                     Exit, Loop);
+    IRB.SetInsertPoint(Loop);
+    PHINode *Index = IRB.CreatePHI(Int32Ty, 2);
+    Index->addIncoming(ConstantInt::get(Int32Ty, 0), Entry);
+    // %struct._objc_method = type { i8* name, i8* types, i8* imp }
+    Value *Method = IRB.CreateInBoundsGEP(objc_method_type, Table, Index);
+    Value *Fields[3];
+    for (unsigned i = 0; i < 3; i++) {
+      Value *FieldPtr = IRB.CreateStructGEP(objc_method_type, Method, i);
+      Fields[i] = IRB.CreateLoad(objc_method_type->getElementType(i), FieldPtr);
+    }
+    CallInst *SEL = IRB.CreateCall(sel_registerName, {Fields[0]});
+    Value *IMP = IRB.CreateBitCast(
+        Fields[2], class_replaceMethod->getFunctionType()->getParamType(2));
+    IRB.CreateCall(class_replaceMethod, {Class, SEL, IMP, Fields[1]});
+    Value *Next = IRB.CreateAdd(Index, ConstantInt::get(Int32Ty, 1));
+    Index->addIncoming(Next, Loop);
+    IRB.CreateCondBr(IRB.CreateICmpEQ(Next, Count), Exit, Loop);
+    IRB.SetInsertPoint(Exit);
+    IRB.CreateRetVoid();
+    return MethodTableWalker;
+  }
   void HandlePropertyIvar(ConstantStruct *class_ro, IRBuilder<> *IRB, Module *M,
                           Value *Class) {
     StructType *objc_property_attribute_t_type = reinterpret_cast<StructType *>(
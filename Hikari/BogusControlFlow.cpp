@@ -110,6 +110,7 @@
 
 #include "Transforms/Obfuscation/BogusControlFlow.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/NoFolder.h"
 #include "llvm/Support/TargetSelect.h"
 #include "Transforms/Obfuscation/Utils.h"
@@ -183,6 +184,12 @@ namespace {
 struct BogusControlFlow : public FunctionPass {
   static char ID; // Pass identification
   bool flag;
+  // The function being obfuscated has branch weights, so the always true
+  // branches get some as well
+  bool profiled = false;
+  // -bcf_prob, -bcf_loop and -bcf_cond_compl for the function being
+  // obfuscated, -hikari-policy may set them per function
+  int probRate = defaultObfRate, loops = defaultObfTime, condComplexity = 3;
   BogusControlFlow() : FunctionPass(ID) { this->flag = true; }
   BogusControlFlow(bool flag) : FunctionPass(ID) { this->flag = flag; }
   /* runOnFunction
@@ -191,14 +198,18 @@ struct BogusControlFlow : public FunctionPass {
    * to the function. See header for more details.
    */
   bool runOnFunction(Function &F) override {
+    probRate = obfuscationParameter(&F, "bcf_prob", ObfProbRate);
+    loops = obfuscationParameter(&F, "bcf_loop", ObfTimes);
+    condComplexity = obfuscationParameter(&F, "bcf_cond_compl",
+                                          ConditionExpressionComplexity);
     // Check if the percentage is correct
-    if (ObfTimes <= 0) {
+    if (loops <= 0) {
       errs() << "BogusControlFlow application number -bcf_loop=x must be x > 0";
       return false;
     }
 
     // Check if the number of applications is correct
-    if (!((ObfProbRate > 0) && (ObfProbRate <= 100))) {
+    if (!((probRate > 0) && (probRate <= 100))) {
       errs() << "BogusControlFlow application basic blocks percentage "
                 "-bcf_prob=x must be 0 < x <= 100";
       return false;
@@ -206,8 +217,10 @@ struct BogusControlFlow : public FunctionPass {
     // If fla annotations
     if (toObfuscate(flag, &F, "bcf")) {
       errs() << "Running BogusControlFlow On " << F.getName() << "\n";
+      ObfuscationTimeScope Scope("BogusControlFlow", F);
+      profiled = hasProfileData(F);
       bogus(F);
-      doF(*F.getParent());
+      doF(*F.getParent(), F);
       return true;
     }
 
@@ -223,25 +236,25 @@ struct BogusControlFlow : public FunctionPass {
     DEBUG_WITH_TYPE("opt", errs() << "bcf: Started on function " << F.getName()
                                   << "\n");
     DEBUG_WITH_TYPE("opt",
-                    errs() << "bcf: Probability rate: " << ObfProbRate << "\n");
-    if (ObfProbRate < 0 || ObfProbRate > 100) {
+                    errs() << "bcf: Probability rate: " << probRate << "\n");
+    if (probRate < 0 || probRate > 100) {
       DEBUG_WITH_TYPE("opt", errs()
                                  << "bcf: Incorrect value,"
                                  << " probability rate set to default value: "
                                  << defaultObfRate << " \n");
-      ObfProbRate = defaultObfRate;
+      probRate = defaultObfRate;
     }
     DEBUG_WITH_TYPE("opt", errs()
-                               << "bcf: How many times: " << ObfTimes << "\n");
-    if (ObfTimes <= 0) {
+                               << "bcf: How many times: " << loops << "\n");
+    if (loops <= 0) {
       DEBUG_WITH_TYPE("opt", errs()
                                  << "bcf: Incorrect value,"
                                  << " must be greater than 1. Set to default: "
                                  << defaultObfTime << " \n");
-      ObfTimes = defaultObfTime;
+      loops = defaultObfTime;
     }
-    NumTimesOnFunctions = ObfTimes;
-    int NumObfTimes = ObfTimes;
+    NumTimesOnFunctions = loops;
+    int NumObfTimes = loops;
 
     // Real begining of the pass
     // Loop for the number of time we run the pass on the function
@@ -263,7 +276,7 @@ struct BogusControlFlow : public FunctionPass {
       while (!basicBlocks.empty()) {
         NumBasicBlocks++;
         // Basic Blocks' selection
-        if ((int)llvm::cryptoutils->get_range(100) <= ObfProbRate) {
+        if ((int)llvm::cryptoutils->get_range(100) <= probRate) {
           DEBUG_WITH_TYPE("opt", errs() << "bcf: Block " << NumBasicBlocks
                                         << " selected. \n");
           hasBeenModified = true;
@@ -332,6 +345,8 @@ struct BogusControlFlow : public FunctionPass {
     // Now that all the blocks are created,
     // we modify the terminators to adjust the control flow.
 
+    DebugLoc alteredLoc = alteredBB->getTerminator()->getDebugLoc();
+    DebugLoc splitLoc = basicBlock->getTerminator()->getDebugLoc();
     alteredBB->getTerminator()->eraseFromParent();
     basicBlock->getTerminator()->eraseFromParent();
     DEBUG_WITH_TYPE("gen", errs() << "bcf: Terminator removed from the altered"
@@ -348,17 +363,20 @@ struct BogusControlFlow : public FunctionPass {
     Twine *var4 = new Twine("condition");
     FCmpInst *condition =
         new FCmpInst(*basicBlock, FCmpInst::FCMP_TRUE, LHS, RHS, *var4);
+    condition->setDebugLoc(splitLoc);
     DEBUG_WITH_TYPE("gen", errs() << "bcf: Always true condition created\n");
 
     // Jump to the original basic block if the condition is true or
     // to the altered block if false.
-    BranchInst::Create(originalBB, alteredBB, (Value *)condition, basicBlock);
+    setAlwaysTaken(BranchInst::Create(originalBB, alteredBB, (Value *)condition,
+                                      basicBlock),
+                   splitLoc);
     DEBUG_WITH_TYPE(
         "gen",
         errs() << "bcf: Terminator instruction in first basic block: ok\n");
 
     // The altered block loop back on the original one.
-    BranchInst::Create(originalBB, alteredBB);
+    BranchInst::Create(originalBB, alteredBB)->setDebugLoc(alteredLoc);
     DEBUG_WITH_TYPE(
         "gen", errs() << "bcf: Terminator instruction in altered block: ok\n");
 
@@ -380,33 +398,50 @@ struct BogusControlFlow : public FunctionPass {
     // the first part go either on the return statement or on the begining
     // of the altered block.. So we erase the terminator created when splitting.
     originalBB->getTerminator()->eraseFromParent();
+    DebugLoc termLoc = originalBBpart2->getTerminator()->getDebugLoc();
     // We add at the end a new always true condition
     Twine *var6 = new Twine("condition2");
     FCmpInst *condition2 =
         new FCmpInst(*originalBB, CmpInst::FCMP_TRUE, LHS, RHS, *var6);
+    condition2->setDebugLoc(termLoc);
     // BranchInst::Create(originalBBpart2, alteredBB, (Value
     // *)condition2,originalBB);  Do random behavior to avoid pattern
     // recognition This is achieved by jumping to a random BB
+    BranchInst *br2;
     switch (llvm::cryptoutils->get_uint16_t() % 2) {
     case 0: {
-      BranchInst::Create(originalBBpart2, originalBB, condition2, originalBB);
+      br2 =
+          BranchInst::Create(originalBBpart2, originalBB, condition2, originalBB);
       break;
     }
     case 1: {
-      BranchInst::Create(originalBBpart2, alteredBB, condition2, originalBB);
+      br2 =
+          BranchInst::Create(originalBBpart2, alteredBB, condition2, originalBB);
       break;
     }
     default: {
-      BranchInst::Create(originalBBpart2, originalBB, condition2, originalBB);
+      br2 =
+          BranchInst::Create(originalBBpart2, originalBB, condition2, originalBB);
       break;
     }
     }
+    setAlwaysTaken(br2, termLoc);
     DEBUG_WITH_TYPE("gen", errs()
                                << "bcf: Terminator original basic block: ok\n");
     DEBUG_WITH_TYPE("gen", errs() << "bcf: End of addBogusFlow().\n");
 
   } // end of addBogusFlow()
 
+  // The true edge of an always true branch is the only one ever taken. The
+  // weights follow the branch when doF() rewrites its condition.
+  void setAlwaysTaken(BranchInst *BI, DebugLoc Loc) {
+    BI->setDebugLoc(Loc);
+    if (profiled) {
+      BI->setMetadata(LLVMContext::MD_prof,
+                      MDBuilder(BI->getContext()).createBranchWeights(2000, 1));
+    }
+  }
+
   /* createAlteredBasicBlock
    *
    * This function return a basic block similar to a given one.
@@ -666,12 +701,13 @@ struct BogusControlFlow : public FunctionPass {
 
   /* doFinalization
    *
-   * Overwrite FunctionPass method to apply the transformations to the whole
-   * module. This part obfuscate all the always true predicates of the module.
+   * Apply the transformations to the function bogus() just ran on.
+   * This part obfuscate all the always true predicates of the function.
    * More precisely, the condition which predicate is FCMP_TRUE.
-   * It also remove all the functions' basic blocks' and instructions' names.
+   * Only F is scanned: the predicates bogus() created in other functions
+   * were already replaced when it ran on them.
    */
-  bool doF(Module &M) {
+  bool doF(Module &M, Function &F) {
     // In this part we extract all always-true predicate and replace them with
     // opaque predicate: For this, we declare two global values: x and y, and
     // replace the FCMP_TRUE predicate with (y < 10 || x * (x + 1) % 2 == 0) A
@@ -683,32 +719,29 @@ struct BogusControlFlow : public FunctionPass {
     // BinaryOperator *op, *op1 = NULL;
     // ICmpInst *condition, *condition2;
     // Looking for the conditions and branches to transform
-    for (Module::iterator mi = M.begin(), me = M.end(); mi != me; ++mi) {
-      for (Function::iterator fi = mi->begin(), fe = mi->end(); fi != fe;
-           ++fi) {
-        // fi->setName("");
-        Instruction *tbb = fi->getTerminator();
-        if (tbb->getOpcode() == Instruction::Br) {
-          BranchInst *br = (BranchInst *)(tbb);
-          if (br->isConditional()) {
-            FCmpInst *cond = (FCmpInst *)br->getCondition();
-            unsigned opcode = cond->getOpcode();
-            if (opcode == Instruction::FCmp) {
-              if (cond->getPredicate() == FCmpInst::FCMP_TRUE) {
-                DEBUG_WITH_TYPE("gen",
-                                errs() << "bcf: an always true predicate !\n");
-                toDelete.push_back(cond); // The condition
-                toEdit.push_back(tbb);    // The branch using the condition
-              }
+    for (Function::iterator fi = F.begin(), fe = F.end(); fi != fe; ++fi) {
+      // fi->setName("");
+      Instruction *tbb = fi->getTerminator();
+      if (tbb->getOpcode() == Instruction::Br) {
+        BranchInst *br = (BranchInst *)(tbb);
+        if (br->isConditional()) {
+          FCmpInst *cond = (FCmpInst *)br->getCondition();
+          unsigned opcode = cond->getOpcode();
+          if (opcode == Instruction::FCmp) {
+            if (cond->getPredicate() == FCmpInst::FCMP_TRUE) {
+              DEBUG_WITH_TYPE("gen",
+                              errs() << "bcf: an always true predicate !\n");
+              toDelete.push_back(cond); // The condition
+              toEdit.push_back(tbb);    // The branch using the condition
             }
           }
         }
-        /*
-        for (BasicBlock::iterator bi = fi->begin(), be = fi->end() ; bi != be;
-        ++bi){ bi->setName(""); // setting the basic blocks' names
-        }
-        */
       }
+      /*
+      for (BasicBlock::iterator bi = fi->begin(), be = fi->end() ; bi != be;
+      ++bi){ bi->setName(""); // setting the basic blocks' names
+      }
+      */
     }
     // Replacing all the branches we found
     for (std::vector<Instruction *>::iterator i = toEdit.begin();
@@ -730,6 +763,7 @@ struct BogusControlFlow : public FunctionPass {
 
       Instruction *tmp = &*((*i)->getParent()->getFirstInsertionPt());
       IRBuilder<> IRBReal(tmp);
+      IRBReal.SetCurrentDebugLocation((*i)->getDebugLoc());
       IRBuilder<> IRBEmu(EntryBlock);
       // First,Construct a real RHS that will be used in the actual condition
       Constant *RealRHS = ConstantInt::get(I32Ty, cryptoutils->get_uint32_t());
@@ -753,7 +787,7 @@ struct BogusControlFlow : public FunctionPass {
           IRBEmu.CreateBinOp(initialOp, emuLHS, emuRHS, "EmuInitialCondition");
       Value *Last =
           IRBReal.CreateBinOp(initialOp, LHS, RHS, "InitialCondition");
-      for (int i = 0; i < ConditionExpressionComplexity; i++) {
+      for (int i = 0; i < condComplexity; i++) {
         Constant *newTmp = ConstantInt::get(I32Ty, cryptoutils->get_uint32_t());
         Instruction::BinaryOps initialOp =
             ops[llvm::cryptoutils->get_uint32_t() %
@@ -771,18 +805,14 @@ struct BogusControlFlow : public FunctionPass {
       ConstantInt *emuCI = cast<ConstantInt>(RI->getReturnValue());
       uint64_t emulateResult = emuCI->getZExtValue();
       vector<BasicBlock *> BBs; // Start To Prepare IndirectBranching
-      if (emulateResult == 1) {
-        // Our ConstantExpr evaluates to true;
-
-        BranchInst::Create(((BranchInst *)*i)->getSuccessor(0),
-                           ((BranchInst *)*i)->getSuccessor(1), (Value *)Last,
-                           ((BranchInst *)*i)->getParent());
-      } else {
-        // False, swap operands
-
-        BranchInst::Create(((BranchInst *)*i)->getSuccessor(1),
-                           ((BranchInst *)*i)->getSuccessor(0), (Value *)Last,
-                           ((BranchInst *)*i)->getParent());
+      BranchInst *newBr = BranchInst::Create(
+          ((BranchInst *)*i)->getSuccessor(0),
+          ((BranchInst *)*i)->getSuccessor(1), (Value *)Last,
+          ((BranchInst *)*i)->getParent());
+      newBr->copyMetadata(**i, {LLVMContext::MD_prof, LLVMContext::MD_dbg});
+      if (emulateResult != 1) {
+        // False, swap operands. The weights are swapped with them
+        newBr->swapSuccessors();
       }
       EntryBlock->eraseFromParent();
       emuFunction->eraseFromParent();
@@ -801,11 +831,8 @@ struct BogusControlFlow : public FunctionPass {
     // Only for debug
     DEBUG_WITH_TYPE("cfg", errs() << "bcf: End of the pass, here are the "
                                      "graphs after doFinalization\n");
-    for (Module::iterator mi = M.begin(), me = M.end(); mi != me; ++mi) {
-      DEBUG_WITH_TYPE("cfg", errs()
-                                 << "bcf: Function " << mi->getName() << "\n");
-      DEBUG_WITH_TYPE("cfg", mi->viewCFG());
-    }
+    DEBUG_WITH_TYPE("cfg", errs() << "bcf: Function " << F.getName() << "\n");
+    DEBUG_WITH_TYPE("cfg", F.viewCFG());
 
     return true;
   } // end of doFinalization
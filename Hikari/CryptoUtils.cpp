@@ -549,6 +549,7 @@ bool CryptoUtils::prng_seed(const std::string _seed) {
     return false;
   }
 
+  std::lock_guard<std::mutex> Guard(PoolLock);
   seed = _seed;
 
   if (_seed.size() == 34) {
@@ -657,6 +658,7 @@ void CryptoUtils::get_bytes(char *buffer, const int len) {
   assert(len > 0 && "CryptoUtils::get_bytes len <= 0");
 
   statsGetBytes++;
+  std::lock_guard<std::mutex> Guard(PoolLock);
 
   if (len > 0) {
 
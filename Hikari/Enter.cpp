@@ -3,12 +3,26 @@
 //
 
 #include "Transforms/Obfuscation/Obfuscation.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 using namespace llvm;
 
-static void registerHikariModulePass(const PassManagerBuilder &,
+// Make the passes reachable from `opt -load` by their INITIALIZE_PASS names.
+// The scheduler depends on every other pass, so this registers all of them
+static struct RegisterHikariPasses {
+    RegisterHikariPasses() {
+        initializeObfuscationPass(*PassRegistry::getPassRegistry());
+    }
+} HikariPasses;
+
+static bool isHikariPhase(const PassManagerBuilder &Builder);
+
+static void registerHikariModulePass(const PassManagerBuilder &Builder,
                               legacy::PassManagerBase &PM) {
+    if (!isHikariPhase(Builder)) {
+        return;
+    }
 //    PM.add(createFunctionWrapperPass(true)); /*broken*/
     PM.add(createStringEncryptionPass(true));
 
@@ -17,9 +31,6 @@ static void registerHikariModulePass(const PassManagerBuilder &,
 static void registerHikariFunctionPass(const PassManagerBuilder &,
                               legacy::PassManagerBase &PM) {
     PM.add(createBogusControlFlowPass(true));
-#if LLVM_VERSION_MAJOR >= 9
-    PM.add(createLowerSwitchPass());
-#endif
     PM.add(createFlatteningPass(true));
     PM.add(createFunctionCallObfuscatePass(true));
     PM.add(createIndirectBranchPass(true));
@@ -27,6 +38,86 @@ static void registerHikariFunctionPass(const PassManagerBuilder &,
     PM.add(createSubstitutionPass(true));
 }
 
+enum ObfuscationExtensionPoint {
+    EP_Early,
+    EP_ScalarLate,
+    EP_Last,
+    EP_LTOLate
+};
+static cl::opt<ObfuscationExtensionPoint> HikariExtensionPoint(
+        "hikari-ep", cl::init(EP_Early),
+        cl::desc("[Hikari]Where the function obfuscation passes run"),
+        cl::values(
+                clEnumValN(EP_Early, "early",
+                           "Before any optimization, so the optimizer can "
+                           "undo some of it (default)"),
+                clEnumValN(EP_ScalarLate, "scalar-late",
+                           "After the scalar optimizations, before "
+                           "vectorization and unrolling"),
+                clEnumValN(EP_Last, "optimizer-last",
+                           "After the whole per-TU optimization pipeline"),
+                clEnumValN(EP_LTOLate, "lto-late",
+                           "At the end of full LTO, nothing runs per TU")));
+
+enum ObfuscationThinLTOPhase {
+    Phase_PreLink,
+    Phase_Backend
+};
+static cl::opt<ObfuscationThinLTOPhase> HikariThinLTOPhase(
+        "hikari-thinlto", cl::init(Phase_PreLink),
+        cl::desc("[Hikari]Where ThinLTO builds are obfuscated"),
+        cl::values(
+                clEnumValN(Phase_PreLink, "prelink",
+                           "When each TU is compiled (default)"),
+                clEnumValN(Phase_Backend, "backend",
+                           "In the ThinLTO backends, after importing. The "
+                           "plugin has to be loaded by the linker")));
+
+// Both ThinLTO phases reach most extension points, so without this check
+// the passes would run twice. Builds without ThinLTO have one phase.
+static bool isHikariPhase(const PassManagerBuilder &Builder) {
+    if (Builder.PrepareForThinLTO) {
+        return HikariThinLTOPhase == Phase_PreLink;
+    }
+    if (Builder.PerformThinLTO) {
+        return HikariThinLTOPhase == Phase_Backend;
+    }
+    return true;
+}
+
+// Registered at every candidate extension point, only the selected one adds
+// the passes. Options are parsed by the time the pipeline is populated.
+template <ObfuscationExtensionPoint EP>
+static void registerHikariFunctionPassAt(const PassManagerBuilder &Builder,
+                              legacy::PassManagerBase &PM) {
+    if (HikariExtensionPoint == EP && isHikariPhase(Builder)) {
+        registerHikariFunctionPass(Builder, PM);
+    }
+}
+
+// ThinLTO backends don't run EP_EarlyAsPossible, the module optimizer is
+// the earliest point after importing
+static bool isEarlyInBackend(const PassManagerBuilder &Builder) {
+    return Builder.PerformThinLTO && HikariExtensionPoint == EP_Early;
+}
+
+static void registerHikariFunctionPassThinLTOEarly(const PassManagerBuilder &Builder,
+                              legacy::PassManagerBase &PM) {
+    if (isEarlyInBackend(Builder) && isHikariPhase(Builder)) {
+        registerHikariFunctionPass(Builder, PM);
+    }
+}
+
+// -O0 pipelines only run EP_EarlyAsPossible and EP_EnabledOnOptLevel0
+static void registerHikariFunctionPassO0(const PassManagerBuilder &Builder,
+                              legacy::PassManagerBase &PM) {
+    if ((HikariExtensionPoint == EP_ScalarLate ||
+         HikariExtensionPoint == EP_Last || isEarlyInBackend(Builder)) &&
+        isHikariPhase(Builder)) {
+        registerHikariFunctionPass(Builder, PM);
+    }
+}
+
 static RegisterStandardPasses
         RegisterMyPass(PassManagerBuilder::EP_EnabledOnOptLevel0,
                        registerHikariModulePass);
@@ -35,4 +126,244 @@ static RegisterStandardPasses
                         registerHikariModulePass);
 static RegisterStandardPasses
         RegisterMyPass1(PassManagerBuilder::EP_EarlyAsPossible,
-                        registerHikariFunctionPass);
\ No newline at end of file
+                       registerHikariFunctionPassAt<EP_Early>);
+static RegisterStandardPasses
+        RegisterMyPass2(PassManagerBuilder::EP_ScalarOptimizerLate,
+                        registerHikariFunctionPassAt<EP_ScalarLate>);
+static RegisterStandardPasses
+        RegisterMyPass3(PassManagerBuilder::EP_OptimizerLast,
+                        registerHikariFunctionPassAt<EP_Last>);
+static RegisterStandardPasses
+        RegisterMyPass4(PassManagerBuilder::EP_FullLinkTimeOptimizationLast,
+                        registerHikariFunctionPassAt<EP_LTOLate>);
+static RegisterStandardPasses
+        RegisterMyPass5(PassManagerBuilder::EP_EnabledOnOptLevel0,
+                        registerHikariFunctionPassO0);
+static RegisterStandardPasses
+        RegisterMyPass6(PassManagerBuilder::EP_ModuleOptimizerEarly,
+                        registerHikariFunctionPassThinLTOEarly);
+
+#if __has_include("llvm/Passes/PassPlugin.h")
+// New pass manager entry point, used with -fpass-plugin / opt -load-pass-plugin
+#include "Transforms/Obfuscation/NewPassManager.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+struct BogusControlFlowPass
+    : ObfuscationFunctionPass<BogusControlFlowPass> {
+    BogusControlFlowPass()
+        : ObfuscationFunctionPass(createBogusControlFlowPass(true), false) {}
+};
+struct FlatteningPass : ObfuscationFunctionPass<FlatteningPass> {
+    FlatteningPass()
+        : ObfuscationFunctionPass(createFlatteningPass(true), false) {}
+};
+struct FunctionCallObfuscatePass
+    : ObfuscationFunctionPass<FunctionCallObfuscatePass> {
+    FunctionCallObfuscatePass()
+        : ObfuscationFunctionPass(createFunctionCallObfuscatePass(true),
+                                  true) {}
+};
+struct IndirectBranchPass : ObfuscationFunctionPass<IndirectBranchPass> {
+    IndirectBranchPass()
+        : ObfuscationFunctionPass(createIndirectBranchPass(true), false) {}
+};
+struct SplitBasicBlockPass : ObfuscationFunctionPass<SplitBasicBlockPass> {
+    SplitBasicBlockPass()
+        : ObfuscationFunctionPass(createSplitBasicBlockPass(true), false) {}
+};
+struct SubstitutionPass : ObfuscationFunctionPass<SubstitutionPass> {
+    SubstitutionPass()
+        : ObfuscationFunctionPass(createSubstitutionPass(true), true) {}
+    // -sub_cost_model uses the target's cost model
+    void prepare(Function &F, FunctionAnalysisManager &AM) {
+        setSubstitutionTTI(Impl.get(),
+                           [&AM](Function &F) -> TargetTransformInfo & {
+                               return AM.getResult<TargetIRAnalysis>(F);
+                           });
+    }
+};
+struct StringEncryptionPass : ObfuscationModulePass<StringEncryptionPass> {
+    StringEncryptionPass()
+        : ObfuscationModulePass(createStringEncryptionPass(true)) {}
+};
+struct FunctionWrapperPass : ObfuscationModulePass<FunctionWrapperPass> {
+    FunctionWrapperPass()
+        : ObfuscationModulePass(createFunctionWrapperPass(true)) {}
+};
+struct AntiClassDumpPass : ObfuscationModulePass<AntiClassDumpPass> {
+    AntiClassDumpPass() : ObfuscationModulePass(createAntiClassDumpPass()) {}
+};
+struct HikariSchedulerPass : ObfuscationModulePass<HikariSchedulerPass> {
+    HikariSchedulerPass() : ObfuscationModulePass(createObfuscationPass()) {}
+    // Substitution's -sub_cost_model uses the target's cost model, and the
+    // passes share the pipeline's function analyses
+    void prepare(Module &M, ModuleAnalysisManager &AM) {
+        FunctionAnalysisManager &FAM =
+            AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        setObfuscationTTI(Impl.get(),
+                          [&FAM](Function &F) -> TargetTransformInfo & {
+                              return FAM.getResult<TargetIRAnalysis>(F);
+                          });
+        setObfuscationAnalyses(Impl.get(), getAnalysisGetters(FAM));
+    }
+};
+} // namespace
+
+// Same passes and order as registerHikariFunctionPass
+static void addHikariFunctionPasses(FunctionPassManager &FPM) {
+    FPM.addPass(BogusControlFlowPass());
+    FPM.addPass(FlatteningPass());
+    FPM.addPass(FunctionCallObfuscatePass());
+    FPM.addPass(IndirectBranchPass());
+    FPM.addPass(SplitBasicBlockPass());
+    FPM.addPass(SubstitutionPass());
+}
+
+// -hikari-thinlto for the new pass manager, see ThinLTOPhaseGate
+static bool isHikariPhase(ThinLTOPhase Phase) {
+    if (Phase == ThinLTOPhase::PreLink) {
+        return HikariThinLTOPhase == Phase_PreLink;
+    }
+    if (Phase == ThinLTOPhase::Backend) {
+        return HikariThinLTOPhase == Phase_Backend;
+    }
+    return true;
+}
+
+// ThinLTO backends don't run PipelineStart, early simplification is the
+// earliest point after importing
+static bool isEarlyInBackend(ThinLTOPhase Phase) {
+    return Phase == ThinLTOPhase::Backend &&
+           HikariThinLTOPhase == Phase_Backend;
+}
+
+static void addHikariFunctionPassesAt(ModulePassManager &MPM,
+                                      bool (*Filter)(ThinLTOPhase)) {
+    FunctionPassManager FPM;
+    addHikariFunctionPasses(FPM);
+    ModulePassManager Passes;
+    Passes.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+    MPM.addPass(ThinLTOPhaseGate<Module>(std::move(Passes), Filter));
+}
+
+#if LLVM_VERSION_MAJOR < 15
+// The new pass manager has no full LTO extension point before LLVM 15.
+// lto-late runs the passes at optimizer-last there instead of leaving every
+// function unobfuscated
+static bool fallBackFromLTOLate() {
+    if (HikariExtensionPoint != EP_LTOLate) {
+        return false;
+    }
+    static bool Warned = false;
+    if (!Warned) {
+        errs() << "warning: -hikari-ep=lto-late needs LLVM 15 with the new "
+                  "pass manager, running the passes at optimizer-last\n";
+        Warned = true;
+    }
+    return true;
+}
+#endif
+
+static void registerHikariPassBuilderCallbacks(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, FunctionPassManager &FPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "hikari-bcf") {
+                FPM.addPass(BogusControlFlowPass());
+            } else if (Name == "hikari-fla") {
+                FPM.addPass(FlatteningPass());
+            } else if (Name == "hikari-fco") {
+                FPM.addPass(FunctionCallObfuscatePass());
+            } else if (Name == "hikari-indibr") {
+                FPM.addPass(IndirectBranchPass());
+            } else if (Name == "hikari-split") {
+                FPM.addPass(SplitBasicBlockPass());
+            } else if (Name == "hikari-sub") {
+                FPM.addPass(SubstitutionPass());
+            } else {
+                return false;
+            }
+            return true;
+        });
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "hikari-strenc") {
+                MPM.addPass(StringEncryptionPass());
+            } else if (Name == "hikari-funcwra") {
+                MPM.addPass(FunctionWrapperPass());
+            } else if (Name == "hikari-acd") {
+                MPM.addPass(AntiClassDumpPass());
+            } else if (Name == "hikari") {
+                MPM.addPass(HikariSchedulerPass());
+            } else {
+                return false;
+            }
+            return true;
+        });
+#if LLVM_VERSION_MAJOR >= 12
+    PB.registerPipelineStartEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+#else
+    PB.registerPipelineStartEPCallback([](ModulePassManager &MPM) {
+#endif
+            startThinLTOPipeline();
+            if (HikariExtensionPoint == EP_Early) {
+                addHikariFunctionPassesAt(MPM, isHikariPhase);
+            }
+        });
+#if LLVM_VERSION_MAJOR >= 12
+    PB.registerPipelineEarlySimplificationEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+            if (HikariExtensionPoint == EP_Early) {
+                addHikariFunctionPassesAt(MPM, isEarlyInBackend);
+            }
+        });
+#endif
+    PB.registerScalarOptimizerLateEPCallback(
+        [](FunctionPassManager &FPM, ObfuscationOptLevel) {
+            if (HikariExtensionPoint == EP_ScalarLate) {
+                FunctionPassManager Passes;
+                addHikariFunctionPasses(Passes);
+                FPM.addPass(ThinLTOPhaseGate<Function>(std::move(Passes),
+                                                       isHikariPhase));
+            }
+        });
+    PB.registerVectorizerStartEPCallback(
+        [](FunctionPassManager &, ObfuscationOptLevel) {
+            getThinLTOPipeline()->SawVectorizer = true;
+        });
+    PB.registerOptimizerLastEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+#if LLVM_VERSION_MAJOR >= 15
+            if (HikariExtensionPoint == EP_Last) {
+#else
+            if (HikariExtensionPoint == EP_Last || fallBackFromLTOLate()) {
+#endif
+                addHikariFunctionPassesAt(MPM, isHikariPhase);
+            }
+            ModulePassManager Passes;
+            Passes.addPass(StringEncryptionPass());
+            MPM.addPass(ThinLTOPhaseGate<Module>(std::move(Passes),
+                                                 isHikariPhase));
+            endThinLTOPipeline();
+        });
+#if LLVM_VERSION_MAJOR >= 15
+    PB.registerFullLinkTimeOptimizationLastEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+            if (HikariExtensionPoint == EP_LTOLate) {
+                FunctionPassManager FPM;
+                addHikariFunctionPasses(FPM);
+                MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+            }
+        });
+#endif
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "Hikari", LLVM_VERSION_STRING,
+            registerHikariPassBuilderCallbacks};
+}
+#endif
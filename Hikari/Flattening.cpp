@@ -13,6 +13,9 @@
 
 #include "Transforms/Obfuscation/Obfuscation.h"
 #include "Transforms/Obfuscation/CryptoUtils.h"
+#include "Transforms/Obfuscation/FlattenSwitch.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include <fcntl.h>
 #include <sys/stat.h>
 
@@ -22,6 +25,16 @@ using namespace llvm;
 
 // Stats
 STATISTIC(Flattened, "Functions flattened");
+STATISTIC(FlattenedRegions, "Regions flattened");
+
+static cl::opt<bool> RegionFlattening(
+    "fla_region", cl::init(false),
+    cl::desc("Flatten each loop body and each acyclic region with its own "
+             "dispatcher, keeping loop headers and latches"));
+static cl::opt<unsigned> Dispatchers(
+    "fla_dispatchers", cl::init(1),
+    cl::desc("Split the states of a flattened function between this many "
+             "dispatchers, each one a separate indirect branch"));
 
 namespace {
 struct Flattening : public FunctionPass {
@@ -31,6 +44,9 @@ struct Flattening : public FunctionPass {
   Flattening(bool flag) : FunctionPass(ID) { this->flag = flag; }
   bool runOnFunction(Function &F);
   bool flatten(Function *f);
+  bool flattenRegions(Function *f);
+  void flattenRegion(Function *f, ArrayRef<BasicBlock *> region,
+                     const ProfileCounts &counts);
 };
 } // namespace
 
@@ -46,14 +62,33 @@ bool Flattening::runOnFunction(Function &F) {
   // Do we obfuscate
   if (toObfuscate(flag, tmp, "fla")) {
     errs() << "Running ControlFlowFlattening On " << F.getName() << "\n";
-    if (flatten(tmp)) {
+    ObfuscationTimeScope Scope("Flattening", F);
+    if (RegionFlattening ? flattenRegions(tmp) : flatten(tmp)) {
       ++Flattened;
+      return true;
     }
   }
 
   return false;
 }
 
+// Exception handling and terminators other than these can't be rewritten to
+// go through a dispatcher
+static bool canFlatten(Function *f) {
+  for (BasicBlock &BB : *f) {
+    if (BB.isEHPad() || BB.isLandingPad()) {
+          errs()<<f->getName()<<" Contains Exception Handing Instructions and is unsupported for flattening in the open-source version of Hikari.\n";
+          return false;
+    }
+    Instruction *term = BB.getTerminator();
+    if (!isa<BranchInst>(term) && !isa<SwitchInst>(term) &&
+        !isa<ReturnInst>(term) && !isa<UnreachableInst>(term)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool Flattening::flatten(Function *f) {
   vector<BasicBlock *> origBB;
   BasicBlock *loopEntry;
@@ -67,27 +102,17 @@ bool Flattening::flatten(Function *f) {
   llvm::cryptoutils->get_bytes(scrambling_key, 16);
   // END OF SCRAMBLER
 
-#if LLVM_VERSION_MAJOR >= 9
-    // >=9.0, LowerSwitchPass depends on LazyValueInfoWrapperPass, which cause AssertError.
-    // So I move LowerSwitchPass into register function, just before FlatteningPass.
-#else
-  FunctionPass *lower = createLowerSwitchPass();
-  lower->runOnFunction(*f);
-#endif
+  if (!canFlatten(f)) {
+    return false;
+  }
+  // Taken before the CFG changes, the dispatchers are weighted with these
+  FunctionAnalyses FA(*f);
+  ProfileCounts counts(*f, FA);
+  DebugLoc dispatcherLoc = artificialDebugLoc(*f);
 
   // Save all original BB
   for (Function::iterator i = f->begin(); i != f->end(); ++i) {
-    BasicBlock *tmp = &*i;
-    if (tmp->isEHPad() || tmp->isLandingPad()) {
-          errs()<<f->getName()<<" Contains Exception Handing Instructions and is unsupported for flattening in the open-source version of Hikari.\n";
-          return false;
-    }
-    origBB.push_back(tmp);
-
-    BasicBlock *bb = &*i;
-    if (!isa<BranchInst>(bb->getTerminator())) {
-      return false;
-    }
+    origBB.push_back(&*i);
   }
 
   // Nothing to flatten
@@ -119,9 +144,11 @@ bool Flattening::flatten(Function *f) {
 
     BasicBlock *tmpBB = insert->splitBasicBlock(i, "first");
     origBB.insert(origBB.begin(), tmpBB);
+    counts.setBlock(tmpBB, counts.block(insert));
   }
 
   // Remove jump
+  DebugLoc entryLoc = insert->getTerminator()->getDebugLoc();
   insert->getTerminator()->eraseFromParent();
 
   // Create switch variable and set as it
@@ -131,117 +158,152 @@ bool Flattening::flatten(Function *f) {
       ConstantInt::get(Type::getInt32Ty(f->getContext()),
                        llvm::cryptoutils->scramble32(0, scrambling_key)),
       switchVar, insert);
+  insert->back().setDebugLoc(entryLoc);
 
   // Create main loop
   loopEntry = BasicBlock::Create(f->getContext(), "loopEntry", f, insert);
   loopEnd = BasicBlock::Create(f->getContext(), "loopEnd", f, insert);
 
   load = new LoadInst(switchVar, "switchVar", loopEntry);
+  load->setDebugLoc(dispatcherLoc);
 
   // Move first BB on top
   insert->moveBefore(loopEntry);
   BranchInst::Create(loopEntry, insert);
 
   // loopEnd jump to loopEntry
-  BranchInst::Create(loopEntry, loopEnd);
+  BranchInst::Create(loopEntry, loopEnd)->setDebugLoc(dispatcherLoc);
 
   BasicBlock *swDefault =
       BasicBlock::Create(f->getContext(), "switchDefault", f, loopEnd);
-  BranchInst::Create(loopEnd, swDefault);
+  BranchInst::Create(loopEnd, swDefault)->setDebugLoc(dispatcherLoc);
 
   // Create switch instruction itself and set condition
   switchI = SwitchInst::Create(&*f->begin(), swDefault, 0, loopEntry);
   switchI->setCondition(load);
+  switchI->setDebugLoc(dispatcherLoc);
 
   // Remove branch jump from 1st BB and make a jump to the while
   f->begin()->getTerminator()->eraseFromParent();
 
-  BranchInst::Create(loopEntry, &*f->begin());
+  BranchInst::Create(loopEntry, &*f->begin())->setDebugLoc(entryLoc);
+
+  // Shards of the state space. Every shard has a dispatcher of its own and
+  // transitions jump straight to the one owning their destination, so the
+  // predictor sees one indirect branch per shard instead of a single one.
+  int64_t wanted = obfuscationParameter(f, "fla_dispatchers", Dispatchers);
+  unsigned shards =
+      std::max<int64_t>(1, std::min<int64_t>(wanted, origBB.size()));
+  vector<SwitchInst *> dispatchers(1, switchI);
+  for (unsigned k = 1; k < shards; k++) {
+    BasicBlock *entry =
+        BasicBlock::Create(f->getContext(), "loopEntry", f, loopEnd);
+    IRBuilder<> IRB(entry);
+    IRB.SetCurrentDebugLocation(dispatcherLoc);
+    dispatchers.push_back(IRB.CreateSwitch(
+        IRB.CreateLoad(switchVar->getAllocatedType(), switchVar, "switchVar"),
+        swDefault));
+  }
+  DenseMap<BasicBlock *, unsigned> shardOf;
 
   // Put all BB in the switch
-  for (vector<BasicBlock *>::iterator b = origBB.begin(); b != origBB.end();
-       ++b) {
-    BasicBlock *i = *b;
-    ConstantInt *numCase = NULL;
+  for (unsigned n = 0; n < origBB.size(); n++) {
+    BasicBlock *i = origBB[n];
 
     // Move the BB inside the switch (only visual, no code logic)
     i->moveBefore(loopEnd);
 
-    // Add case to switch
-    numCase = cast<ConstantInt>(ConstantInt::get(
+    // Add case to switch, the first block stays with loopEntry
+    ConstantInt *numCase = cast<ConstantInt>(ConstantInt::get(
         switchI->getCondition()->getType(),
-        llvm::cryptoutils->scramble32(switchI->getNumCases(), scrambling_key)));
-    switchI->addCase(numCase, i);
+        llvm::cryptoutils->scramble32(n, scrambling_key)));
+    shardOf[i] = n % shards;
+    dispatchers[n % shards]->addCase(numCase, i);
   }
+  // Every case is entered as often as its block runs
+  if (!counts.empty()) {
+    for (SwitchInst *d : dispatchers) {
+      setSwitchWeights(d, [&](BasicBlock *BB) { return counts.block(BB); });
+    }
+  }
+
+  // State of the dispatcher case that jumps to BB
+  auto stateOf = [&](BasicBlock *BB) {
+    ConstantInt *numCase = dispatchers[shardOf.lookup(BB)]->findCaseDest(BB);
+    // If next case == default case (switchDefault)
+    if (numCase == NULL) {
+      numCase = cast<ConstantInt>(
+          ConstantInt::get(switchI->getCondition()->getType(),
+                           llvm::cryptoutils->scramble32(origBB.size() - 1,
+                                                         scrambling_key)));
+    }
+    return numCase;
+  };
+  // Where to jump after updating switchVar for BB
+  auto dispatcherOf = [&](BasicBlock *BB) {
+    if (shards == 1) {
+      return loopEnd;
+    }
+    return dispatchers[shardOf.lookup(BB)]->getParent();
+  };
 
   // Recalculate switchVar
   for (vector<BasicBlock *>::iterator b = origBB.begin(); b != origBB.end();
        ++b) {
     BasicBlock *i = *b;
-    ConstantInt *numCase = NULL;
 
     // Ret BB
     if (i->getTerminator()->getNumSuccessors() == 0) {
       continue;
     }
 
+    // Switches map each case to its state without being lowered
+    if (SwitchInst *SI = dyn_cast<SwitchInst>(i->getTerminator())) {
+      flattenSwitch(SI, switchVar, dispatcherOf, stateOf);
+      continue;
+    }
+
     // If it's a non-conditional jump
     if (i->getTerminator()->getNumSuccessors() == 1) {
       // Get successor and delete terminator
       BasicBlock *succ = i->getTerminator()->getSuccessor(0);
+      DebugLoc loc = i->getTerminator()->getDebugLoc();
       i->getTerminator()->eraseFromParent();
 
-      // Get next case
-      numCase = switchI->findCaseDest(succ);
-
-      // If next case == default case (switchDefault)
-      if (numCase == NULL) {
-        numCase = cast<ConstantInt>(
-            ConstantInt::get(switchI->getCondition()->getType(),
-                             llvm::cryptoutils->scramble32(
-                                 switchI->getNumCases() - 1, scrambling_key)));
-      }
-
       // Update switchVar and jump to the end of loop
-      new StoreInst(numCase, load->getPointerOperand(), i);
-      BranchInst::Create(loopEnd, i);
+      new StoreInst(stateOf(succ), switchVar, i);
+      i->back().setDebugLoc(loc);
+      BranchInst::Create(dispatcherOf(succ), i)->setDebugLoc(loc);
       continue;
     }
 
     // If it's a conditional jump
     if (i->getTerminator()->getNumSuccessors() == 2) {
-      // Get next cases
-      ConstantInt *numCaseTrue =
-          switchI->findCaseDest(i->getTerminator()->getSuccessor(0));
-      ConstantInt *numCaseFalse =
-          switchI->findCaseDest(i->getTerminator()->getSuccessor(1));
-
-      // Check if next case == default case (switchDefault)
-      if (numCaseTrue == NULL) {
-        numCaseTrue = cast<ConstantInt>(
-            ConstantInt::get(switchI->getCondition()->getType(),
-                             llvm::cryptoutils->scramble32(
-                                 switchI->getNumCases() - 1, scrambling_key)));
-      }
-
-      if (numCaseFalse == NULL) {
-        numCaseFalse = cast<ConstantInt>(
-            ConstantInt::get(switchI->getCondition()->getType(),
-                             llvm::cryptoutils->scramble32(
-                                 switchI->getNumCases() - 1, scrambling_key)));
-      }
-
-      // Create a SelectInst
       BranchInst *br = cast<BranchInst>(i->getTerminator());
-      SelectInst *sel =
-          SelectInst::Create(br->getCondition(), numCaseTrue, numCaseFalse, "",
-                             i->getTerminator());
-
+      BasicBlock *succTrue = br->getSuccessor(0);
+      BasicBlock *succFalse = br->getSuccessor(1);
+      Value *cond = br->getCondition();
+
+      // Create a SelectInst, it keeps the branch weights
+      SelectInst *sel = SelectInst::Create(cond, stateOf(succTrue),
+                                           stateOf(succFalse), "", br);
+      sel->copyMetadata(*br, {LLVMContext::MD_prof, LLVMContext::MD_dbg});
+
+      // Update switchVar and jump to the end of loop, or to the dispatchers
+      // of both successors
+      new StoreInst(sel, switchVar, i);
+      i->back().setDebugLoc(br->getDebugLoc());
+      BranchInst *next;
+      if (dispatcherOf(succTrue) == dispatcherOf(succFalse)) {
+        next = BranchInst::Create(dispatcherOf(succTrue), i);
+        next->setDebugLoc(br->getDebugLoc());
+      } else {
+        next = BranchInst::Create(dispatcherOf(succTrue),
+                                  dispatcherOf(succFalse), cond, i);
+        next->copyMetadata(*br, {LLVMContext::MD_prof, LLVMContext::MD_dbg});
+      }
       // Erase terminator
-      i->getTerminator()->eraseFromParent();
-      // Update switchVar and jump to the end of loop
-      new StoreInst(sel, load->getPointerOperand(), i);
-      BranchInst::Create(loopEnd, i);
+      br->eraseFromParent();
       continue;
     }
   }
@@ -250,3 +312,206 @@ bool Flattening::flatten(Function *f) {
   errs()<<"Fixed Stack\n";
   return true;
 }
+
+// Region mode: blocks are grouped by their innermost loop, every loop header
+// and latch is left out, and each group is split into regions flattened with
+// a dispatcher of their own. The loops keep their headers and latches, so
+// LoopInfo still finds them and unrolling, vectorization and LICM still apply
+// once the stack slots are promoted back to registers.
+//
+// A region is connected and no path leaves it and comes back without going
+// through the header of its loop. Otherwise its dispatcher would be on a
+// cycle the function doesn't have, around a subloop or, outside loops,
+// around a whole loop, and LoopInfo would find a loop nesting it.
+bool Flattening::flattenRegions(Function *f) {
+  if (!canFlatten(f)) {
+    return false;
+  }
+  FunctionAnalyses FA(*f);
+  ProfileCounts counts(*f, FA);
+  LoopInfo &LI = FA.getLoopInfo();
+  SmallPtrSet<BasicBlock *, 16> kept;
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    SmallVector<BasicBlock *, 4> latches;
+    L->getLoopLatches(latches);
+    kept.insert(L->getHeader());
+    kept.insert(latches.begin(), latches.end());
+  }
+
+  struct Region {
+    std::vector<BasicBlock *> blocks;
+    SmallPtrSet<BasicBlock *, 16> contains;
+  };
+  std::vector<Region> regions;
+  DenseMap<BasicBlock *, unsigned> regionOf;
+  // Paths are followed inside the loop of the group, or the whole function
+  // outside loops, without the back edges starting another iteration
+  auto inScope = [](Loop *L, BasicBlock *from, BasicBlock *to) {
+    return L == nullptr || (L->contains(from) && to != L->getHeader());
+  };
+  // In reverse post-order the blocks of a region all come before BB, so it
+  // can take BB if none of its edges leads out of it to a block reaching BB
+  ReversePostOrderTraversal<Function *> RPOT(f);
+  for (BasicBlock *BB : RPOT) {
+    if (BB == &f->getEntryBlock() || kept.count(BB)) {
+      continue;
+    }
+    Loop *L = LI.getLoopFor(BB);
+    SmallPtrSet<BasicBlock *, 16> reachesBB;
+    SmallVector<BasicBlock *, 16> worklist{BB};
+    while (!worklist.empty()) {
+      BasicBlock *cur = worklist.pop_back_val();
+      for (BasicBlock *pred : predecessors(cur)) {
+        if (inScope(L, pred, cur) && reachesBB.insert(pred).second) {
+          worklist.push_back(pred);
+        }
+      }
+    }
+    auto canTake = [&](const Region &region) {
+      for (BasicBlock *member : region.blocks) {
+        for (BasicBlock *succ : successors(member)) {
+          if (succ != BB && inScope(L, member, succ) &&
+              reachesBB.count(succ) && !region.contains.count(succ)) {
+            return false;
+          }
+        }
+      }
+      return true;
+    };
+    unsigned index = regions.size();
+    for (BasicBlock *pred : predecessors(BB)) {
+      auto it = regionOf.find(pred);
+      if (it != regionOf.end() && LI.getLoopFor(pred) == L &&
+          canTake(regions[it->second])) {
+        index = it->second;
+        break;
+      }
+    }
+    if (index == regions.size()) {
+      regions.emplace_back();
+    }
+    regions[index].blocks.push_back(BB);
+    regions[index].contains.insert(BB);
+    regionOf[BB] = index;
+  }
+
+  bool changed = false;
+  for (Region &region : regions) {
+    // A single block has no transitions of its own to hide
+    if (region.blocks.size() > 1) {
+      flattenRegion(f, region.blocks, counts);
+      ++FlattenedRegions;
+      changed = true;
+    }
+  }
+  if (changed) {
+    fixStack(f);
+  }
+  return changed;
+}
+
+// Every edge into, inside and out of the region goes through its dispatcher.
+// Edges from outside get a block storing the state of their destination,
+// edges leaving the region become cases of the dispatcher.
+void Flattening::flattenRegion(Function *f, ArrayRef<BasicBlock *> region,
+                               const ProfileCounts &counts) {
+  char scrambling_key[16];
+  llvm::cryptoutils->get_bytes(scrambling_key, 16);
+  LLVMContext &ctx = f->getContext();
+  IntegerType *stateTy = Type::getInt32Ty(ctx);
+  SmallPtrSet<BasicBlock *, 16> inRegion(region.begin(), region.end());
+
+  AllocaInst *regionVar = new AllocaInst(stateTy, 0, "regionVar",
+                                         f->getEntryBlock().getTerminator());
+  BasicBlock *dispatcher =
+      BasicBlock::Create(ctx, "regionEntry", f, region.front());
+  DebugLoc dispatcherLoc = artificialDebugLoc(*f);
+  IRBuilder<> IRB(dispatcher);
+  IRB.SetCurrentDebugLocation(dispatcherLoc);
+  SwitchInst *switchI = IRB.CreateSwitch(
+      IRB.CreateLoad(stateTy, regionVar, "regionVar"), region.front());
+
+  // The default destination isn't a case, so findCaseDest can't be used
+  DenseMap<BasicBlock *, ConstantInt *> states;
+  auto addCase = [&](BasicBlock *BB) {
+    ConstantInt *&state = states[BB];
+    if (state == nullptr) {
+      state = ConstantInt::get(
+          stateTy, llvm::cryptoutils->scramble32(states.size() - 1,
+                                                 scrambling_key));
+      switchI->addCase(state, BB);
+    }
+  };
+  for (BasicBlock *BB : region) {
+    addCase(BB);
+  }
+  for (BasicBlock *BB : region) {
+    for (BasicBlock *succ : successors(BB)) {
+      addCase(succ);
+    }
+  }
+  auto stateOf = [&](BasicBlock *BB) { return states.lookup(BB); };
+  // Exits are taken as often as the edges leading out of the region
+  if (!counts.empty()) {
+    setSwitchWeights(switchI, [&](BasicBlock *BB) {
+      if (inRegion.count(BB)) {
+        return counts.block(BB);
+      }
+      uint64_t count = 0;
+      for (BasicBlock *pred : region) {
+        count += counts.edge(pred, BB);
+      }
+      return count;
+    });
+  }
+
+  // Entries
+  for (BasicBlock *BB : region) {
+    SmallSetVector<BasicBlock *, 4> preds;
+    for (BasicBlock *pred : predecessors(BB)) {
+      if (pred != dispatcher && !inRegion.count(pred)) {
+        preds.insert(pred);
+      }
+    }
+    if (preds.empty()) {
+      continue;
+    }
+    BasicBlock *entry = BasicBlock::Create(ctx, "regionCase", f, dispatcher);
+    new StoreInst(stateOf(BB), regionVar, entry);
+    entry->back().setDebugLoc(dispatcherLoc);
+    BranchInst::Create(dispatcher, entry)->setDebugLoc(dispatcherLoc);
+    for (BasicBlock *pred : preds) {
+      Instruction *term = pred->getTerminator();
+      for (unsigned i = 0; i < term->getNumSuccessors(); i++) {
+        if (term->getSuccessor(i) == BB) {
+          term->setSuccessor(i, entry);
+        }
+      }
+    }
+  }
+
+  // Transitions and exits, as in flatten()
+  for (BasicBlock *BB : region) {
+    Instruction *term = BB->getTerminator();
+    if (term->getNumSuccessors() == 0) {
+      continue;
+    }
+    if (SwitchInst *SI = dyn_cast<SwitchInst>(term)) {
+      flattenSwitch(
+          SI, regionVar, [&](BasicBlock *) { return dispatcher; }, stateOf);
+      continue;
+    }
+    BranchInst *br = cast<BranchInst>(term);
+    Value *next = stateOf(br->getSuccessor(0));
+    if (br->isConditional()) {
+      SelectInst *sel = SelectInst::Create(
+          br->getCondition(), next, stateOf(br->getSuccessor(1)), "", br);
+      sel->copyMetadata(*br, {LLVMContext::MD_prof, LLVMContext::MD_dbg});
+      next = sel;
+    }
+    StoreInst *store = new StoreInst(next, regionVar, br);
+    store->setDebugLoc(br->getDebugLoc());
+    BranchInst::Create(dispatcher, br)->setDebugLoc(br->getDebugLoc());
+    br->eraseFromParent();
+  }
+}
@@ -17,7 +17,6 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "json.hpp"
 #include "llvm/ADT/Triple.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
@@ -30,6 +29,7 @@
 #include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
 #include "Transforms/Obfuscation/Obfuscation.h"
+#include "Transforms/Obfuscation/SymbolConfig.h"
 #include <algorithm>
 #include <cstdlib>
 #include <dlfcn.h>
@@ -39,7 +39,6 @@
 #include <string>
 using namespace llvm;
 using namespace std;
-using json = nlohmann::json;
 static cl::opt<string>
     SymbolConfigPath("fcoconfig",
                      cl::desc("FunctionCallObfuscate Configuration Path"),
@@ -47,10 +46,16 @@ static cl::opt<string>
 namespace llvm {
 struct FunctionCallObfuscate : public FunctionPass {
   static char ID;
-  json Configuration;
+  const SymbolConfig *Configuration;
   bool flag;
-  FunctionCallObfuscate() : FunctionPass(ID) { this->flag = true; }
-  FunctionCallObfuscate(bool flag) : FunctionPass(ID) { this->flag = flag; }
+  FunctionCallObfuscate() : FunctionPass(ID) {
+    this->flag = true;
+    this->Configuration = nullptr;
+  }
+  FunctionCallObfuscate(bool flag) : FunctionPass(ID) {
+    this->flag = flag;
+    this->Configuration = nullptr;
+  }
   StringRef getPassName() const override {
     return StringRef("FunctionCallObfuscate");
   }
@@ -63,11 +68,12 @@ struct FunctionCallObfuscate : public FunctionPass {
         SymbolConfigPath = Path.str();
       }
     }
-    ifstream infile(SymbolConfigPath);
-    if (infile.good()) {
+    // Either a JSON file or one compiled by hikari-symcfg. Both are loaded
+    // once per process and shared by every module
+    this->Configuration = SymbolConfig::get(SymbolConfigPath);
+    if (this->Configuration != nullptr) {
       errs() << "Loading Symbol Configuration From:" << SymbolConfigPath
              << "\n";
-      infile >> this->Configuration;
     } else {
       errs() << "Failed To Loading Symbol Configuration From:"
              << SymbolConfigPath << "\n";
@@ -220,6 +226,7 @@ struct FunctionCallObfuscate : public FunctionPass {
       return false;
     }
     errs() << "Running FunctionCallObfuscate On " << F.getName() << "\n";
+    ObfuscationTimeScope Scope("FunctionCallObfuscate", F);
     Module *M = F.getParent();
     FixFunctionConstantExpr(&F);
     HandleObjC(*M);
@@ -277,11 +284,10 @@ struct FunctionCallObfuscate : public FunctionPass {
           }
           // errs()<<"Searching For:"<<calledFunction->getName()<<" In
           // Configuration\n";
-          if (this->Configuration.find(calledFunction->getName().str()) !=
-              this->Configuration.end()) {
-            string sname = this->Configuration[calledFunction->getName().str()]
-                               .get<string>();
-            StringRef calledFunctionName = StringRef(sname);
+          StringRef calledFunctionName;
+          if (this->Configuration != nullptr &&
+              this->Configuration->lookup(calledFunction->getName(),
+                                          calledFunctionName)) {
             BasicBlock *EntryBlock = CS->getParent();
             IRBuilder<> IRB(EntryBlock, EntryBlock->getFirstInsertionPt());
             vector<Value *> dlopenargs;
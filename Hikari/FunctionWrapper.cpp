@@ -50,23 +50,29 @@ struct FunctionWrapper : public ModulePass {
     return StringRef("FunctionWrapper");
   }
   bool runOnModule(Module &M) override {
+    ObfuscationTimeScope Scope("FunctionWrapper", M);
     vector<CallSite *> callsites;
+    vector<int64_t> wrapTimes; // -fw_times of each callsite's function
     for (Module::iterator iter = M.begin(); iter != M.end(); iter++) {
       Function &F = *iter;
       if (toObfuscate(flag, &F, "fw")) {
         errs() << "Running FunctionWrapper On " << F.getName() << "\n";
+        int64_t prob = obfuscationParameter(&F, "fw_prob", ProbRate);
+        int64_t times = obfuscationParameter(&F, "fw_times", ObfTimes);
         for (inst_iterator fi = inst_begin(&F); fi != inst_end(&F); fi++) {
           Instruction *Inst = &*fi;
           if (isa<CallInst>(Inst) || isa<InvokeInst>(Inst)) {
-            if ((int)llvm::cryptoutils->get_range(100) <= ProbRate) {
+            if ((int)llvm::cryptoutils->get_range(100) <= prob) {
               callsites.push_back(new CallSite(Inst));
+              wrapTimes.push_back(times);
             }
           }
         }
       }
     }
-    for (CallSite *CS : callsites) {
-      for (int i = 0; i < ObfTimes && CS != nullptr; i++) {
+    for (size_t i = 0; i < callsites.size(); i++) {
+      CallSite *CS = callsites[i];
+      for (int64_t j = 0; j < wrapTimes[i] && CS != nullptr; j++) {
         CS = HandleCallSite(CS);
       }
     }
@@ -118,6 +124,10 @@ struct FunctionWrapper : public ModulePass {
     //func->addFnAttr(Attribute::AttrKind::OptimizeNone);
     //func->addFnAttr(Attribute::AttrKind::NoInline);
     func->copyAttributesFrom(cast<Function>(calledFunction));
+    // The wrapper is internal, which requires default visibility. Callees
+    // are often hidden, ThinLTO promotes local functions to hidden too
+    func->setVisibility(GlobalValue::DefaultVisibility);
+    func->setDLLStorageClass(GlobalValue::DefaultStorageClass);
     BasicBlock *BB = BasicBlock::Create(func->getContext(), "", func);
     IRBuilder<> IRB(BB);
     vector<Value *> params;
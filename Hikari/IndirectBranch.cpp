@@ -19,6 +19,7 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Pass.h"
@@ -32,21 +33,33 @@ namespace llvm {
 struct IndirectBranch : public FunctionPass {
   static char ID;
   bool flag;
-  bool initialized;
+  // Module the global table was built for. Tracked per module rather than
+  // with a flag so a pass object reused across modules, e.g. one ThinLTO
+  // backend after another, never indexes a stale table
+  Module *initialized;
+  GlobalVariable *GlobalTable;
   map<BasicBlock *, unsigned long long> indexmap;
   IndirectBranch() : FunctionPass(ID) {
     this->flag = true;
-    this->initialized = false;
+    this->initialized = nullptr;
+    this->GlobalTable = nullptr;
   }
   IndirectBranch(bool flag) : FunctionPass(ID) {
     this->flag = flag;
-    this->initialized = false;
+    this->initialized = nullptr;
+    this->GlobalTable = nullptr;
   }
   StringRef getPassName() const override { return StringRef("IndirectBranch"); }
   bool initialize(Module &M) {
     vector<Constant *> BBs;
     unsigned long long i = 0;
+    indexmap.clear();
     for (auto F = M.begin(); F != M.end(); F++) {
+      // Imported available_externally bodies are dropped before codegen and
+      // are never obfuscated, keep their blocks out of the table
+      if (F->isDeclaration() || F->hasAvailableExternallyLinkage()) {
+        continue;
+      }
       for (auto BB = F->begin(); BB != F->end(); BB++) {
         BasicBlock *BBPtr = &*BB;
         if (BBPtr != &(BBPtr->getParent()->getEntryBlock())) {
@@ -59,21 +72,22 @@ struct IndirectBranch : public FunctionPass {
         ArrayType::get(Type::getInt8PtrTy(M.getContext()), BBs.size());
     Constant *BlockAddressArray =
         ConstantArray::get(AT, ArrayRef<Constant *>(BBs));
-    GlobalVariable *Table = new GlobalVariable(
+    GlobalTable = new GlobalVariable(
         M, AT, false, GlobalValue::LinkageTypes::InternalLinkage,
         BlockAddressArray, "IndirectBranchingGlobalTable");
-    appendToCompilerUsed(M, {Table});
+    appendToCompilerUsed(M, {GlobalTable});
     return true;
   }
   bool runOnFunction(Function &Func) override {
     if (!toObfuscate(flag, &Func, "indibr")) {
       return false;
     }
-    if (this->initialized == false) {
+    if (this->initialized != Func.getParent()) {
       initialize(*Func.getParent());
-      this->initialized = true;
+      this->initialized = Func.getParent();
     }
     errs() << "Running IndirectBranch On " << Func.getName() << "\n";
+    ObfuscationTimeScope Scope("IndirectBranch", Func);
     vector<BranchInst *> BIs;
     for (inst_iterator I = inst_begin(Func); I != inst_end(Func); I++) {
       Instruction *Inst = &(*I);
@@ -112,8 +126,7 @@ struct IndirectBranch : public FunctionPass {
             "HikariConditionalLocalIndirectBranchingTable");
         appendToCompilerUsed(*Func.getParent(), {LoadFrom});
       } else {
-        LoadFrom = Func.getParent()->getGlobalVariable(
-            "IndirectBranchingGlobalTable", true);
+        LoadFrom = GlobalTable;
       }
       Value *index = NULL;
       if (BI->isConditional()) {
@@ -131,13 +144,23 @@ struct IndirectBranch : public FunctionPass {
       for (BasicBlock *BB : BBs) {
         indirBr->addDestination(BB);
       }
+      // Same weights, in the order of the destinations
+      uint64_t trueWeight, falseWeight;
+      if (BI->isConditional() &&
+          BI->extractProfMetadata(trueWeight, falseWeight)) {
+        indirBr->setMetadata(
+            LLVMContext::MD_prof,
+            MDBuilder(Func.getContext())
+                .createBranchWeights(falseWeight, trueWeight));
+      }
       ReplaceInstWithInst(BI, indirBr);
     }
     return true;
   }
   virtual bool doFinalization(Module &M) override {
     indexmap.clear();
-    initialized = false;
+    initialized = nullptr;
+    GlobalTable = nullptr;
     return false;
   }
 };
@@ -20,6 +20,10 @@
   Ref : http://lists.llvm.org/pipermail/llvm-dev/2011-February/038109.html
 */
 #include "Transforms/Obfuscation/Obfuscation.h"
+#include "Transforms/Obfuscation/Utils.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Support/Timer.h"
+#include <chrono>
 using namespace llvm;
 using namespace std;
 // Begin Obfuscator Options
@@ -31,9 +35,10 @@ static cl::opt<bool> EnableAntiClassDump("enable-acdobf", cl::init(false),
 static cl::opt<bool>
     EnableBogusControlFlow("enable-bcfobf", cl::init(false), cl::NotHidden,
                            cl::desc("Enable BogusControlFlow."));
-static cl::opt<bool> EnableFlattening("enable-cffobf", cl::init(false),
-                                      cl::NotHidden,
-                                      cl::desc("Enable Flattening."));
+static cl::opt<bool> EnableFlattening(
+    "enable-cffobf", cl::init(false), cl::NotHidden,
+    cl::desc("Enable Flattening. Functions ending in ret, unreachable or "
+             "switch are flattened too, not only all-branch ones as before"));
 static cl::opt<bool>
     EnableBasicBlockSplit("enable-splitobf", cl::init(false), cl::NotHidden,
                           cl::desc("Enable BasicBlockSpliting."));
@@ -55,20 +60,87 @@ static cl::opt<bool>
 static cl::opt<bool>
     EnableFunctionWrapper("enable-funcwra", cl::init(false), cl::NotHidden,
                           cl::desc("Enable Function Wrapper."));
+// Compile-time guardrails of the function-level passes
+static cl::opt<unsigned> MaxInstructions(
+    "hikari-max-insts", cl::init(0),
+    cl::desc("[Hikari]Functions with more instructions get neither "
+             "BogusControlFlow nor Flattening, 0 for no limit"));
+static cl::opt<unsigned> MaxBlocks(
+    "hikari-max-blocks", cl::init(0),
+    cl::desc("[Hikari]Functions with more basic blocks get neither "
+             "BogusControlFlow nor Flattening, 0 for no limit"));
+static cl::opt<unsigned> TimeBudget(
+    "hikari-time-budget", cl::init(0), cl::value_desc("ms"),
+    cl::desc("[Hikari]Soft per-function budget, the passes still left when it "
+             "runs out are skipped, 0 for no budget"));
 // End Obfuscator Options
+
+// BogusControlFlow and Flattening grow faster than the function, above the
+// limits only the linear passes run
+static bool isOverSizeLimit(Function &F) {
+  unsigned Instructions = F.getInstructionCount();
+  bool Over = (MaxInstructions != 0 && Instructions > MaxInstructions) ||
+              (MaxBlocks != 0 && F.size() > MaxBlocks);
+  if (Over) {
+    errs() << "Guardrail: " << F.getName() << " has " << Instructions
+           << " instructions in " << F.size()
+           << " blocks, over -hikari-max-insts=" << MaxInstructions
+           << " / -hikari-max-blocks=" << MaxBlocks
+           << ", skipping BogusControlFlow and Flattening\n";
+  }
+  return Over;
+}
+
+// Checked before each pass, a pass that already started is never stopped
+static bool isOverTimeBudget(Function &F,
+                             std::chrono::steady_clock::time_point Start,
+                             StringRef Pass) {
+  if (TimeBudget == 0) {
+    return false;
+  }
+  long long Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::steady_clock::now() - Start)
+                          .count();
+  if (Elapsed <= TimeBudget) {
+    return false;
+  }
+  errs() << "Guardrail: " << F.getName() << " took " << Elapsed
+         << " ms, over -hikari-time-budget=" << TimeBudget << ", skipping "
+         << Pass << "\n";
+  return true;
+}
 namespace llvm {
 struct Obfuscation : public ModulePass {
   static char ID;
+  // Set under the new pass manager, see setObfuscationTTI and
+  // setObfuscationAnalyses
+  TTIGetter GetTTI;
+  AnalysisGetters Analyses;
   Obfuscation() : ModulePass(ID) {}
   StringRef getPassName() const override {
     return StringRef("HikariObfuscationScheduler");
   }
   bool runOnModule(Module &M) override {
+    // Annotations and hikari_* markers are read once for all passes below
+    ObfuscationFlagCache FlagCache(M);
+    ObfuscationTimeScope Scope("HikariObfuscationScheduler", M);
+    // The passes below share the pipeline's function analyses. Each pass
+    // that changes a function drops its results, see invalidateAnalyses
+    ObfuscationAnalysisScope AnalysisScope(Analyses);
+    auto invalidateAll = [&M]() {
+      for (Function &F : M) {
+        if (!F.isDeclaration()) {
+          invalidateAnalyses(F, false);
+        }
+      }
+    };
     // Initial ACD Pass
     if (EnableAllObfuscation || EnableAntiClassDump) {
       ModulePass *P = createAntiClassDumpPass();
       P->doInitialization(M);
-      P->runOnModule(M);
+      if (P->runOnModule(M)) {
+        invalidateAll();
+      }
       delete P;
     }
     // Now do FCO
@@ -77,15 +149,17 @@ struct Obfuscation : public ModulePass {
     FP->doInitialization(M);
     for (Module::iterator iter = M.begin(); iter != M.end(); iter++) {
       Function &F = *iter;
-      if (!F.isDeclaration()) {
-        FP->runOnFunction(F);
+      if (!F.isDeclaration() && FP->runOnFunction(F)) {
+        invalidateAnalyses(F, true);
       }
     }
     delete FP;
     // Now Encrypt Strings
     ModulePass *MP = createStringEncryptionPass(EnableAllObfuscation ||
                                     EnableStringEncryption);
-    MP->runOnModule(M);
+    if (MP->runOnModule(M)) {
+      invalidateAll();
+    }
     delete MP;
     /*
     // Placing FW here does provide the most obfuscation however the compile
@@ -98,26 +172,96 @@ struct Obfuscation : public ModulePass {
       delete P;
     }*/
     // Now perform Function-Level Obfuscation
+    // Pass objects are shared by every function and each function's
+    // eligibility is decided once, functions no pass applies to are skipped
+    bool SplitFlag = EnableAllObfuscation || EnableBasicBlockSplit;
+    bool BCFFlag = EnableAllObfuscation || EnableBogusControlFlow;
+    bool FlaFlag = EnableAllObfuscation || EnableFlattening;
+    bool SubFlag = EnableAllObfuscation || EnableSubstitution;
+    FunctionPass *SplitPass = createSplitBasicBlockPass(SplitFlag);
+    FunctionPass *BCFPass = createBogusControlFlowPass(BCFFlag);
+    FunctionPass *FlaPass = createFlatteningPass(FlaFlag);
+    // Substitution weighs its rewrites with the target's cost model. The
+    // new pass manager wrapper runs this pass without a resolver and hands
+    // over its analyses instead
+    TargetTransformInfoWrapperPass *TTIWP = nullptr;
+    if (getResolver() != nullptr) {
+      TTIWP = getAnalysisIfAvailable<TargetTransformInfoWrapperPass>();
+    }
+    FunctionPass *SubPass = createSubstitutionPass(SubFlag, TTIWP);
+    if (GetTTI) {
+      setSubstitutionTTI(SubPass, GetTTI);
+    }
+    unsigned ReducedFunctions = 0, SkippedPasses = 0;
     for (Module::iterator iter = M.begin(); iter != M.end(); iter++) {
       Function &F = *iter;
       if (!F.isDeclaration()) {
-        FunctionPass *P = NULL;
-        P = createSplitBasicBlockPass(EnableAllObfuscation ||
-                                      EnableBasicBlockSplit);
-        P->runOnFunction(F);
-        delete P;
-        P = createBogusControlFlowPass(EnableAllObfuscation ||
-                                       EnableBogusControlFlow);
-        P->runOnFunction(F);
-        delete P;
-        P = createFlatteningPass(EnableAllObfuscation || EnableFlattening);
-        P->runOnFunction(F);
-        delete P;
-        P = createSubstitutionPass(EnableAllObfuscation || EnableSubstitution);
-        P->runOnFunction(F);
-        delete P;
+        bool DoSplit = toObfuscate(SplitFlag, &F, "split");
+        bool DoBCF = toObfuscate(BCFFlag, &F, "bcf");
+        bool DoFla = toObfuscate(FlaFlag, &F, "fla");
+        bool DoSub = toObfuscate(SubFlag, &F, "sub");
+        if (!DoSplit && !DoBCF && !DoFla && !DoSub) {
+          continue;
+        }
+        if ((DoBCF || DoFla) && isOverSizeLimit(F)) {
+          DoBCF = DoFla = false;
+          ReducedFunctions++;
+        }
+        // Parent of the per-pass scopes, so the trace shows each function's
+        // total next to its passes
+        ObfuscationTimeScope FunctionScope("HikariFunction", F);
+        std::chrono::steady_clock::time_point Start =
+            std::chrono::steady_clock::now();
+        auto outOfTime = [&](StringRef Pass) {
+          if (isOverTimeBudget(F, Start, Pass)) {
+            SkippedPasses++;
+            return true;
+          }
+          return false;
+        };
+        if (DoSplit) {
+          NamedRegionTimer T("split", "SplitBasicBlock", "hikari",
+                             "Hikari Function-Level Obfuscation",
+                             TimePassesIsEnabled);
+          if (SplitPass->runOnFunction(F)) {
+            invalidateAnalyses(F, false);
+          }
+        }
+        if (DoBCF && !outOfTime("BogusControlFlow")) {
+          NamedRegionTimer T("bcf", "BogusControlFlow", "hikari",
+                             "Hikari Function-Level Obfuscation",
+                             TimePassesIsEnabled);
+          if (BCFPass->runOnFunction(F)) {
+            invalidateAnalyses(F, false);
+          }
+        }
+        if (DoFla && !outOfTime("Flattening")) {
+          NamedRegionTimer T("fla", "Flattening", "hikari",
+                             "Hikari Function-Level Obfuscation",
+                             TimePassesIsEnabled);
+          if (FlaPass->runOnFunction(F)) {
+            invalidateAnalyses(F, false);
+          }
+        }
+        if (DoSub && !outOfTime("Substitution")) {
+          NamedRegionTimer T("sub", "Substitution", "hikari",
+                             "Hikari Function-Level Obfuscation",
+                             TimePassesIsEnabled);
+          if (SubPass->runOnFunction(F)) {
+            invalidateAnalyses(F, true);
+          }
+        }
       }
     }
+    delete SplitPass;
+    delete BCFPass;
+    delete FlaPass;
+    delete SubPass;
+    if (ReducedFunctions != 0 || SkippedPasses != 0) {
+      errs() << "Guardrails: " << ReducedFunctions
+             << " functions without BogusControlFlow and Flattening, "
+             << SkippedPasses << " passes skipped over the time budget\n";
+    }
     errs() << "Doing Post-Run Cleanup\n";
     FunctionPass *P = createIndirectBranchPass(EnableAllObfuscation ||
                                                EnableIndirectBranching);
@@ -160,6 +304,12 @@ ModulePass *createObfuscationPass() {
   }
   return new Obfuscation();
 }
+void setObfuscationTTI(ModulePass *P, TTIGetter GetTTI) {
+  static_cast<Obfuscation *>(P)->GetTTI = std::move(GetTTI);
+}
+void setObfuscationAnalyses(ModulePass *P, AnalysisGetters Getters) {
+  static_cast<Obfuscation *>(P)->Analyses = std::move(Getters);
+}
 } // namespace llvm
 char Obfuscation::ID = 0;
 INITIALIZE_PASS_BEGIN(Obfuscation, "obfus", "Enable Obfuscation", true, true)
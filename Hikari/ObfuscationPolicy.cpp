@@ -0,0 +1,343 @@
+/*
+ *  Per-function obfuscation policy for -hikari-policy
+ *  See include/Transforms/Obfuscation/ObfuscationPolicy.h for the file format
+ */
+#include "Transforms/Obfuscation/ObfuscationPolicy.h"
+#include "json.hpp"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include <mutex>
+using namespace llvm;
+using namespace std;
+using json = nlohmann::json;
+
+static const char *const PolicyPasses[] = {
+    "all", "bcf", "fla", "sub", "split", "strenc", "indibr", "fw", "fco"};
+// The pass options read through obfuscationParameter()
+static const char *const PolicyParameters[] = {
+    "bcf_prob", "bcf_loop", "bcf_cond_compl", "fla_dispatchers", "split_num",
+    "sub_loop", "sub_prob", "fw_prob",        "fw_times"};
+static const pair<const char *, GlobalValue::LinkageTypes> PolicyLinkages[] = {
+    {"external", GlobalValue::ExternalLinkage},
+    {"available_externally", GlobalValue::AvailableExternallyLinkage},
+    {"linkonce", GlobalValue::LinkOnceAnyLinkage},
+    {"linkonce_odr", GlobalValue::LinkOnceODRLinkage},
+    {"weak", GlobalValue::WeakAnyLinkage},
+    {"weak_odr", GlobalValue::WeakODRLinkage},
+    {"appending", GlobalValue::AppendingLinkage},
+    {"internal", GlobalValue::InternalLinkage},
+    {"private", GlobalValue::PrivateLinkage},
+    {"extern_weak", GlobalValue::ExternalWeakLinkage},
+    {"common", GlobalValue::CommonLinkage}};
+
+template <size_t N>
+static bool isOneOf(const char *const (&Names)[N], const std::string &Name) {
+  for (const char *Known : Names) {
+    if (Name == Known) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ObfuscationPolicy::Decision::pass(StringRef Pass, bool &Enabled) const {
+  StringMap<bool>::const_iterator It = Passes.find(Pass);
+  if (It == Passes.end()) {
+    It = Passes.find("all");
+  }
+  if (It == Passes.end()) {
+    return false;
+  }
+  Enabled = It->second;
+  return true;
+}
+
+bool ObfuscationPolicy::Decision::parameter(StringRef Name,
+                                            int64_t &Value) const {
+  StringMap<int64_t>::const_iterator It = Parameters.find(Name);
+  if (It == Parameters.end()) {
+    return false;
+  }
+  Value = It->second;
+  return true;
+}
+
+bool ObfuscationPolicy::PatternIndex::add(StringRef Pattern, unsigned Rule,
+                                          std::string &Error) {
+  if (Pattern.startswith("re:")) {
+    unique_ptr<Regex> RE(new Regex(Pattern.drop_front(3)));
+    if (!RE->isValid(Error)) {
+      Error = "invalid regex \"" + Pattern.str() + "\": " + Error;
+      return false;
+    }
+    Regexes.emplace_back(std::move(RE), Rule);
+    return true;
+  }
+  // Braces are literal before LLVM 17 and a brace expansion after
+  size_t Meta = Pattern.find_first_of("*?[\\{");
+  if (Meta == StringRef::npos) {
+    Literals[Pattern].push_back(Rule);
+    return true;
+  }
+  if (Meta == Pattern.size() - 1 && Pattern.back() == '*') {
+    unsigned Node = 0;
+    for (char C : Pattern.drop_back()) {
+      map<char, unsigned>::iterator Child = Trie[Node].Children.find(C);
+      if (Child == Trie[Node].Children.end()) {
+        Trie[Node].Children[C] = Trie.size();
+        Node = Trie.size();
+        Trie.emplace_back();
+      } else {
+        Node = Child->second;
+      }
+    }
+    Trie[Node].Rules.push_back(Rule);
+    return true;
+  }
+  Expected<GlobPattern> Glob = GlobPattern::create(Pattern);
+  if (!Glob) {
+    Error = "invalid glob \"" + Pattern.str() +
+            "\": " + toString(Glob.takeError());
+    return false;
+  }
+  Globs.emplace_back(std::move(*Glob), Rule);
+  return true;
+}
+
+void ObfuscationPolicy::PatternIndex::match(StringRef S,
+                                            BitVector &Matched) const {
+  StringMap<vector<unsigned>>::const_iterator Literal = Literals.find(S);
+  if (Literal != Literals.end()) {
+    for (unsigned Rule : Literal->second) {
+      Matched.set(Rule);
+    }
+  }
+  unsigned Node = 0;
+  for (size_t i = 0;; i++) {
+    for (unsigned Rule : Trie[Node].Rules) {
+      Matched.set(Rule);
+    }
+    if (i == S.size()) {
+      break;
+    }
+    map<char, unsigned>::const_iterator Child = Trie[Node].Children.find(S[i]);
+    if (Child == Trie[Node].Children.end()) {
+      break;
+    }
+    Node = Child->second;
+  }
+  for (const pair<GlobPattern, unsigned> &Glob : Globs) {
+    if (!Matched.test(Glob.second) && Glob.first.match(S)) {
+      Matched.set(Glob.second);
+    }
+  }
+  for (const pair<unique_ptr<Regex>, unsigned> &RE : Regexes) {
+    if (!Matched.test(RE.second) && RE.first->match(S)) {
+      Matched.set(RE.second);
+    }
+  }
+}
+
+// A pattern or a list of patterns of one field
+static bool addPatterns(const json &Field, unsigned Rule,
+                        function_ref<bool(StringRef, unsigned, std::string &)>
+                            Add,
+                        std::string &Error) {
+  if (Field.is_string()) {
+    return Add(Field.get<std::string>(), Rule, Error);
+  }
+  if (!Field.is_array() || Field.empty()) {
+    Error = "expected a pattern or a list of patterns";
+    return false;
+  }
+  for (const json &Pattern : Field) {
+    if (!Pattern.is_string()) {
+      Error = "expected a pattern or a list of patterns";
+      return false;
+    }
+    if (!Add(Pattern.get<std::string>(), Rule, Error)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+unique_ptr<ObfuscationPolicy> ObfuscationPolicy::parse(StringRef Buffer,
+                                                       std::string &Error) {
+  json Root = json::parse(Buffer.begin(), Buffer.end(), nullptr, false);
+  if (Root.is_discarded() || !Root.is_object() || !Root.count("rules") ||
+      !Root["rules"].is_array()) {
+    Error = "expected a JSON object with an array of \"rules\"";
+    return nullptr;
+  }
+  const json &Rules = Root["rules"];
+  unique_ptr<ObfuscationPolicy> Policy(new ObfuscationPolicy());
+  Policy->AnyName.resize(Rules.size());
+  Policy->AnyPath.resize(Rules.size());
+  auto addName = [&](StringRef Pattern, unsigned Rule, std::string &Message) {
+    return Policy->Names.add(Pattern, Rule, Message);
+  };
+  auto addPath = [&](StringRef Pattern, unsigned Rule, std::string &Message) {
+    return Policy->Paths.add(Pattern, Rule, Message);
+  };
+  for (unsigned i = 0; i < Rules.size(); i++) {
+    const json &Entry = Rules[i];
+    std::string Where = "rule " + to_string(i) + ": ";
+    if (!Entry.is_object()) {
+      Error = Where + "expected an object";
+      return nullptr;
+    }
+    Rule R;
+    for (json::const_iterator It = Entry.begin(); It != Entry.end(); ++It) {
+      const std::string &Key = It.key();
+      const json &Value = It.value();
+      if (Key == "function") {
+        R.AnyName = false;
+        if (!addPatterns(Value, i, addName, Error)) {
+          Error = Where + Error;
+          return nullptr;
+        }
+      } else if (Key == "path") {
+        R.AnyPath = false;
+        if (!addPatterns(Value, i, addPath, Error)) {
+          Error = Where + Error;
+          return nullptr;
+        }
+      } else if (Key == "linkage") {
+        R.Linkages = 0;
+        json Names = Value.is_string() ? json::array({Value}) : Value;
+        if (!Names.is_array() || Names.empty()) {
+          Error = Where + "expected a linkage or a list of linkages";
+          return nullptr;
+        }
+        for (const json &Name : Names) {
+          uint32_t Bits = R.Linkages;
+          for (const auto &Linkage : PolicyLinkages) {
+            if (Name.is_string() && Name.get<std::string>() == Linkage.first) {
+              R.Linkages |= 1u << Linkage.second;
+            }
+          }
+          if (Bits == R.Linkages) {
+            Error = Where + "unknown linkage " + Name.dump();
+            return nullptr;
+          }
+        }
+      } else if (Key == "passes") {
+        if (!Value.is_object()) {
+          Error = Where + "expected an object of \"pass\": true/false";
+          return nullptr;
+        }
+        for (json::const_iterator P = Value.begin(); P != Value.end(); ++P) {
+          if (!isOneOf(PolicyPasses, P.key()) || !P.value().is_boolean()) {
+            Error = Where + "unknown pass or not a boolean \"" + P.key() + "\"";
+            return nullptr;
+          }
+          pair<std::string, bool> Pass(P.key(), P.value().get<bool>());
+          if (Pass.first == "all") {
+            R.Passes.insert(R.Passes.begin(), Pass);
+          } else {
+            R.Passes.push_back(Pass);
+          }
+        }
+      } else if (Key == "params") {
+        if (!Value.is_object()) {
+          Error = Where + "expected an object of \"parameter\": integer";
+          return nullptr;
+        }
+        for (json::const_iterator P = Value.begin(); P != Value.end(); ++P) {
+          if (!isOneOf(PolicyParameters, P.key()) ||
+              !P.value().is_number_integer()) {
+            Error =
+                Where + "unknown parameter or not an integer \"" + P.key() + "\"";
+            return nullptr;
+          }
+          R.Parameters.emplace_back(P.key(), P.value().get<int64_t>());
+        }
+      } else {
+        Error = Where + "unknown field \"" + Key + "\"";
+        return nullptr;
+      }
+    }
+    Policy->AnyName[i] = R.AnyName;
+    Policy->AnyPath[i] = R.AnyPath;
+    Policy->Rules.push_back(std::move(R));
+  }
+  return Policy;
+}
+
+// The source file in F's debug info, empty without one
+static std::string sourcePath(const Function &F) {
+  const DISubprogram *SP = F.getSubprogram();
+  if (SP == nullptr || SP->getFilename().empty()) {
+    return "";
+  }
+  if (sys::path::is_absolute(SP->getFilename()) ||
+      SP->getDirectory().empty()) {
+    return SP->getFilename().str();
+  }
+  SmallString<128> Path(SP->getDirectory());
+  sys::path::append(Path, SP->getFilename());
+  return Path.str().str();
+}
+
+ObfuscationPolicy::Decision
+ObfuscationPolicy::decide(const Function &F) const {
+  Decision Result;
+  BitVector Matched(AnyName);
+  Names.match(F.getName(), Matched);
+  BitVector PathMatched(AnyPath);
+  std::string Path = sourcePath(F);
+  if (!Path.empty()) {
+    Paths.match(Path, PathMatched);
+  }
+  Matched &= PathMatched;
+  uint32_t Linkage = 1u << F.getLinkage();
+  for (unsigned i : Matched.set_bits()) {
+    const Rule &R = Rules[i];
+    if ((R.Linkages & Linkage) == 0) {
+      continue;
+    }
+    for (const pair<std::string, bool> &Pass : R.Passes) {
+      // "all" comes first and replaces every pass an earlier rule set
+      if (Pass.first == "all") {
+        Result.Passes.clear();
+      }
+      Result.Passes[Pass.first] = Pass.second;
+    }
+    for (const pair<std::string, int64_t> &Parameter : R.Parameters) {
+      Result.Parameters[Parameter.first] = Parameter.second;
+    }
+  }
+  return Result;
+}
+
+const ObfuscationPolicy *ObfuscationPolicy::get(StringRef Path) {
+  // Every module compiled by this process shares one instance per path
+  static std::mutex CacheLock;
+  static StringMap<ObfuscationPolicy *> Cache;
+  std::lock_guard<std::mutex> Guard(CacheLock);
+  StringMap<ObfuscationPolicy *>::iterator Cached = Cache.find(Path);
+  if (Cached != Cache.end()) {
+    return Cached->second;
+  }
+  ObfuscationPolicy *Policy = nullptr;
+  std::string Error;
+  ErrorOr<unique_ptr<MemoryBuffer>> File = MemoryBuffer::getFile(Path);
+  if (!File) {
+    Error = File.getError().message();
+  } else {
+    Policy = parse((*File)->getBuffer(), Error).release();
+  }
+  if (Policy == nullptr) {
+    errs() << "Failed To Load Obfuscation Policy From:" << Path << ": "
+           << Error << "\n";
+  } else {
+    errs() << "Loaded Obfuscation Policy From:" << Path << ", "
+           << Policy->size() << " rules\n";
+  }
+  Cache[Path] = Policy;
+  return Policy;
+}
@@ -30,6 +30,8 @@ namespace {
 struct SplitBasicBlock : public FunctionPass {
   static char ID; // Pass identification, replacement for typeid
   bool flag;
+  // -split_num for the function being split, see obfuscationParameter()
+  int splitNum = 2;
   SplitBasicBlock() : FunctionPass(ID) { this->flag = true; }
   SplitBasicBlock(bool flag) : FunctionPass(ID) { this->flag = flag; }
 
@@ -52,8 +54,9 @@ FunctionPass *llvm::createSplitBasicBlockPass(bool flag) {
 }
 
 bool SplitBasicBlock::runOnFunction(Function &F) {
+  splitNum = obfuscationParameter(&F, "split_num", SplitNum);
   // Check if the number of applications is correct
-  if (!((SplitNum > 1) && (SplitNum <= 10))) {
+  if (!((splitNum > 1) && (splitNum <= 10))) {
     errs() << "Split application basic block percentage\
             -split_num=x must be 1 < x <= 10";
     return false;
@@ -64,8 +67,10 @@ bool SplitBasicBlock::runOnFunction(Function &F) {
   // Do we obfuscate
   if (toObfuscate(flag, tmp, "split")) {
     errs() << "Running BasicBlockSplit On " << tmp->getName() << "\n";
+    ObfuscationTimeScope Scope("SplitBasicBlock", F);
     split(tmp);
     ++Split;
+    return true;
   }
 
   return false;
@@ -73,7 +78,7 @@ bool SplitBasicBlock::runOnFunction(Function &F) {
 
 void SplitBasicBlock::split(Function *f) {
   std::vector<BasicBlock *> origBB;
-  int splitN = SplitNum;
+  int splitN = splitNum;
 
   // Save all basic blocks
   for (Function::iterator I = f->begin(), IE = f->end(); I != IE; ++I) {
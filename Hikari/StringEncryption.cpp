@@ -19,17 +19,21 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "Transforms/Obfuscation/CryptoUtils.h"
 #include "Transforms/Obfuscation/Obfuscation.h"
 #include "Transforms/Obfuscation/Utils.h"
+#include "llvm/ADT/StringMap.h"
 #include <cstdlib>
 #include <iostream>
 #include <map>
@@ -37,6 +41,41 @@
 #include <string>
 using namespace llvm;
 using namespace std;
+static cl::opt<bool> PoolStrings(
+    "strcry_pool", cl::init(false),
+    cl::desc("Encrypt the strings of every function into one deduplicated "
+             "module-wide pool, decrypted once by a single loop"));
+
+// Keystream of the pool, one xorshift32 step per byte from a 32-bit seed
+static uint32_t nextPoolKey(uint32_t &State) {
+  State ^= State << 13;
+  State ^= State >> 17;
+  State ^= State << 5;
+  return State;
+}
+
+// Atomic accesses of the pool's status word need an explicit alignment
+template <typename InstTy> static void alignStatusAccess(InstTy *I) {
+#if LLVM_VERSION_MAJOR >= 11
+  I->setAlignment(Align(4));
+#elif LLVM_VERSION_MAJOR >= 10
+  I->setAlignment(MaybeAlign(4));
+#else
+  I->setAlignment(4);
+#endif
+}
+
+static uint64_t alignmentOf(GlobalVariable *GV) {
+#if LLVM_VERSION_MAJOR >= 11
+  uint64_t Align = GV->getAlign() ? GV->getAlign()->value() : 1;
+#else
+  uint64_t Align = std::max(1u, GV->getAlignment());
+#endif
+  ConstantDataSequential *CDS =
+      cast<ConstantDataSequential>(GV->getInitializer());
+  return std::max<uint64_t>(Align, CDS->getElementByteSize());
+}
+
 namespace llvm {
 struct StringEncryption : public ModulePass {
   static char ID;
@@ -49,6 +88,9 @@ struct StringEncryption : public ModulePass {
     return StringRef("StringEncryption");
   }
   bool runOnModule(Module &M) override {
+    if (PoolStrings) {
+      return HandleModulePooled(M);
+    }
     // in runOnModule. We simple iterate function list and dispatch functions
     // to handlers
     for (Module::iterator iter = M.begin(); iter != M.end(); iter++) {
@@ -56,6 +98,7 @@ struct StringEncryption : public ModulePass {
 
       if (toObfuscate(flag, F, "strenc")) {
         errs() << "Running StringEncryption On " << F->getName() << "\n";
+        ObfuscationTimeScope Scope("StringEncryption", *F);
         Constant *S = ConstantInt::get(Type::getInt32Ty(M.getContext()), 0);
         GlobalVariable *GV = new GlobalVariable(
             M, S->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
@@ -76,7 +119,6 @@ struct StringEncryption : public ModulePass {
               |
               C
     */
-    FixFunctionConstantExpr(Func);
     BasicBlock *A = &(Func->getEntryBlock());
     BasicBlock *C = A->splitBasicBlock(A->getFirstNonPHIOrDbgOrLifetime());
     C->setName("PrecedingBlock");
@@ -86,17 +128,14 @@ struct StringEncryption : public ModulePass {
     // We'll add new terminator to jump C later
     BranchInst *newBr = BranchInst::Create(B);
     ReplaceInstWithInst(A->getTerminator(), newBr);
+    // Globals referenced directly or through constant expressions. The
+    // expressions stay constants, see Replace Uses below
     set<GlobalVariable *> Globals;
-    set<User *> Users;
     for (BasicBlock &BB : *Func) {
       for (Instruction &I : BB) {
         for (Value *Op : I.operands()) {
-          if (GlobalVariable *G = dyn_cast<GlobalVariable>(Op->stripPointerCasts())) {
-            if(User* U=dyn_cast<User>(Op)){
-              Users.insert(U);
-            }
-            Users.insert(&I);
-            Globals.insert(G);
+          if (Constant *Const = dyn_cast<Constant>(Op)) {
+            collectGlobals(Const, Globals);
           }
         }
       }
@@ -204,10 +243,13 @@ struct StringEncryption : public ModulePass {
         errs() << "Unsupported CDS Type\n";
         abort();
       }
-      // Prepare new rawGV
+      // Prepare new rawGV. Only this function references it, so it is always
+      // private. Copying GV's linkage would clash across ThinLTO backends
+      // for promoted strings, or leave an available_externally definition
       GlobalVariable *EncryptedRawGV = new GlobalVariable(
           *(GV->getParent()), EncryptedConst->getType(), false,
-          GV->getLinkage(), EncryptedConst, "EncryptedString", nullptr,
+          GlobalValue::LinkageTypes::PrivateLinkage, EncryptedConst,
+          "EncryptedString", nullptr,
           GV->getThreadLocalMode(), GV->getType()->getAddressSpace());
       old2new[GV] = EncryptedRawGV;
       GV2Keys[EncryptedRawGV] = KeyConst;
@@ -238,23 +280,39 @@ struct StringEncryption : public ModulePass {
       Constant *newCS =
           ConstantStruct::get(CS->getType(), ArrayRef<Constant *>(vals));
       GlobalVariable *EncryptedOCGV = new GlobalVariable(
-          *(GV->getParent()), newCS->getType(), false, GV->getLinkage(), newCS,
+          *(GV->getParent()), newCS->getType(), false,
+          GlobalValue::LinkageTypes::PrivateLinkage, newCS,
           "EncryptedObjCString", nullptr, GV->getThreadLocalMode(),
           GV->getType()->getAddressSpace());
       old2new[GV] = EncryptedOCGV;
     } // End prepare ObjC new GV
-    // Replace Uses
-    for (User *U : Users) {
-      for (map<GlobalVariable *, GlobalVariable *>::iterator iter =
-               old2new.begin();
-           iter != old2new.end(); ++iter) {
-        U->replaceUsesOfWith(iter->first, iter->second);
-        iter->first->removeDeadConstantUsers();
+    // Replace Uses. Only the constant operands referencing an encrypted
+    // global are rebuilt, in place, so no instruction is materialized
+    map<GlobalVariable *, Constant *> Replacements(old2new.begin(),
+                                                  old2new.end());
+    map<Constant *, Constant *> Rebased;
+    for (BasicBlock &BB : *Func) {
+      for (Instruction &I : BB) {
+        for (unsigned i = 0; i < I.getNumOperands(); i++) {
+          if (Constant *Op = dyn_cast<Constant>(I.getOperand(i))) {
+            Constant *New = rebase(Op, Replacements, Rebased);
+            if (New != Op) {
+              I.setOperand(i, New);
+            }
+          }
+        }
       }
+    }
+    for (map<GlobalVariable *, GlobalVariable *>::iterator iter =
+             old2new.begin();
+         iter != old2new.end(); ++iter) {
+      iter->first->removeDeadConstantUsers();
     } // End Replace Uses
     // CleanUp Old ObjC GVs
+    // Globals visible outside this module, such as strings ThinLTO promoted
+    // so other backends can import functions using them, are kept
     for (GlobalVariable *GV : objCStrings) {
-      if (GV->getNumUses() == 0) {
+      if (GV->getNumUses() == 0 && GV->hasLocalLinkage()) {
         GV->dropAllReferences();
         old2new.erase(GV);
         GV->eraseFromParent();
@@ -266,7 +324,7 @@ struct StringEncryption : public ModulePass {
          iter != old2new.end(); ++iter) {
       GlobalVariable *toDelete = iter->first;
       toDelete->removeDeadConstantUsers();
-      if (toDelete->getNumUses() == 0) {
+      if (toDelete->getNumUses() == 0 && toDelete->hasLocalLinkage()) {
         toDelete->dropAllReferences();
         toDelete->eraseFromParent();
       }
@@ -321,6 +379,383 @@ struct StringEncryption : public ModulePass {
     }
     IRB.CreateBr(C);
   } // End of HandleDecryptionBlock
+  /*
+    -strcry_pool: the strings all the obfuscated functions reference are
+    encrypted into one private pool, each distinct string once, with a 32-bit
+    seed for the keystream instead of a key per element. A function using the
+    pool checks one status word at entry and the first to find it unset
+    decrypts the whole pool. Under full LTO the pool covers the program.
+    Only local strings are pooled. Strings with a significant address get a
+    slot of their own and are only pooled when no other code uses them.
+  */
+  bool HandleModulePooled(Module &M) {
+    ObfuscationTimeScope Scope("StringEncryption", M);
+    LLVMContext &Ctx = M.getContext();
+    vector<Function *> Funcs;
+    set<Function *> FuncSet;
+    for (Function &F : M) {
+      if (toObfuscate(flag, &F, "strenc")) {
+        errs() << "Running StringEncryption On " << F.getName() << "\n";
+        Funcs.push_back(&F);
+        FuncSet.insert(&F);
+      }
+    }
+    // Strings and ObjC string objects referenced by those functions
+    vector<GlobalVariable *> Strings;
+    vector<GlobalVariable *> ObjCStrings;
+    set<GlobalVariable *> Seen;
+    uint64_t References = 0, ReferencedBytes = 0;
+#if LLVM_VERSION_MAJOR >= 12
+    StructType *CFStringTy =
+        StructType::getTypeByName(Ctx, "struct.__NSConstantString_tag");
+#else
+    StructType *CFStringTy = M.getTypeByName("struct.__NSConstantString_tag");
+#endif
+    auto addString = [&](GlobalVariable *GV) {
+      if (Seen.insert(GV).second) {
+        Strings.push_back(GV);
+      }
+    };
+    for (Function *F : Funcs) {
+      set<GlobalVariable *> Used;
+      for (BasicBlock &BB : *F) {
+        for (Instruction &I : BB) {
+          for (Value *Op : I.operands()) {
+            if (Constant *C = dyn_cast<Constant>(Op)) {
+              collectGlobals(C, Used);
+            }
+          }
+        }
+      }
+      for (GlobalVariable *GV : Used) {
+        GlobalVariable *Raw = GV;
+        if (isPoolable(GV, FuncSet)) {
+          addString(GV);
+        } else if (CFStringTy != nullptr && GV->hasInitializer() &&
+                   GV->getInitializer()->getType() == CFStringTy &&
+                   isa<ConstantStruct>(GV->getInitializer())) {
+          Raw = dyn_cast<GlobalVariable>(
+              GV->getInitializer()->getOperand(2)->stripPointerCasts());
+          if (Raw == nullptr || !isPoolable(Raw, FuncSet, true)) {
+            continue;
+          }
+          addString(Raw);
+          if (Seen.insert(GV).second) {
+            ObjCStrings.push_back(GV);
+          }
+        } else {
+          continue;
+        }
+        References++;
+        ReferencedBytes +=
+            M.getDataLayout().getTypeAllocSize(Raw->getValueType());
+      }
+    }
+    if (Strings.empty()) {
+      return false;
+    }
+    // Lay out the pool, identical strings whose address doesn't matter share
+    // one slot
+    const DataLayout &DL = M.getDataLayout();
+    vector<uint8_t> Pool;
+    StringMap<uint64_t> Slots;
+    map<GlobalVariable *, uint64_t> Offsets;
+    uint64_t MaxAlign = 1, Distinct = 0;
+    for (GlobalVariable *GV : Strings) {
+      ConstantDataSequential *CDS =
+          cast<ConstantDataSequential>(GV->getInitializer());
+      unsigned Width = CDS->getElementByteSize();
+      std::string Bytes;
+      for (unsigned i = 0; i < CDS->getNumElements(); i++) {
+        uint64_t V = CDS->getElementAsInteger(i);
+        for (unsigned b = 0; b < Width; b++) {
+          unsigned Shift = DL.isLittleEndian() ? b : Width - 1 - b;
+          Bytes.push_back(char(V >> (8 * Shift)));
+        }
+      }
+      std::string Key = std::string(1, char(Width)) + Bytes;
+      bool Shared = GV->hasAtLeastLocalUnnamedAddr();
+      StringMap<uint64_t>::iterator Slot = Slots.find(Key);
+      if (Shared && Slot != Slots.end()) {
+        Offsets[GV] = Slot->second;
+        continue;
+      }
+      uint64_t Align = alignmentOf(GV);
+      MaxAlign = std::max(MaxAlign, Align);
+      uint64_t Offset = alignTo(Pool.size(), Align);
+      Pool.resize(Offset);
+      Pool.insert(Pool.end(), Bytes.begin(), Bytes.end());
+      Offsets[GV] = Offset;
+      if (Shared) {
+        Slots[Key] = Offset;
+      }
+      Distinct++;
+    }
+    uint32_t Seed = cryptoutils->get_uint32_t() | 1;
+    uint32_t State = Seed;
+    for (uint8_t &Byte : Pool) {
+      Byte ^= uint8_t(nextPoolKey(State));
+    }
+    GlobalVariable *PoolGV = new GlobalVariable(
+        M, ArrayType::get(Type::getInt8Ty(Ctx), Pool.size()), false,
+        GlobalValue::PrivateLinkage,
+        ConstantDataArray::get(Ctx, ArrayRef<uint8_t>(Pool)),
+        "EncryptedStringPool");
+#if LLVM_VERSION_MAJOR >= 10
+    PoolGV->setAlignment(MaybeAlign(MaxAlign));
+#else
+    PoolGV->setAlignment(MaxAlign);
+#endif
+    // 0 while encrypted, 1 while being decrypted and 2 once decrypted
+    GlobalVariable *StatusGV = new GlobalVariable(
+        M, Type::getInt32Ty(Ctx), false, GlobalValue::PrivateLinkage,
+        ConstantInt::get(Type::getInt32Ty(Ctx), 0), "");
+#if LLVM_VERSION_MAJOR >= 10
+    StatusGV->setAlignment(MaybeAlign(4));
+#else
+    StatusGV->setAlignment(4);
+#endif
+    Function *Decrypt =
+        CreatePoolDecryptionFunction(M, PoolGV, StatusGV, Seed);
+    // Pool slices replacing the strings, then the ObjC objects pointing
+    // to them
+    map<GlobalVariable *, Constant *> Replacements;
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    for (GlobalVariable *GV : Strings) {
+      Constant *Indices[] = {ConstantInt::get(Int64Ty, 0),
+                             ConstantInt::get(Int64Ty, Offsets[GV])};
+      Constant *Slice = ConstantExpr::getInBoundsGetElementPtr(
+          PoolGV->getValueType(), PoolGV, Indices);
+      Replacements[GV] = ConstantExpr::getPointerCast(Slice, GV->getType());
+    }
+    for (GlobalVariable *GV : ObjCStrings) {
+      ConstantStruct *CS = cast<ConstantStruct>(GV->getInitializer());
+      GlobalVariable *Raw =
+          cast<GlobalVariable>(CS->getOperand(2)->stripPointerCasts());
+      Constant *Vals[] = {CS->getOperand(0), CS->getOperand(1),
+                          ConstantExpr::getPointerCast(
+                              Replacements[Raw], CS->getOperand(2)->getType()),
+                          CS->getOperand(3)};
+      GlobalVariable *EncryptedOCGV = new GlobalVariable(
+          M, CS->getType(), false, GlobalValue::LinkageTypes::PrivateLinkage,
+          ConstantStruct::get(CS->getType(), Vals), "EncryptedObjCString",
+          nullptr, GV->getThreadLocalMode(), GV->getType()->getAddressSpace());
+      Replacements[GV] = EncryptedOCGV;
+    }
+    // Rewrite the constant operands in place, nothing is materialized
+    map<Constant *, Constant *> Rebased;
+    for (Function *F : Funcs) {
+      bool UsesPool = false;
+      for (BasicBlock &BB : *F) {
+        for (Instruction &I : BB) {
+          for (unsigned i = 0; i < I.getNumOperands(); i++) {
+            Constant *C = dyn_cast<Constant>(I.getOperand(i));
+            if (C == nullptr) {
+              continue;
+            }
+            Constant *New = rebase(C, Replacements, Rebased);
+            if (New != C) {
+              I.setOperand(i, New);
+              UsesPool = true;
+            }
+          }
+        }
+      }
+      if (UsesPool) {
+        InsertPoolCheck(F, StatusGV, Decrypt);
+      }
+    }
+    // Drop the plaintext no one else uses, ObjC objects first
+    uint64_t Removed = 0;
+    for (vector<GlobalVariable *> *GVs : {&ObjCStrings, &Strings}) {
+      for (GlobalVariable *GV : *GVs) {
+        GV->removeDeadConstantUsers();
+        if (GV->use_empty() && GV->hasLocalLinkage()) {
+          Removed += DL.getTypeAllocSize(GV->getValueType());
+          GV->eraseFromParent();
+        }
+      }
+    }
+    errs() << "StringEncryption pooled " << References
+           << " string references of " << Funcs.size() << " functions into "
+           << Distinct << " strings, a " << Pool.size()
+           << " byte pool with a 4 byte seed. Per function they take "
+           << ReferencedBytes << " bytes of encrypted copies and as many "
+           << "bytes of keys, " << Removed
+           << " bytes of plaintext were removed\n";
+    return true;
+  }
+  // Global variables C references, looking through constant expressions
+  void collectGlobals(Constant *C, set<GlobalVariable *> &Globals) {
+    if (GlobalVariable *GV = dyn_cast<GlobalVariable>(C)) {
+      Globals.insert(GV);
+    } else if (isa<ConstantExpr>(C)) {
+      for (Value *Op : C->operands()) {
+        collectGlobals(cast<Constant>(Op), Globals);
+      }
+    }
+  }
+  // Same candidates as HandleFunction's raw strings, restricted to what can
+  // be moved into the pool without other code noticing
+  bool isPoolable(GlobalVariable *GV, const set<Function *> &Funcs,
+                  bool ObjCBacking = false) {
+    if (!GV->hasLocalLinkage() || !GV->isConstant() ||
+        !GV->hasDefinitiveInitializer() || GV->isThreadLocal() ||
+        GV->getType()->getAddressSpace() != 0 ||
+        GV->getSection() == StringRef("llvm.metadata") ||
+        GV->getSection().find(StringRef("__objc")) != string::npos ||
+        GV->getName().find("OBJC") != string::npos) {
+      return false;
+    }
+    ConstantDataSequential *CDS =
+        dyn_cast<ConstantDataSequential>(GV->getInitializer());
+    if (CDS == nullptr || !CDS->getElementType()->isIntegerTy() ||
+        CDS->isZeroValue()) {
+      return false;
+    }
+    if (GV->hasAtLeastLocalUnnamedAddr() || ObjCBacking) {
+      return true;
+    }
+    // Its address is significant, every use has to move to the pool
+    SmallVector<User *, 8> Users(GV->user_begin(), GV->user_end());
+    while (!Users.empty()) {
+      User *U = Users.pop_back_val();
+      if (Instruction *I = dyn_cast<Instruction>(U)) {
+        if (Funcs.count(I->getFunction()) == 0) {
+          return false;
+        }
+      } else if (isa<ConstantExpr>(U)) {
+        Users.append(U->user_begin(), U->user_end());
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+  // C with the globals in Replacements replaced, C itself if it uses none
+  // of them. Rebased caches the rebuilt constant expressions.
+  Constant *rebase(Constant *C, map<GlobalVariable *, Constant *> &Replacements,
+                   map<Constant *, Constant *> &Rebased) {
+    if (GlobalVariable *GV = dyn_cast<GlobalVariable>(C)) {
+      map<GlobalVariable *, Constant *>::iterator It = Replacements.find(GV);
+      return It == Replacements.end() ? C : It->second;
+    }
+    ConstantExpr *CE = dyn_cast<ConstantExpr>(C);
+    if (CE == nullptr) {
+      return C;
+    }
+    map<Constant *, Constant *>::iterator Done = Rebased.find(C);
+    if (Done != Rebased.end()) {
+      return Done->second;
+    }
+    SmallVector<Constant *, 4> Ops;
+    bool Changed = false;
+    for (Value *Op : CE->operands()) {
+      Ops.push_back(rebase(cast<Constant>(Op), Replacements, Rebased));
+      Changed |= Ops.back() != Op;
+    }
+    Constant *Result = Changed ? CE->getWithOperands(Ops) : C;
+    Rebased[C] = Result;
+    return Result;
+  }
+  // Calls Decrypt from a block of its own unless the pool is decrypted
+  // already. Static allocas stay in the entry block.
+  void InsertPoolCheck(Function *F, GlobalVariable *StatusGV,
+                       Function *Decrypt) {
+    BasicBlock *A = &F->getEntryBlock();
+    BasicBlock::iterator SplitPt = A->getFirstInsertionPt();
+    while (isa<AllocaInst>(*SplitPt) || isa<DbgInfoIntrinsic>(*SplitPt)) {
+      ++SplitPt;
+    }
+    BasicBlock *C = A->splitBasicBlock(SplitPt, "PrecedingBlock");
+    BasicBlock *B =
+        BasicBlock::Create(F->getContext(), "StringDecryptionBB", F, C);
+    IRBuilder<> IRB(A->getTerminator());
+    Type *Int32Ty = Type::getInt32Ty(F->getContext());
+    LoadInst *LI = IRB.CreateLoad(Int32Ty, StatusGV, "LoadEncryptionStatus");
+    LI->setAtomic(AtomicOrdering::Acquire);
+    alignStatusAccess(LI);
+    Value *Decrypted = IRB.CreateICmpEQ(LI, ConstantInt::get(Int32Ty, 2));
+    BranchInst *Br = BranchInst::Create(C, B, Decrypted);
+    Br->setMetadata(LLVMContext::MD_prof,
+                    MDBuilder(F->getContext()).createBranchWeights(2000, 1));
+    ReplaceInstWithInst(A->getTerminator(), Br);
+    IRBuilder<> IRBB(B);
+    IRBB.CreateCall(Decrypt);
+    IRBB.CreateBr(C);
+  }
+  // void Decrypt(): the caller winning the 0 -> 1 exchange on the status
+  // decrypts the pool and publishes it with 2, the others wait for that
+  Function *CreatePoolDecryptionFunction(Module &M, GlobalVariable *PoolGV,
+                                         GlobalVariable *StatusGV,
+                                         uint32_t Seed) {
+    LLVMContext &Ctx = M.getContext();
+    Type *Int8Ty = Type::getInt8Ty(Ctx);
+    Type *Int32Ty = Type::getInt32Ty(Ctx);
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    Function *F = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), false),
+        GlobalValue::PrivateLinkage, "DecryptStringPool", &M);
+    F->addFnAttr(Attribute::NoInline);
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "Entry", F);
+    BasicBlock *Claim = BasicBlock::Create(Ctx, "Claim", F);
+    BasicBlock *Wait = BasicBlock::Create(Ctx, "Wait", F);
+    BasicBlock *Loop = BasicBlock::Create(Ctx, "Decrypt", F);
+    BasicBlock *Publish = BasicBlock::Create(Ctx, "Publish", F);
+    BasicBlock *Done = BasicBlock::Create(Ctx, "Done", F);
+    Constant *Zero = ConstantInt::get(Int32Ty, 0);
+    Constant *One = ConstantInt::get(Int32Ty, 1);
+    Constant *Two = ConstantInt::get(Int32Ty, 2);
+    auto loadStatus = [&](IRBuilder<> &IRB) {
+      LoadInst *LI = IRB.CreateLoad(Int32Ty, StatusGV, "Status");
+      LI->setAtomic(AtomicOrdering::Acquire);
+      alignStatusAccess(LI);
+      return IRB.CreateICmpEQ(LI, Two);
+    };
+    IRBuilder<> IRB(Entry);
+    IRB.CreateCondBr(loadStatus(IRB), Done, Claim);
+    IRB.SetInsertPoint(Claim);
+#if LLVM_VERSION_MAJOR >= 13
+    Value *Exchange = IRB.CreateAtomicCmpXchg(StatusGV, Zero, One, MaybeAlign(4),
+                                              AtomicOrdering::Acquire,
+                                              AtomicOrdering::Acquire);
+#else
+    Value *Exchange = IRB.CreateAtomicCmpXchg(
+        StatusGV, Zero, One, AtomicOrdering::Acquire, AtomicOrdering::Acquire);
+#endif
+    IRB.CreateCondBr(IRB.CreateExtractValue(Exchange, 1), Loop, Wait);
+    IRB.SetInsertPoint(Wait);
+    IRB.CreateCondBr(loadStatus(IRB), Done, Wait);
+    // The keystream of nextPoolKey(), one step per byte
+    IRB.SetInsertPoint(Loop);
+    PHINode *Index = IRB.CreatePHI(Int64Ty, 2, "Index");
+    PHINode *State = IRB.CreatePHI(Int32Ty, 2, "State");
+    Index->addIncoming(ConstantInt::get(Int64Ty, 0), Claim);
+    State->addIncoming(ConstantInt::get(Int32Ty, Seed), Claim);
+    Value *Next = IRB.CreateXor(State, IRB.CreateShl(State, 13));
+    Next = IRB.CreateXor(Next, IRB.CreateLShr(Next, 17));
+    Next = IRB.CreateXor(Next, IRB.CreateShl(Next, 5));
+    Value *Indices[] = {ConstantInt::get(Int64Ty, 0), Index};
+    Value *Ptr = IRB.CreateInBoundsGEP(PoolGV->getValueType(), PoolGV, Indices);
+    Value *Byte = IRB.CreateLoad(Int8Ty, Ptr, "EncryptedChar");
+    IRB.CreateStore(IRB.CreateXor(Byte, IRB.CreateTrunc(Next, Int8Ty)), Ptr);
+    Value *NextIndex = IRB.CreateAdd(Index, ConstantInt::get(Int64Ty, 1));
+    Index->addIncoming(NextIndex, Loop);
+    State->addIncoming(Next, Loop);
+    uint64_t Size =
+        cast<ArrayType>(PoolGV->getValueType())->getNumElements();
+    IRB.CreateCondBr(
+        IRB.CreateICmpULT(NextIndex, ConstantInt::get(Int64Ty, Size)), Loop,
+        Publish);
+    IRB.SetInsertPoint(Publish);
+    StoreInst *SI = IRB.CreateStore(Two, StatusGV);
+    alignStatusAccess(SI);
+    SI->setAtomic(AtomicOrdering::Release);
+    IRB.CreateBr(Done);
+    IRB.SetInsertPoint(Done);
+    IRB.CreateRetVoid();
+    return F;
+  }
   bool doFinalization(Module &M) override {
     encstatus.clear();
     return false;
@@ -13,10 +13,20 @@
 //===----------------------------------------------------------------------===//
 
 #include "Transforms/Obfuscation/Substitution.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 #include "Transforms/Obfuscation/Utils.h"
+#include <deque>
 
 #define DEBUG_TYPE "substitution"
 
@@ -35,6 +45,32 @@ static cl::opt<unsigned int>
                 cl::desc("Choose the probability [%] each basic blocks will be "
                          "obfuscated by the InstructioSubstitution pass"),
                 cl::value_desc("probability rate"), cl::init(50), cl::Optional);
+static cl::opt<bool> SkipVectorizable(
+    "sub_skip_vectorizable", cl::init(false),
+    cl::desc("Leave innermost loops the vectorizer may still transform "
+             "untouched"),
+    cl::Optional);
+static cl::opt<bool> Worklist(
+    "sub_worklist", cl::init(false),
+    cl::desc("Rewrite every original instruction at most -sub_loop times, "
+             "including the instructions its rewrites create, instead of "
+             "rescanning the function -sub_loop times"),
+    cl::Optional);
+static cl::opt<double> MaxGrowth(
+    "sub_max_growth", cl::init(4.0),
+    cl::desc("With -sub_worklist, stop once a function has grown to this many "
+             "times its instruction count, 0 for no limit"),
+    cl::value_desc("factor"), cl::Optional);
+static cl::opt<bool> CostModel(
+    "sub_cost_model", cl::init(false),
+    cl::desc("Pick cheap rewrites in hot blocks and expensive ones in cold "
+             "blocks, by their TargetTransformInfo cost, instead of uniformly"),
+    cl::Optional);
+static cl::opt<unsigned> HotFreq(
+    "sub_hot_freq", cl::init(8),
+    cl::desc("With -sub_cost_model, blocks running this many times per call "
+             "are hot, blocks running less than once are cold"),
+    cl::value_desc("frequency"), cl::Optional);
 
 // Stats
 STATISTIC(Add, "Add substitued");
@@ -46,6 +82,37 @@ STATISTIC(Sub, "Sub substitued");
 STATISTIC(And, "And substitued");
 STATISTIC(Or, "Or substitued");
 STATISTIC(Xor, "Xor substitued");
+STATISTIC(SkippedBlocks, "Blocks left to the vectorizer");
+STATISTIC(GrowthInstructions, "Instructions added by -sub_worklist");
+STATISTIC(RewriteCost, "TTI cost of the -sub_cost_model rewrites");
+
+// Opcodes each rewrite emits, in the order of the funcAdd, funcSub, funcAnd,
+// funcOr and funcXor tables. Not is an xor with -1, neg a sub from 0.
+static const std::vector<unsigned> AddOpcodes[NUMBER_ADD_SUBST] = {
+    {Instruction::Sub, Instruction::Sub},
+    {Instruction::Sub, Instruction::Sub, Instruction::Add, Instruction::Sub},
+    {Instruction::Add, Instruction::Add, Instruction::Sub},
+    {Instruction::Sub, Instruction::Add, Instruction::Add}};
+static const std::vector<unsigned> SubOpcodes[NUMBER_SUB_SUBST] = {
+    {Instruction::Sub, Instruction::Add},
+    {Instruction::Add, Instruction::Sub, Instruction::Sub},
+    {Instruction::Sub, Instruction::Sub, Instruction::Add}};
+static const std::vector<unsigned> AndOpcodes[NUMBER_AND_SUBST] = {
+    {Instruction::Xor, Instruction::Xor, Instruction::And},
+    {Instruction::Xor, Instruction::Xor, Instruction::Xor, Instruction::Or,
+     Instruction::Or, Instruction::Xor, Instruction::And}};
+static const std::vector<unsigned> OrOpcodes[NUMBER_OR_SUBST] = {
+    {Instruction::And, Instruction::Xor, Instruction::Or},
+    {Instruction::Xor, Instruction::Xor, Instruction::Xor, Instruction::And,
+     Instruction::And, Instruction::And, Instruction::And, Instruction::Or,
+     Instruction::Or, Instruction::Xor, Instruction::Or, Instruction::Xor,
+     Instruction::Or, Instruction::And, Instruction::Or}};
+static const std::vector<unsigned> XorOpcodes[NUMBER_XOR_SUBST] = {
+    {Instruction::Xor, Instruction::And, Instruction::Xor, Instruction::And,
+     Instruction::Or},
+    {Instruction::Xor, Instruction::And, Instruction::Xor, Instruction::And,
+     Instruction::Xor, Instruction::And, Instruction::And, Instruction::Or,
+     Instruction::Or, Instruction::Xor}};
 
 namespace {
 
@@ -57,6 +124,23 @@ struct Substitution : public FunctionPass {
   void (Substitution::*funcOr[NUMBER_OR_SUBST])(BinaryOperator *bo);
   void (Substitution::*funcXor[NUMBER_XOR_SUBST])(BinaryOperator *bo);
   bool flag;
+  // Cost model of -sub_cost_model. The scheduler and the new pass manager
+  // wrapper hand over their own, run from a legacy pass manager the pass
+  // looks it up.
+  TTIGetter GetTTI;
+  TargetTransformInfoWrapperPass *TTIWP = nullptr;
+  TargetTransformInfo *TTI = nullptr;
+  DenseMap<std::pair<Type *, unsigned>, unsigned> OpcodeCosts;
+  // -1 for cold blocks, 1 for hot ones
+  DenseMap<BasicBlock *, int> Hotness;
+  // -sub_loop and -sub_prob for the function being obfuscated, see
+  // obfuscationParameter()
+  int times = 1;
+  unsigned probRate = 50;
+  Substitution(bool flag, TargetTransformInfoWrapperPass *TTIWP)
+      : Substitution(flag) {
+    this->TTIWP = TTIWP;
+  }
   Substitution(bool flag) : Substitution() { this->flag = flag; }
   Substitution() : FunctionPass(ID) {
     this->flag = true;
@@ -81,6 +165,12 @@ struct Substitution : public FunctionPass {
 
   bool runOnFunction(Function &F);
   bool substitute(Function *f);
+  bool substituteBounded(Function *f,
+                         const SmallPtrSetImpl<BasicBlock *> &skipped);
+  bool rewrite(BinaryOperator *bo);
+  unsigned pick(BinaryOperator *bo, unsigned count,
+                const std::vector<unsigned> *opcodes);
+  unsigned opcodeCost(unsigned opcode, Type *ty);
 
   void addNeg(BinaryOperator *bo);
   void addDoubleNeg(BinaryOperator *bo);
@@ -102,6 +192,68 @@ struct Substitution : public FunctionPass {
 };
 } // namespace
 
+// Random constant of an integer or integer vector type, each lane drawn on
+// its own, so the rewrites also apply after the vectorizers ran. The lanes
+// of a scalable vector aren't known at compile time, it gets a splat.
+static Constant *randomConstant(Type *ty) {
+  if (VectorType *VT = dyn_cast<VectorType>(ty)) {
+#if LLVM_VERSION_MAJOR >= 11
+    FixedVectorType *FVT = dyn_cast<FixedVectorType>(VT);
+    if (!FVT) {
+      return ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+    }
+    unsigned lanes = FVT->getNumElements();
+#else
+    unsigned lanes = VT->getNumElements();
+#endif
+    SmallVector<Constant *, 16> elements;
+    for (unsigned i = 0; i < lanes; i++) {
+      elements.push_back(randomConstant(VT->getElementType()));
+    }
+    return ConstantVector::get(elements);
+  }
+  return ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+}
+
+// An innermost loop is left to the vectorizer unless it was vectorized
+// already or its metadata turns vectorization off. Substituting it first
+// turns every add into a dependency chain the cost model rejects.
+static bool mayBeVectorized(Loop *L) {
+  if (!L->getSubLoops().empty()) {
+    return false;
+  }
+  MDNode *LoopID = L->getLoopID();
+  if (LoopID == nullptr) {
+    return true;
+  }
+  for (unsigned i = 1; i < LoopID->getNumOperands(); i++) {
+    MDNode *MD = dyn_cast<MDNode>(LoopID->getOperand(i));
+    if (MD == nullptr || MD->getNumOperands() == 0) {
+      continue;
+    }
+    MDString *Name = dyn_cast<MDString>(MD->getOperand(0));
+    if (Name == nullptr) {
+      continue;
+    }
+    ConstantInt *Value = nullptr;
+    if (MD->getNumOperands() > 1) {
+      Value = mdconst::dyn_extract<ConstantInt>(MD->getOperand(1));
+    }
+    if (Name->getString() == "llvm.loop.isvectorized") {
+      return false;
+    }
+    if (Name->getString() == "llvm.loop.vectorize.enable" && Value &&
+        Value->isZero()) {
+      return false;
+    }
+    if (Name->getString() == "llvm.loop.vectorize.width" && Value &&
+        Value->isOne()) {
+      return false;
+    }
+  }
+  return true;
+}
+
 char Substitution::ID = 0;
 INITIALIZE_PASS(Substitution, "subobf", "Enable Instruction Substitution.",
                 true, true)
@@ -109,13 +261,23 @@ FunctionPass *llvm::createSubstitutionPass() { return new Substitution(); }
 FunctionPass *llvm::createSubstitutionPass(bool flag) {
   return new Substitution(flag);
 }
+FunctionPass *
+llvm::createSubstitutionPass(bool flag,
+                             TargetTransformInfoWrapperPass *TTIWP) {
+  return new Substitution(flag, TTIWP);
+}
+void llvm::setSubstitutionTTI(FunctionPass *P, TTIGetter GetTTI) {
+  static_cast<Substitution *>(P)->GetTTI = std::move(GetTTI);
+}
 bool Substitution::runOnFunction(Function &F) {
+  times = obfuscationParameter(&F, "sub_loop", ObfTimes);
+  probRate = obfuscationParameter(&F, "sub_prob", ObfProbRate);
   // Check if the percentage is correct
-  if (ObfTimes <= 0) {
+  if (times <= 0) {
     errs() << "Substitution application number -sub_loop=x must be x > 0";
     return false;
   }
-  if (ObfProbRate > 100) {
+  if (probRate > 100) {
     errs() << "InstructionSubstitution application instruction percentage "
               "-sub_prob=x must be 0 < x <= 100";
     return false;
@@ -125,7 +287,23 @@ bool Substitution::runOnFunction(Function &F) {
   // Do we obfuscate
   if (toObfuscate(flag, tmp, "sub")) {
     errs() << "Running Instruction Substitution On " << F.getName() << "\n";
+    ObfuscationTimeScope Scope("Substitution", F);
+    TargetTransformInfo DefaultTTI(F.getParent()->getDataLayout());
+    TTI = &DefaultTTI;
+    if (CostModel && GetTTI) {
+      TTI = &GetTTI(F);
+    } else if (CostModel) {
+      if (TTIWP == nullptr && getResolver() != nullptr) {
+        TTIWP = getAnalysisIfAvailable<TargetTransformInfoWrapperPass>();
+      }
+      if (TTIWP != nullptr) {
+        TTI = &TTIWP->getTTI(F);
+      }
+    }
     substitute(tmp);
+    TTI = nullptr;
+    OpcodeCosts.clear();
+    Hotness.clear();
     return true;
   }
 
@@ -135,75 +313,199 @@ bool Substitution::runOnFunction(Function &F) {
 bool Substitution::substitute(Function *f) {
   Function *tmp = f;
 
+  SmallPtrSet<BasicBlock *, 16> skipped;
+  if (SkipVectorizable || CostModel) {
+    FunctionAnalyses FA(*f);
+    LoopInfo &LI = FA.getLoopInfo();
+    if (SkipVectorizable) {
+      for (Loop *L : LI.getLoopsInPreorder()) {
+        if (mayBeVectorized(L)) {
+          skipped.insert(L->block_begin(), L->block_end());
+        }
+      }
+      SkippedBlocks += skipped.size();
+    }
+    if (CostModel) {
+      // Frequencies relative to the entry block, from the profile if there
+      // is one and estimated from the loops and branches otherwise
+      BlockFrequencyInfo &BFI = FA.getBFI();
+      uint64_t entry = BFI.getBlockFreq(&f->getEntryBlock()).getFrequency();
+      for (BasicBlock &BB : *f) {
+        uint64_t freq = BFI.getBlockFreq(&BB).getFrequency();
+        if (freq >= entry * HotFreq) {
+          Hotness[&BB] = 1;
+        } else if (freq < entry) {
+          Hotness[&BB] = -1;
+        }
+      }
+    }
+  }
+
+  if (Worklist) {
+    return substituteBounded(f, skipped);
+  }
+
   // Loop for the number of time we run the pass on the function
-  int times = ObfTimes;
+  int loops = times;
   do {
     for (Function::iterator bb = tmp->begin(); bb != tmp->end(); ++bb) {
+      if (skipped.count(&*bb)) {
+        continue;
+      }
       for (BasicBlock::iterator inst = bb->begin(); inst != bb->end(); ++inst) {
-        if (inst->isBinaryOp() && cryptoutils->get_range(100) <= ObfProbRate) {
-          switch (inst->getOpcode()) {
-          case BinaryOperator::Add:
-            // case BinaryOperator::FAdd:
-            // Substitute with random add operation
-            (this->*funcAdd[llvm::cryptoutils->get_range(NUMBER_ADD_SUBST)])(
-                cast<BinaryOperator>(inst));
-            ++Add;
-            break;
-          case BinaryOperator::Sub:
-            // case BinaryOperator::FSub:
-            // Substitute with random sub operation
-            (this->*funcSub[llvm::cryptoutils->get_range(NUMBER_SUB_SUBST)])(
-                cast<BinaryOperator>(inst));
-            ++Sub;
-            break;
-          case BinaryOperator::Mul:
-          case BinaryOperator::FMul:
-            //++Mul;
-            break;
-          case BinaryOperator::UDiv:
-          case BinaryOperator::SDiv:
-          case BinaryOperator::FDiv:
-            //++Div;
-            break;
-          case BinaryOperator::URem:
-          case BinaryOperator::SRem:
-          case BinaryOperator::FRem:
-            //++Rem;
-            break;
-          case Instruction::Shl:
-            //++Shi;
-            break;
-          case Instruction::LShr:
-            //++Shi;
-            break;
-          case Instruction::AShr:
-            //++Shi;
-            break;
-          case Instruction::And:
-            (this->*funcAnd[llvm::cryptoutils->get_range(2)])(
-                cast<BinaryOperator>(inst));
-            ++And;
-            break;
-          case Instruction::Or:
-            (this->*funcOr[llvm::cryptoutils->get_range(2)])(
-                cast<BinaryOperator>(inst));
-            ++Or;
-            break;
-          case Instruction::Xor:
-            (this->*funcXor[llvm::cryptoutils->get_range(2)])(
-                cast<BinaryOperator>(inst));
-            ++Xor;
-            break;
-          default:
-            break;
-          }              // End switch
+        if (inst->isBinaryOp() && cryptoutils->get_range(100) <= probRate) {
+          rewrite(cast<BinaryOperator>(inst));
         }                // End isBinaryOp
       }                  // End for basickblock
     }                    // End for Function
-  } while (--times > 0); // for times
+  } while (--loops > 0); // for times
   return false;
 }
 
+// Every instruction of the original function may be rewritten -sub_loop
+// times, counting the rewrites of the instructions created for it. The
+// growth is linear in -sub_loop instead of geometric, and the pass stops
+// once the function reaches -sub_max_growth times its original size.
+bool Substitution::substituteBounded(
+    Function *f, const SmallPtrSetImpl<BasicBlock *> &skipped) {
+  // Worklist entries index the rewrite budget of their original instruction
+  std::deque<std::pair<BinaryOperator *, unsigned>> worklist;
+  std::vector<int> budget;
+  uint64_t original = 0;
+  for (BasicBlock &BB : *f) {
+    original += BB.size();
+    if (skipped.count(&BB)) {
+      continue;
+    }
+    for (Instruction &I : BB) {
+      if (BinaryOperator *bo = dyn_cast<BinaryOperator>(&I)) {
+        worklist.emplace_back(bo, budget.size());
+        budget.push_back(times);
+      }
+    }
+  }
+  uint64_t size = original;
+  uint64_t limit = MaxGrowth > 0 ? original * MaxGrowth : UINT64_MAX;
+  unsigned rewrites = 0;
+  while (!worklist.empty() && size < limit) {
+    BinaryOperator *bo = worklist.front().first;
+    unsigned origin = worklist.front().second;
+    worklist.pop_front();
+    if (budget[origin] <= 0 || cryptoutils->get_range(100) > probRate) {
+      continue;
+    }
+    Instruction *first = bo->getPrevNode();
+    if (!rewrite(bo)) {
+      continue;
+    }
+    budget[origin]--;
+    rewrites++;
+    // The rewriters insert before bo, whatever they created shares its budget
+    BasicBlock::iterator I =
+        first ? std::next(first->getIterator()) : bo->getParent()->begin();
+    for (; &*I != bo; ++I) {
+      size++;
+      if (BinaryOperator *created = dyn_cast<BinaryOperator>(&*I)) {
+        worklist.emplace_back(created, origin);
+      }
+    }
+    bo->eraseFromParent();
+    size--;
+  }
+  GrowthInstructions += size - original;
+  errs() << "Substitution grew " << f->getName() << " from " << original
+         << " to " << size << " instructions ("
+         << format("x%.2f", original ? (double)size / original : 1.0)
+         << ") with " << rewrites << " rewrites";
+  if (size >= limit) {
+    errs() << ", stopped at -sub_max_growth=" << format("%g", (double)MaxGrowth);
+  }
+  errs() << "\n";
+  return rewrites != 0;
+}
+
+// Applies one of the rewrites of bo's opcode. bo is left without uses,
+// false when no rewrite handles its opcode or type.
+bool Substitution::rewrite(BinaryOperator *bo) {
+  switch (bo->getOpcode()) {
+  case BinaryOperator::Add:
+    // case BinaryOperator::FAdd:
+    // Substitute with random add operation
+    (this->*funcAdd[pick(bo, NUMBER_ADD_SUBST, AddOpcodes)])(bo);
+    ++Add;
+    return true;
+  case BinaryOperator::Sub:
+    // case BinaryOperator::FSub:
+    // Substitute with random sub operation
+    (this->*funcSub[pick(bo, NUMBER_SUB_SUBST, SubOpcodes)])(bo);
+    ++Sub;
+    return true;
+  case Instruction::And:
+    (this->*funcAnd[pick(bo, NUMBER_AND_SUBST, AndOpcodes)])(bo);
+    ++And;
+    return true;
+  case Instruction::Or:
+    (this->*funcOr[pick(bo, NUMBER_OR_SUBST, OrOpcodes)])(bo);
+    ++Or;
+    return true;
+  case Instruction::Xor:
+    (this->*funcXor[pick(bo, NUMBER_XOR_SUBST, XorOpcodes)])(bo);
+    ++Xor;
+    return true;
+  default:
+    // Mul, Div, Rem and the shifts have no rewrites
+    return false;
+  }
+}
+
+// Index of the rewrite to apply to bo. Uniform without -sub_cost_model,
+// otherwise weighted by 1/cost^2 in hot blocks and by cost^2 in cold ones.
+unsigned Substitution::pick(BinaryOperator *bo, unsigned count,
+                            const std::vector<unsigned> *opcodes) {
+  if (!CostModel) {
+    return llvm::cryptoutils->get_range(count);
+  }
+  int hotness = Hotness.lookup(bo->getParent());
+  SmallVector<unsigned, 4> costs;
+  SmallVector<double, 4> weights;
+  double total = 0;
+  for (unsigned i = 0; i < count; i++) {
+    unsigned cost = 0;
+    for (unsigned opcode : opcodes[i]) {
+      cost += opcodeCost(opcode, bo->getType());
+    }
+    double weight = 1;
+    if (hotness > 0) {
+      weight = 1.0 / ((double)cost * cost);
+    } else if (hotness < 0) {
+      weight = (double)cost * cost;
+    }
+    costs.push_back(cost);
+    weights.push_back(weight);
+    total += weight;
+  }
+  double r = total * llvm::cryptoutils->get_uint32_t() / 4294967296.0;
+  unsigned i = 0;
+  while (i + 1 < count && r >= weights[i]) {
+    r -= weights[i++];
+  }
+  RewriteCost += costs[i];
+  return i;
+}
+
+unsigned Substitution::opcodeCost(unsigned opcode, Type *ty) {
+  unsigned &cost = OpcodeCosts[std::make_pair(ty, opcode)];
+  if (cost == 0) {
+#if LLVM_VERSION_MAJOR >= 12
+    cost = std::max<int64_t>(
+        1, *TTI->getArithmeticInstrCost(opcode, ty).getValue());
+#else
+    cost = std::max(1, TTI->getArithmeticInstrCost(opcode, ty));
+#endif
+  }
+  return cost;
+}
+
 // Implementation of a = b - (-c)
 void Substitution::addNeg(BinaryOperator *bo) {
   BinaryOperator *op = NULL;
@@ -255,8 +557,7 @@ void Substitution::addRand(BinaryOperator *bo) {
 
   if (bo->getOpcode() == Instruction::Add) {
     Type *ty = bo->getType();
-    ConstantInt *co =
-        (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+    Constant *co = randomConstant(ty);
     op =
         BinaryOperator::Create(Instruction::Add, bo->getOperand(0), co, "", bo);
     op =
@@ -285,8 +586,7 @@ void Substitution::addRand2(BinaryOperator *bo) {
 
   if (bo->getOpcode() == Instruction::Add) {
     Type *ty = bo->getType();
-    ConstantInt *co =
-        (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+    Constant *co = randomConstant(ty);
     op =
         BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), co, "", bo);
     op =
@@ -336,8 +636,7 @@ void Substitution::subRand(BinaryOperator *bo) {
 
   if (bo->getOpcode() == Instruction::Sub) {
     Type *ty = bo->getType();
-    ConstantInt *co =
-        (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+    Constant *co = randomConstant(ty);
     op =
         BinaryOperator::Create(Instruction::Add, bo->getOperand(0), co, "", bo);
     op =
@@ -366,8 +665,7 @@ void Substitution::subRand2(BinaryOperator *bo) {
 
   if (bo->getOpcode() == Instruction::Sub) {
     Type *ty = bo->getType();
-    ConstantInt *co =
-        (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+    Constant *co = randomConstant(ty);
     op =
         BinaryOperator::Create(Instruction::Sub, bo->getOperand(0), co, "", bo);
     op =
@@ -413,8 +711,7 @@ void Substitution::andSubstitutionRand(BinaryOperator *bo) {
   Type *ty = bo->getType();
 
   // r (Random number)
-  ConstantInt *co =
-      (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+  Constant *co = randomConstant(ty);
 
   // !a
   BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
@@ -446,8 +743,7 @@ void Substitution::andSubstitutionRand(BinaryOperator *bo) {
 void Substitution::orSubstitutionRand(BinaryOperator *bo) {
 
   Type *ty = bo->getType();
-  ConstantInt *co =
-      (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+  Constant *co = randomConstant(ty);
 
   // !a
   BinaryOperator *op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
@@ -549,8 +845,7 @@ void Substitution::xorSubstitutionRand(BinaryOperator *bo) {
   BinaryOperator *op = NULL;
 
   Type *ty = bo->getType();
-  ConstantInt *co =
-      (ConstantInt *)ConstantInt::get(ty, llvm::cryptoutils->get_uint64_t());
+  Constant *co = randomConstant(ty);
 
   // !a
   op = BinaryOperator::CreateNot(bo->getOperand(0), "", bo);
@@ -0,0 +1,182 @@
+/*
+ *  Compiled Symbol Configuration for FunctionCallObfuscate
+ *  See include/Transforms/Obfuscation/SymbolConfig.h for the file layout
+ */
+#include "Transforms/Obfuscation/SymbolConfig.h"
+#include "json.hpp"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+using namespace llvm;
+using namespace std;
+using json = nlohmann::json;
+
+static const char SymbolConfigMagic[4] = {'H', 'K', 'S', 'C'};
+static const size_t SymbolConfigHeaderSize = 16;
+static const size_t SymbolConfigEntrySize = 16;
+
+static uint32_t read32(const char *P) {
+  return support::endian::read32le(P);
+}
+
+SymbolConfig::SymbolConfig(unique_ptr<MemoryBuffer> Buffer, bool Compiled)
+    : Buffer(std::move(Buffer)), Compiled(Compiled) {
+  const char *Start = this->Buffer->getBufferStart();
+  if (this->Buffer->getBufferSize() >= SymbolConfigHeaderSize &&
+      memcmp(Start, SymbolConfigMagic, sizeof(SymbolConfigMagic)) == 0 &&
+      read32(Start + 4) == Version) {
+    NumEntries = read32(Start + 8);
+    Entries = Start + SymbolConfigHeaderSize;
+    Strings = Start + read32(Start + 12);
+  }
+}
+
+bool SymbolConfig::validate() const {
+  if (Entries == nullptr) {
+    return false;
+  }
+  const char *End = Buffer->getBufferEnd();
+  uint64_t TableSize = uint64_t(NumEntries) * SymbolConfigEntrySize;
+  if (uint64_t(End - Entries) < TableSize || Strings < Entries + TableSize ||
+      Strings > End) {
+    return false;
+  }
+  uint64_t StringsSize = End - Strings;
+  for (uint32_t i = 0; i < NumEntries; i++) {
+    const char *E = Entries + i * SymbolConfigEntrySize;
+    if (uint64_t(read32(E)) + read32(E + 4) > StringsSize ||
+        uint64_t(read32(E + 8)) + read32(E + 12) > StringsSize) {
+      return false;
+    }
+    // lookup() relies on the table being sorted
+    if (i != 0 && !(keyAt(i - 1) < keyAt(i))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+StringRef SymbolConfig::keyAt(uint32_t Index) const {
+  const char *E = Entries + Index * SymbolConfigEntrySize;
+  return StringRef(Strings + read32(E), read32(E + 4));
+}
+
+StringRef SymbolConfig::valueAt(uint32_t Index) const {
+  const char *E = Entries + Index * SymbolConfigEntrySize;
+  return StringRef(Strings + read32(E + 8), read32(E + 12));
+}
+
+bool SymbolConfig::lookup(StringRef Key, StringRef &Value) const {
+  uint32_t Low = 0, High = NumEntries;
+  while (Low < High) {
+    uint32_t Mid = Low + (High - Low) / 2;
+    int Cmp = keyAt(Mid).compare(Key);
+    if (Cmp == 0) {
+      Value = valueAt(Mid);
+      return true;
+    }
+    if (Cmp < 0) {
+      Low = Mid + 1;
+    } else {
+      High = Mid;
+    }
+  }
+  return false;
+}
+
+bool SymbolConfig::parseJSON(StringRef Buffer,
+                             vector<pair<string, string>> &Entries) {
+  json Root = json::parse(Buffer.begin(), Buffer.end(), nullptr, false);
+  if (Root.is_discarded() || !Root.is_object()) {
+    return false;
+  }
+  for (json::iterator it = Root.begin(); it != Root.end(); ++it) {
+    if (!it.value().is_string()) {
+      return false;
+    }
+    Entries.push_back(make_pair(it.key(), it.value().get<string>()));
+  }
+  return true;
+}
+
+void SymbolConfig::writeCompiled(vector<pair<string, string>> &Entries,
+                                 raw_ostream &OS) {
+  std::sort(Entries.begin(), Entries.end());
+  Entries.erase(std::unique(Entries.begin(), Entries.end(),
+                       [](const pair<string, string> &A,
+                          const pair<string, string> &B) {
+                         return A.first == B.first;
+                       }),
+                Entries.end());
+  uint32_t StringsOffset =
+      SymbolConfigHeaderSize + Entries.size() * SymbolConfigEntrySize;
+  OS.write(SymbolConfigMagic, sizeof(SymbolConfigMagic));
+  support::endian::write<uint32_t>(OS, Version, support::little);
+  support::endian::write<uint32_t>(OS, Entries.size(), support::little);
+  support::endian::write<uint32_t>(OS, StringsOffset, support::little);
+  uint32_t Offset = 0;
+  for (const pair<string, string> &E : Entries) {
+    support::endian::write<uint32_t>(OS, Offset, support::little);
+    support::endian::write<uint32_t>(OS, E.first.size(), support::little);
+    Offset += E.first.size();
+    support::endian::write<uint32_t>(OS, Offset, support::little);
+    support::endian::write<uint32_t>(OS, E.second.size(), support::little);
+    Offset += E.second.size();
+  }
+  for (const pair<string, string> &E : Entries) {
+    OS << E.first << E.second;
+  }
+}
+
+unique_ptr<SymbolConfig> SymbolConfig::load(StringRef Path) {
+#if LLVM_VERSION_MAJOR >= 13
+  ErrorOr<unique_ptr<MemoryBuffer>> File =
+      MemoryBuffer::getFile(Path, /*IsText=*/false,
+                            /*RequiresNullTerminator=*/false);
+#else
+  ErrorOr<unique_ptr<MemoryBuffer>> File = MemoryBuffer::getFile(
+      Path, /*FileSize=*/-1, /*RequiresNullTerminator=*/false);
+#endif
+  if (!File) {
+    return nullptr;
+  }
+  unique_ptr<SymbolConfig> Config;
+  StringRef Contents = (*File)->getBuffer();
+  if (Contents.startswith(
+          StringRef(SymbolConfigMagic, sizeof(SymbolConfigMagic)))) {
+    Config.reset(new SymbolConfig(std::move(*File), true));
+  } else {
+    vector<pair<string, string>> Entries;
+    if (!parseJSON(Contents, Entries)) {
+      return nullptr;
+    }
+    string Compiled;
+    raw_string_ostream OS(Compiled);
+    writeCompiled(Entries, OS);
+    OS.flush();
+    Config.reset(
+        new SymbolConfig(MemoryBuffer::getMemBufferCopy(Compiled, Path), false));
+  }
+  if (!Config->validate()) {
+    return nullptr;
+  }
+  return Config;
+}
+
+const SymbolConfig *SymbolConfig::get(StringRef Path) {
+  // Every module compiled by this process shares one instance per path
+  static std::mutex CacheLock;
+  static StringMap<SymbolConfig *> Cache;
+  std::lock_guard<std::mutex> Guard(CacheLock);
+  StringMap<SymbolConfig *>::iterator Cached = Cache.find(Path);
+  if (Cached != Cache.end()) {
+    return Cached->second;
+  }
+  SymbolConfig *Config = load(Path).release();
+  Cache[Path] = Config;
+  return Config;
+}
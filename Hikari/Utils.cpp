@@ -1,10 +1,43 @@
 #include "Transforms/Obfuscation/Utils.h"
+#include "Transforms/Obfuscation/ObfuscationPolicy.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/NoFolder.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Compiler.h"
+#if __has_include("llvm/Support/TimeProfiler.h")
+#include "llvm/Support/TimeProfiler.h"
+#define HIKARI_TIME_TRACE 1
+#endif
+static cl::opt<std::string> PolicyPath(
+    "hikari-policy", cl::init(""), cl::value_desc("filename"),
+    cl::desc("[Hikari]JSON rules choosing the passes and their parameters "
+             "per function, see ObfuscationPolicy.h"));
+namespace {
+struct FunctionFlags {
+  std::string Annotation;           // Same format as readAnnotate()
+  std::vector<std::string> Markers; // Names of the hikari_* functions called
+  ObfuscationPolicy::Decision Policy; // Of the -hikari-policy rules
+};
+} // namespace
+// One cache per thread, ThinLTO backends may run the scheduler in parallel
+static LLVM_THREAD_LOCAL DenseMap<const Function *, FunctionFlags> *FlagCache =
+    nullptr;
+// Installed by ObfuscationAnalysisScope
+static LLVM_THREAD_LOCAL const AnalysisGetters *CurrentAnalyses = nullptr;
 // Shamefully borrowed from ../Scalar/RegToMem.cpp :(
 bool valueEscapes(Instruction *Inst) {
   BasicBlock *BB = Inst->getParent();
@@ -141,7 +174,7 @@ void fixStack(Function *f) {
       }
     }
     for (unsigned int i = 0; i != tmpReg.size(); ++i) {
-      DemoteRegToStack(*tmpReg.at(i), f->begin()->getTerminator());
+      DemoteRegToStack(*tmpReg.at(i));
     }
 
     for (unsigned int i = 0; i != tmpPhi.size(); ++i) {
@@ -151,6 +184,127 @@ void fixStack(Function *f) {
   } while (tmpReg.size() != 0 || tmpPhi.size() != 0);
 }
 
+bool hasProfileData(Function &F) {
+  if (F.hasProfileData()) {
+    return true;
+  }
+  for (BasicBlock &BB : F) {
+    if (BB.getTerminator()->getMetadata(LLVMContext::MD_prof)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+DebugLoc artificialDebugLoc(Function &F) {
+  if (DISubprogram *SP = F.getSubprogram()) {
+    return DILocation::get(F.getContext(), 0, 0, SP);
+  }
+  return DebugLoc();
+}
+
+ObfuscationAnalysisScope::ObfuscationAnalysisScope(
+    const AnalysisGetters &Getters)
+    : Previous(CurrentAnalyses) {
+  CurrentAnalyses = &Getters;
+}
+
+ObfuscationAnalysisScope::~ObfuscationAnalysisScope() {
+  CurrentAnalyses = Previous;
+}
+
+void invalidateAnalyses(Function &F, bool PreservesCFG) {
+  if (CurrentAnalyses != nullptr && CurrentAnalyses->Invalidate) {
+    CurrentAnalyses->Invalidate(F, PreservesCFG);
+  }
+}
+
+FunctionAnalyses::FunctionAnalyses(Function &F)
+    : F(F), Getters(CurrentAnalyses) {}
+
+FunctionAnalyses::~FunctionAnalyses() {}
+
+DominatorTree &FunctionAnalyses::getDomTree() {
+  if (Getters != nullptr && Getters->DT) {
+    return Getters->DT(F);
+  }
+  if (!DT) {
+    DT.reset(new DominatorTree(F));
+  }
+  return *DT;
+}
+
+LoopInfo &FunctionAnalyses::getLoopInfo() {
+  if (Getters != nullptr && Getters->LI) {
+    return Getters->LI(F);
+  }
+  if (!LI) {
+    LI.reset(new LoopInfo(getDomTree()));
+  }
+  return *LI;
+}
+
+BranchProbabilityInfo &FunctionAnalyses::getBPI() {
+  if (Getters != nullptr && Getters->BPI) {
+    return Getters->BPI(F);
+  }
+  if (!BPI) {
+    BPI.reset(new BranchProbabilityInfo(F, getLoopInfo()));
+  }
+  return *BPI;
+}
+
+BlockFrequencyInfo &FunctionAnalyses::getBFI() {
+  if (Getters != nullptr && Getters->BFI) {
+    return Getters->BFI(F);
+  }
+  if (!BFI) {
+    BFI.reset(new BlockFrequencyInfo(F, getBPI(), getLoopInfo()));
+  }
+  return *BFI;
+}
+
+ProfileCounts::ProfileCounts(Function &F, FunctionAnalyses &FA) {
+  if (!hasProfileData(F)) {
+    return;
+  }
+  BranchProbabilityInfo &BPI = FA.getBPI();
+  BlockFrequencyInfo &BFI = FA.getBFI();
+  for (BasicBlock &BB : F) {
+    auto Count = BFI.getBlockProfileCount(&BB);
+    Blocks[&BB] = Count ? *Count : BFI.getBlockFreq(&BB).getFrequency();
+  }
+  for (BasicBlock &BB : F) {
+    SmallPtrSet<BasicBlock *, 4> Seen;
+    for (BasicBlock *Succ : successors(&BB)) {
+      if (Seen.insert(Succ).second) {
+        Edges[std::make_pair(&BB, Succ)] =
+            BPI.getEdgeProbability(&BB, Succ).scale(Blocks[&BB]);
+      }
+    }
+  }
+}
+
+void setSwitchWeights(SwitchInst *SI,
+                      function_ref<uint64_t(BasicBlock *)> CountOf) {
+  SmallVector<uint64_t, 16> Counts(1, 0);
+  uint64_t Max = 0;
+  for (auto Case : SI->cases()) {
+    Counts.push_back(CountOf(Case.getCaseSuccessor()));
+    Max = std::max(Max, Counts.back());
+  }
+  unsigned Shift = 0;
+  while ((Max >> Shift) > UINT32_MAX) {
+    Shift++;
+  }
+  SmallVector<uint32_t, 16> Weights;
+  for (uint64_t Count : Counts) {
+    Weights.push_back(Count >> Shift);
+  }
+  SI->setMetadata(LLVMContext::MD_prof,
+                  MDBuilder(SI->getContext()).createBranchWeights(Weights));
+}
+
 std::string readAnnotate(Function *f) {
   std::string annotation = "";
 
@@ -212,6 +366,113 @@ bool readFlag(Function *f, std::string attribute) {
   }
   return false;
 }
+// The attributes toObfuscate() is asked about, hikari_<attr> and
+// hikari_no<attr> are their markers
+static const char *const MarkerAttributes[] = {
+    "bcf", "fla", "sub", "split", "strenc", "indibr", "fw", "fco"};
+
+// Marker calls are unused calls to a function only declared in the module,
+// other calls to functions named hikari_* are left alone
+static bool isMarkerCall(const CallInst *CI) {
+  const Function *Callee = CI->getCalledFunction();
+  if (Callee == nullptr || !Callee->isDeclaration() || !CI->use_empty()) {
+    return false;
+  }
+  StringRef Name = Callee->getName();
+  for (const char *Attr : MarkerAttributes) {
+    if (Name.contains((Twine("hikari_") + Attr).str()) ||
+        Name.contains((Twine("hikari_no") + Attr).str())) {
+      return true;
+    }
+  }
+  return false;
+}
+static const ObfuscationPolicy *policy() {
+  if (PolicyPath.empty()) {
+    return nullptr;
+  }
+  return ObfuscationPolicy::get(PolicyPath);
+}
+
+ObfuscationFlagCache::ObfuscationFlagCache(Module &M) {
+  assert(FlagCache == nullptr && "ObfuscationFlagCache is not reentrant");
+  FlagCache = new DenseMap<const Function *, FunctionFlags>();
+  const ObfuscationPolicy *Policy = policy();
+  for (Function &F : M) {
+    if (!F.isDeclaration()) {
+      FunctionFlags &Flags = (*FlagCache)[&F];
+      if (Policy != nullptr) {
+        Flags.Policy = Policy->decide(F);
+      }
+    }
+  }
+  // Single pass over llvm.global.annotations, see readAnnotate()
+  GlobalVariable *glob = M.getGlobalVariable("llvm.global.annotations");
+  if (glob != NULL && glob->hasInitializer()) {
+    if (ConstantArray *ca = dyn_cast<ConstantArray>(glob->getInitializer())) {
+      for (unsigned i = 0; i < ca->getNumOperands(); ++i) {
+        ConstantStruct *structAn = dyn_cast<ConstantStruct>(ca->getOperand(i));
+        if (structAn == NULL) {
+          continue;
+        }
+        ConstantExpr *expr = dyn_cast<ConstantExpr>(structAn->getOperand(0));
+        if (expr == NULL || expr->getOpcode() != Instruction::BitCast) {
+          continue;
+        }
+        Function *f = dyn_cast<Function>(expr->getOperand(0));
+        ConstantExpr *note = dyn_cast<ConstantExpr>(structAn->getOperand(1));
+        if (f == NULL || note == NULL ||
+            note->getOpcode() != Instruction::GetElementPtr ||
+            FlagCache->find(f) == FlagCache->end()) {
+          continue;
+        }
+        if (GlobalVariable *annoteStr =
+                dyn_cast<GlobalVariable>(note->getOperand(0))) {
+          if (ConstantDataSequential *data =
+                  dyn_cast<ConstantDataSequential>(
+                      annoteStr->getInitializer())) {
+            if (data->isString()) {
+              (*FlagCache)[f].Annotation += data->getAsString().lower() + " ";
+            }
+          }
+        }
+      }
+    }
+  }
+  // Single pass over each function's instructions, see readFlag()
+  vector<CallInst *> toErase;
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    FunctionFlags &Flags = (*FlagCache)[&F];
+    for (inst_iterator I = inst_begin(F); I != inst_end(F); I++) {
+      CallInst *CI = dyn_cast<CallInst>(&*I);
+      if (CI != nullptr && isMarkerCall(CI)) {
+        Flags.Markers.push_back(CI->getCalledFunction()->getName().str());
+        toErase.push_back(CI);
+      }
+    }
+  }
+  for (CallInst *CI : toErase) {
+    CI->eraseFromParent();
+  }
+}
+
+ObfuscationFlagCache::~ObfuscationFlagCache() {
+  delete FlagCache;
+  FlagCache = nullptr;
+}
+
+static bool hasMarker(const FunctionFlags &Flags, const std::string &attr) {
+  for (const std::string &Marker : Flags.Markers) {
+    if (StringRef(Marker).contains("hikari_" + attr)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 bool toObfuscate(bool flag, Function *f, std::string attribute) {
 
   // Check if declaration
@@ -224,6 +485,26 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
   }
   std::string attr = attribute;
   std::string attrNo = "no" + attr;
+  if (FlagCache != nullptr) {
+    DenseMap<const Function *, FunctionFlags>::iterator Cached =
+        FlagCache->find(f);
+    if (Cached != FlagCache->end()) {
+      const FunctionFlags &Flags = Cached->second;
+      if (Flags.Annotation.find(attrNo) != std::string::npos ||
+          hasMarker(Flags, attrNo)) {
+        return false;
+      }
+      if (Flags.Annotation.find(attr) != std::string::npos ||
+          hasMarker(Flags, attr)) {
+        return true;
+      }
+      bool Enabled;
+      if (Flags.Policy.pass(attr, Enabled)) {
+        return Enabled;
+      }
+      return flag;
+    }
+  }
   // We have to check the nofla flag first
   // Because .find("fla") is true for a string like "fla" or
   // "nofla"
@@ -234,8 +515,131 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
   if (readAnnotate(f).find(attr) != std::string::npos || readFlag(f, attr)) {
     return true;
   }
+  if (const ObfuscationPolicy *Policy = policy()) {
+    bool Enabled;
+    if (Policy->decide(*f).pass(attr, Enabled)) {
+      return Enabled;
+    }
+  }
   if (flag == true) {
     return true;
   }
   return false;
 }
+
+int64_t obfuscationParameter(Function *f, StringRef Name, int64_t Default) {
+  int64_t Value;
+  if (FlagCache != nullptr) {
+    DenseMap<const Function *, FunctionFlags>::iterator Cached =
+        FlagCache->find(f);
+    if (Cached != FlagCache->end()) {
+      return Cached->second.Policy.parameter(Name, Value) ? Value : Default;
+    }
+  }
+  const ObfuscationPolicy *Policy = policy();
+  if (Policy != nullptr && Policy->decide(*f).parameter(Name, Value)) {
+    return Value;
+  }
+  return Default;
+}
+
+ObfuscationTimeScope::ObfuscationTimeScope(StringRef Pass, Function &F)
+    : Pass(Pass), F(&F), M(F.getParent()), Active(false), Remark(false) {
+  begin();
+}
+
+ObfuscationTimeScope::ObfuscationTimeScope(StringRef Pass, Module &M)
+    : Pass(Pass), F(nullptr), M(&M), Active(false), Remark(false) {
+  begin();
+}
+
+// Module-level remarks are attached to the first definition
+static Function *remarkAnchor(Function *F, Module &M) {
+  if (F != nullptr) {
+    return F->isDeclaration() ? nullptr : F;
+  }
+  for (Function &Func : M) {
+    if (!Func.isDeclaration()) {
+      return &Func;
+    }
+  }
+  return nullptr;
+}
+
+void ObfuscationTimeScope::begin() {
+#ifdef HIKARI_TIME_TRACE
+  Active = timeTraceProfilerEnabled();
+#endif
+  if (Function *Anchor = remarkAnchor(F, *M)) {
+    Remark = OptimizationRemarkEmitter(Anchor).allowExtraAnalysis("hikari");
+  }
+  if (!Active && !Remark) {
+    return;
+  }
+  Before = size();
+#ifdef HIKARI_TIME_TRACE
+  if (Active) {
+    timeTraceProfilerBegin(Pass, name() + ": " + Before);
+  }
+#endif
+}
+
+ObfuscationTimeScope::~ObfuscationTimeScope() {
+  if (!Active && !Remark) {
+    return;
+  }
+  std::string After = size();
+  Function *Anchor = Remark ? remarkAnchor(F, *M) : nullptr;
+  if (Anchor != nullptr) {
+    OptimizationRemarkEmitter ORE(Anchor);
+    ORE.emit([&] {
+      return OptimizationRemarkAnalysis("hikari", "ObfuscationSize",
+                                        Anchor->getSubprogram(),
+                                        &Anchor->getEntryBlock())
+             << ore::NV("Pass", Pass) << " " << ore::NV("Name", name())
+             << ": " << ore::NV("Before", Before) << " before, "
+             << ore::NV("After", After) << " after";
+    });
+  }
+#ifdef HIKARI_TIME_TRACE
+  if (!Active) {
+    return;
+  }
+#if LLVM_VERSION_MAJOR >= 19
+  timeTraceAddInstantEvent((Pass + " Result").str(),
+                           [&] { return name() + ": " + After; });
+#endif
+  timeTraceProfilerEnd();
+#endif
+}
+
+std::string ObfuscationTimeScope::name() const {
+  return F != nullptr ? F->getName().str() : M->getModuleIdentifier();
+}
+
+// "12 blocks, 80 instructions", modules count functions instead of blocks
+std::string ObfuscationTimeScope::size() const {
+  size_t Blocks = 0, Instructions = 0, Functions = 0;
+  if (F != nullptr) {
+    for (BasicBlock &BB : *F) {
+      Blocks++;
+      Instructions += BB.size();
+    }
+  } else {
+    for (Function &Func : *M) {
+      if (!Func.isDeclaration()) {
+        Functions++;
+        Instructions += Func.getInstructionCount();
+      }
+    }
+  }
+  std::string Size;
+  raw_string_ostream OS(Size);
+  if (F != nullptr) {
+    OS << Blocks << " blocks, ";
+  } else {
+    OS << Functions << " functions, ";
+  }
+  OS << Instructions << " instructions";
+  return OS.str();
+}
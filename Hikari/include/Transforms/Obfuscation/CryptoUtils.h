@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <cstdio>
+#include <mutex>
 #include <string>
 
 namespace llvm {
@@ -242,6 +243,9 @@ private:
   uint32_t idx;
   std::string seed;
   bool seeded;
+  // cryptoutils is shared by every thread running the passes, e.g. parallel
+  // ThinLTO backends in the linker
+  std::mutex PoolLock;
 
   typedef struct {
     uint64_t length;
@@ -28,6 +28,10 @@ using namespace llvm;
 // Namespace
 namespace llvm {
 	ModulePass* createObfuscationPass();
+	// Cost model the scheduler hands to Substitution, see setSubstitutionTTI
+	void setObfuscationTTI(ModulePass *P, TTIGetter GetTTI);
+	// Function analyses the scheduler's passes share, see FunctionAnalyses
+	void setObfuscationAnalyses(ModulePass *P, AnalysisGetters Getters);
 	void initializeObfuscationPass(PassRegistry &Registry);
 }
 
@@ -0,0 +1,113 @@
+#ifndef _OBFUSCATION_POLICY_H_
+#define _OBFUSCATION_POLICY_H_
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/Regex.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+using namespace llvm;
+
+/*
+  Per-function obfuscation policy, loaded from -hikari-policy=<file>.
+  Selects the passes and their parameters from outside the sources, e.g. to
+  keep hot third-party code unobfuscated. The file is a JSON object holding
+  an array of rules:
+
+  {
+    "rules": [
+      {"path": "*third_party*", "passes": {"all": false}},
+      {"function": ["aes_*", "re:^(en|de)crypt_[a-z]+$"],
+       "linkage": ["external", "internal"],
+       "passes": {"bcf": true, "fla": true},
+       "params": {"bcf_prob": 100, "fla_dispatchers": 4}}
+    ]
+  }
+
+  "function" and "path" take a pattern or a list of patterns: globs, which
+  must match the whole string, or regexes prefixed with "re:", which only
+  need to match part of it. The path is the source file in the function's
+  debug info, functions without one match no rule that has a "path".
+  "linkage" takes the IR linkage names. A rule applies when each field it
+  has matches, a rule without any applies to every function.
+  "passes" maps the names toObfuscate() takes (bcf, fla, sub, split, strenc,
+  indibr, fw, fco) or "all" to on/off, "params" overrides the pass options
+  listed in ObfuscationPolicy.cpp. Rules apply in file order, a later rule
+  overrides what an earlier one set. Source annotations and hikari_*
+  markers still take precedence over the policy, and the policy over the
+  -enable-* options.
+
+  The patterns of all rules are compiled once per file and process: literal
+  patterns go into a hash table, a literal followed by "*" into a prefix
+  trie and only the others are matched one by one. A lookup costs a walk
+  over the name and path plus the irregular patterns, whatever the number
+  of rules.
+*/
+namespace llvm {
+class ObfuscationPolicy {
+public:
+  // The passes and parameters the matching rules set for a function
+  class Decision {
+  public:
+    // Returns true and sets Enabled if a rule switched Pass on or off
+    bool pass(StringRef Pass, bool &Enabled) const;
+    // Returns true and sets Value if a rule set the parameter Name
+    bool parameter(StringRef Name, int64_t &Value) const;
+    bool empty() const { return Passes.empty() && Parameters.empty(); }
+
+  private:
+    friend class ObfuscationPolicy;
+    StringMap<bool> Passes; // "all" covers the passes not named
+    StringMap<int64_t> Parameters;
+  };
+  // Returns the policy at Path, loading it on first use. Instances are
+  // shared by every pass in the process and never freed. Returns nullptr
+  // and reports why once if Path can't be read or is malformed.
+  static const ObfuscationPolicy *get(StringRef Path);
+  // Compiles the JSON policy in Buffer, nullptr and Error when malformed
+  static unique_ptr<ObfuscationPolicy> parse(StringRef Buffer,
+                                             std::string &Error);
+  Decision decide(const Function &F) const;
+  size_t size() const { return Rules.size(); }
+
+private:
+  struct Rule {
+    bool AnyName = true;
+    bool AnyPath = true;
+    uint32_t Linkages = ~0u; // One bit per GlobalValue::LinkageTypes
+    vector<pair<std::string, bool>> Passes; // "all" first
+    vector<pair<std::string, int64_t>> Parameters;
+  };
+  // Patterns of one field of every rule
+  class PatternIndex {
+  public:
+    PatternIndex() : Trie(1) {}
+    bool add(StringRef Pattern, unsigned Rule, std::string &Error);
+    // Sets the bit of every rule with a pattern matching S
+    void match(StringRef S, BitVector &Matched) const;
+
+  private:
+    struct TrieNode {
+      map<char, unsigned> Children;
+      vector<unsigned> Rules; // Rules whose prefix ends here
+    };
+    StringMap<vector<unsigned>> Literals;
+    vector<TrieNode> Trie; // Trie[0] is the root
+    vector<pair<GlobPattern, unsigned>> Globs;
+    vector<pair<unique_ptr<Regex>, unsigned>> Regexes;
+  };
+  ObfuscationPolicy() {}
+  vector<Rule> Rules;
+  PatternIndex Names;
+  PatternIndex Paths;
+  BitVector AnyName; // Rules without a "function"
+  BitVector AnyPath; // Rules without a "path"
+};
+}
+#endif
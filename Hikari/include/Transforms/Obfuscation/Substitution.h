@@ -24,14 +24,24 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Support/CommandLine.h"
 #include "Transforms/Obfuscation/CryptoUtils.h"
+#include <functional>
 
 // Namespace
 using namespace llvm;
 using namespace std;
 
 namespace llvm {
+	class TargetTransformInfo;
+	class TargetTransformInfoWrapperPass;
+	// Returns the TargetTransformInfo of a function
+	typedef std::function<TargetTransformInfo &(Function &)> TTIGetter;
 	FunctionPass *createSubstitutionPass();
 	FunctionPass *createSubstitutionPass(bool flag);
+	FunctionPass *createSubstitutionPass(bool flag,
+	                                     TargetTransformInfoWrapperPass *TTIWP);
+	// Cost model of -sub_cost_model when no legacy pass manager runs P, e.g.
+	// the new pass manager's TargetIRAnalysis
+	void setSubstitutionTTI(FunctionPass *P, TTIGetter GetTTI);
 	void initializeSubstitutionPass(PassRegistry &Registry);
 }
 
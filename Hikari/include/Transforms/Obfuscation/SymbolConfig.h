@@ -0,0 +1,59 @@
+#ifndef _SYMBOL_CONFIG_H_
+#define _SYMBOL_CONFIG_H_
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+using namespace llvm;
+
+/*
+  Compiled FunctionCallObfuscate symbol configuration.
+  The on-disk layout is a little-endian header, a table of entries sorted by
+  key and a string blob. The file is mapped read-only and looked up with a
+  binary search, so loading it costs neither parsing nor allocation.
+  JSON configurations are still accepted, they are converted into the same
+  layout in memory once per process.
+
+  Header : char Magic[4] = "HKSC", uint32 Version, uint32 NumEntries,
+           uint32 StringsOffset
+  Entry  : uint32 KeyOffset, uint32 KeyLength, uint32 ValueOffset,
+           uint32 ValueLength (offsets are relative to StringsOffset)
+*/
+namespace llvm {
+class SymbolConfig {
+public:
+	static const uint32_t Version = 1;
+	// Returns the configuration at Path, loading it on first use.
+	// Instances are shared by every pass in the process and never freed.
+	// Returns nullptr if Path can't be read or is malformed.
+	static const SymbolConfig *get(StringRef Path);
+	// Uncached variant of get(), used by hikari-symcfg.
+	static unique_ptr<SymbolConfig> load(StringRef Path);
+	// Parse a JSON object of "symbol":"replacement" pairs.
+	static bool parseJSON(StringRef Buffer,
+	                      vector<pair<string, string>> &Entries);
+	// Serialize Entries into the compiled layout. Entries is sorted in place.
+	static void writeCompiled(vector<pair<string, string>> &Entries,
+	                          raw_ostream &OS);
+	// Returns true and sets Value if Key is configured.
+	bool lookup(StringRef Key, StringRef &Value) const;
+	uint32_t size() const { return NumEntries; }
+	bool isCompiledFile() const { return Compiled; }
+
+private:
+	SymbolConfig(unique_ptr<MemoryBuffer> Buffer, bool Compiled);
+	bool validate() const;
+	StringRef keyAt(uint32_t Index) const;
+	StringRef valueAt(uint32_t Index) const;
+	unique_ptr<MemoryBuffer> Buffer;
+	const char *Entries = nullptr;
+	const char *Strings = nullptr;
+	uint32_t NumEntries = 0;
+	bool Compiled;
+};
+}
+#endif
@@ -1,9 +1,14 @@
 #ifndef __UTILS_OBF__
 #define __UTILS_OBF__
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Transforms/Utils/Local.h" // For DemoteRegToStack and DemotePHIToStack
+#include <functional>
+#include <memory>
 #include <stdio.h>
 #include <sstream>
 #include <map>
@@ -11,11 +16,125 @@
 using namespace std;
 using namespace llvm;
 
+namespace llvm {
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+class DominatorTree;
+class LoopInfo;
+} // namespace llvm
+
 void fixStack(Function *f);
 std::string readAnnotate(Function *f);
 map<GlobalValue*,StringRef> BuildAnnotateMap(Module& M);
 bool toObfuscate(bool flag, Function *f, std::string attribute);
+// The pass option Name (bcf_prob, split_num...) for f, Default unless a
+// -hikari-policy rule matching f sets it
+int64_t obfuscationParameter(Function *f, StringRef Name, int64_t Default);
 void FixBasicBlockConstantExpr(BasicBlock *BB);
 void FixFunctionConstantExpr(Function *Func);
 void appendToAnnotations(Module &M,ConstantStruct *Data);
+// Passes rewriting terminators keep !prof and debug locations with these.
+// hasProfileData is true when F has an entry count or any branch weights.
+bool hasProfileData(Function &F);
+// Line 0 location in F's scope, for code without a source line of its own
+// such as dispatchers. Empty when F has no debug info.
+DebugLoc artificialDebugLoc(Function &F);
+// Function analyses of the pass manager running the obfuscation. The new
+// pass manager wrappers and the scheduler install getters reading the
+// FunctionAnalysisManager, so the passes share its cached results. Without
+// them FunctionAnalyses computes each one locally, as under the legacy
+// pass manager.
+struct AnalysisGetters {
+  std::function<DominatorTree &(Function &)> DT;
+  std::function<LoopInfo &(Function &)> LI;
+  std::function<BranchProbabilityInfo &(Function &)> BPI;
+  std::function<BlockFrequencyInfo &(Function &)> BFI;
+  // Drops the results of a function a pass changed
+  std::function<void(Function &, bool PreservesCFG)> Invalidate;
+};
+// Installs Getters on the current thread while alive
+class ObfuscationAnalysisScope {
+public:
+  ObfuscationAnalysisScope(const AnalysisGetters &Getters);
+  ~ObfuscationAnalysisScope();
+
+private:
+  const AnalysisGetters *Previous;
+};
+// Called by the scheduler after a pass changed F, so later passes don't see
+// stale results. Does nothing without installed getters.
+void invalidateAnalyses(Function &F, bool PreservesCFG);
+// The analyses of one function, from the installed getters or computed on
+// first use. Only valid until the CFG of the function changes.
+class FunctionAnalyses {
+public:
+  explicit FunctionAnalyses(Function &F);
+  ~FunctionAnalyses();
+  DominatorTree &getDomTree();
+  LoopInfo &getLoopInfo();
+  BranchProbabilityInfo &getBPI();
+  BlockFrequencyInfo &getBFI();
+
+private:
+  Function &F;
+  const AnalysisGetters *Getters;
+  std::unique_ptr<DominatorTree> DT;
+  std::unique_ptr<LoopInfo> LI;
+  std::unique_ptr<BranchProbabilityInfo> BPI;
+  std::unique_ptr<BlockFrequencyInfo> BFI;
+};
+// Execution counts estimated from F's entry count and branch weights,
+// relative frequencies when it only has weights. Taken before a pass
+// rewrites the CFG, empty when F has no profile data.
+class ProfileCounts {
+public:
+  ProfileCounts(Function &F, FunctionAnalyses &FA);
+  bool empty() const { return Blocks.empty(); }
+  uint64_t block(BasicBlock *BB) const { return Blocks.lookup(BB); }
+  uint64_t edge(BasicBlock *From, BasicBlock *To) const {
+    return Edges.lookup(std::make_pair(From, To));
+  }
+  void setBlock(BasicBlock *BB, uint64_t Count) { Blocks[BB] = Count; }
+
+private:
+  DenseMap<BasicBlock *, uint64_t> Blocks;
+  DenseMap<std::pair<BasicBlock *, BasicBlock *>, uint64_t> Edges;
+};
+// Sets the branch weights of SI to the count of each case's destination,
+// scaled to 32 bits. The default destination gets 0.
+void setSwitchWeights(SwitchInst *SI,
+                      function_ref<uint64_t(BasicBlock *)> CountOf);
+// While alive, toObfuscate() answers from a snapshot of every function's
+// annotations and hikari_* marker calls, taken in one walk over the module,
+// instead of rescanning both for every pass. Marker calls are removed when
+// the snapshot is taken. Functions created afterwards are scanned as usual.
+class ObfuscationFlagCache {
+public:
+  ObfuscationFlagCache(Module &M);
+  ~ObfuscationFlagCache();
+};
+// While alive, a scope in the time trace (clang -ftime-trace, opt -time-trace,
+// hikari-batch -time-trace) named after the pass, with the function or module
+// and its size as detail. The size after the pass is added as an instant
+// event on LLVM 19+. A trace scope can't change its detail once open, so
+// both sizes also go to an analysis remark of "hikari" (-Rpass-analysis,
+// -pass-remarks-analysis, -fsave-optimization-record), which no time trace
+// granularity filters. Costs nothing when neither is being recorded.
+class ObfuscationTimeScope {
+public:
+  ObfuscationTimeScope(StringRef Pass, Function &F);
+  ObfuscationTimeScope(StringRef Pass, Module &M);
+  ~ObfuscationTimeScope();
+
+private:
+  void begin();
+  std::string name() const;
+  std::string size() const;
+  StringRef Pass;
+  Function *F;
+  Module *M;
+  std::string Before;
+  bool Active;
+  bool Remark;
+};
 #endif
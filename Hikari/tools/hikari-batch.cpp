@@ -0,0 +1,726 @@
+/*
+ *  hikari-batch
+ *  Obfuscates a corpus of bitcode files in one process with the Hikari
+ *  scheduler linked in, instead of one `opt -load` per file.
+ *
+ *  Files go through three stages connected by bounded queues:
+ *    reader  : one thread loading input files into memory
+ *    workers : -j threads, each parsing a file into its own LLVMContext,
+ *              running the scheduler and serializing the result
+ *    writer  : one thread writing the bitcode to the output directory
+ *  so disk I/O overlaps with obfuscation, and at most a few files per
+ *  thread are held in memory at once.
+ *
+ *  -lazy bounds memory for huge modules. The bitcode is loaded lazily and
+ *  split into partitions of -lazy-partition-size functions. Each partition
+ *  is materialized one function at a time, cloned into its own module,
+ *  obfuscated and written as <name>.part<N>.bc. The function bodies are then
+ *  dropped from the source module. Local symbols are promoted to hidden
+ *  globals with a per-input suffix so the partitions link back together.
+ *  Local constants whose address doesn't matter, string literals and
+ *  CFStrings, stay local instead and are copied into each partition that
+ *  uses them, so StringEncryption still encrypts them there. Passes that
+ *  need the whole module, like AntiClassDump, only see the first partition,
+ *  which holds every other global variable.
+ *
+ *  -time-trace writes one Chrome trace (-ftime-trace format) for the run,
+ *  with a scope per file and, inside it, per pass and function.
+
+    Usage:
+      hikari-batch -o out/ -j 16 -enable-allobf a.bc b.bc ...
+      hikari-batch -o out/ -filelist=corpus.txt -enable-cffobf
+      hikari-batch -o out/ -lazy -lazy-partition-size=16 -enable-allobf lto.bc
+      hikari-batch -o out/ -time-trace=trace.json -enable-allobf *.bc
+ */
+#include "Transforms/Obfuscation/Obfuscation.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#if LLVM_VERSION_MAJOR >= 12
+#include "llvm/Support/TimeProfiler.h"
+#endif
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#if __has_include(<sys/resource.h>)
+#include <sys/resource.h>
+#endif
+using namespace llvm;
+using namespace std;
+
+static cl::list<string> InputFilenames(cl::Positional, cl::ZeroOrMore,
+                                       cl::desc("<input bitcode files>"));
+static cl::opt<string>
+    FileList("filelist", cl::desc("Read input filenames from this file, "
+                                  "one per line"),
+             cl::value_desc("filename"));
+static cl::opt<string> OutputDirectory("o", cl::Required,
+                                       cl::desc("Output directory"),
+                                       cl::value_desc("directory"));
+static cl::opt<unsigned>
+    Threads("j", cl::init(0),
+            cl::desc("Number of worker threads, 0 for one per core"));
+static cl::opt<bool> VerifyOutput("verify", cl::init(false),
+                                  cl::desc("Verify each module after "
+                                           "obfuscation"));
+static cl::opt<bool> Quiet("q", cl::init(false),
+                           cl::desc("Only print the totals"));
+static cl::opt<bool>
+    Lazy("lazy", cl::init(false),
+         cl::desc("Materialize and obfuscate the functions of each file a "
+                  "partition at a time, writing one bitcode file per "
+                  "partition"));
+static cl::opt<unsigned> LazyPartitionSize(
+    "lazy-partition-size", cl::init(256),
+    cl::desc("Number of functions per partition in -lazy mode"));
+#if LLVM_VERSION_MAJOR >= 12
+static cl::opt<string>
+    TimeTrace("time-trace",
+              cl::desc("Write a Chrome trace (-ftime-trace format) of every "
+                       "file, pass and function to this file"),
+              cl::value_desc("filename"));
+static cl::opt<unsigned> TimeTraceGranularity(
+    "time-trace-granularity", cl::init(500),
+    cl::desc("Minimum duration of a traced scope, in microseconds"));
+#endif
+
+namespace {
+typedef chrono::steady_clock Clock;
+
+static double msSince(Clock::time_point Start) {
+  return chrono::duration<double, milli>(Clock::now() - Start).count();
+}
+
+// Queue with a capacity, close() wakes up consumers once it drains
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t Capacity) : Capacity(Capacity) {}
+  void push(T Item) {
+    unique_lock<mutex> Lock(M);
+    NotFull.wait(Lock, [this] { return Items.size() < Capacity; });
+    Items.push_back(std::move(Item));
+    NotEmpty.notify_one();
+  }
+  // Returns false once the queue is closed and empty
+  bool pop(T &Item) {
+    unique_lock<mutex> Lock(M);
+    NotEmpty.wait(Lock, [this] { return !Items.empty() || Closed; });
+    if (Items.empty()) {
+      return false;
+    }
+    Item = std::move(Items.front());
+    Items.pop_front();
+    NotFull.notify_one();
+    return true;
+  }
+  void close() {
+    lock_guard<mutex> Lock(M);
+    Closed = true;
+    NotEmpty.notify_all();
+  }
+
+private:
+  size_t Capacity;
+  bool Closed = false;
+  deque<T> Items;
+  mutex M;
+  condition_variable NotEmpty, NotFull;
+};
+
+struct FileJob {
+  size_t Index = 0;
+  unique_ptr<MemoryBuffer> Input;
+  SmallVector<char, 0> Output;
+  // -lazy writes the partitions itself
+  unsigned Partitions = 0;
+  uint64_t WrittenBytes = 0;
+  string Error;
+  string Warning;
+};
+
+struct FileStats {
+  uint64_t InputBytes = 0;
+  uint64_t OutputBytes = 0;
+  double ReadMs = 0, ObfuscateMs = 0, WriteMs = 0;
+  bool Failed = false;
+};
+} // namespace
+
+static bool collectInputs(vector<string> &Inputs) {
+  Inputs.assign(InputFilenames.begin(), InputFilenames.end());
+  if (!FileList.empty()) {
+    ErrorOr<unique_ptr<MemoryBuffer>> List = MemoryBuffer::getFile(FileList);
+    if (!List) {
+      errs() << "Failed To Read " << FileList << "\n";
+      return false;
+    }
+    SmallVector<StringRef, 64> Lines;
+    (*List)->getBuffer().split(Lines, '\n', -1, false);
+    for (StringRef Line : Lines) {
+      Line = Line.trim();
+      if (!Line.empty()) {
+        Inputs.push_back(Line.str());
+      }
+    }
+  }
+  if (Inputs.empty()) {
+    errs() << "No Input Files\n";
+    return false;
+  }
+  return true;
+}
+
+static string outputPathFor(StringRef Input) {
+  SmallString<256> Path(OutputDirectory);
+  sys::path::append(Path, sys::path::filename(Input));
+  return std::string(Path.str());
+}
+
+static string partitionPathFor(StringRef Input, unsigned Partition) {
+  SmallString<256> Path(outputPathFor(Input));
+  sys::path::replace_extension(Path, "part" + Twine(Partition) + ".bc");
+  return std::string(Path.str());
+}
+
+// Peak resident set size of the process in bytes, 0 if unknown
+static uint64_t getPeakRSS() {
+#if __has_include(<sys/resource.h>)
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage) == 0) {
+#ifdef __APPLE__
+    return Usage.ru_maxrss;
+#else
+    return uint64_t(Usage.ru_maxrss) * 1024;
+#endif
+  }
+#endif
+  return 0;
+}
+
+static std::error_code writeBitcode(const Module &M, StringRef Path,
+                                    uint64_t &Size) {
+  std::error_code EC;
+#if LLVM_VERSION_MAJOR >= 9
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+#else
+  raw_fd_ostream OS(Path, EC, sys::fs::F_None);
+#endif
+  if (EC) {
+    return EC;
+  }
+#if LLVM_VERSION_MAJOR >= 7
+  WriteBitcodeToFile(M, OS);
+#else
+  WriteBitcodeToFile(&M, OS);
+#endif
+  Size += OS.tell();
+  OS.close();
+  return OS.error();
+}
+
+static void runScheduler(Module &M) {
+  legacy::PassManager PM;
+  PM.add(createObfuscationPass());
+  if (VerifyOutput) {
+    PM.add(createVerifierPass());
+  }
+  PM.run(M);
+}
+
+// Runs on a worker thread, everything it creates lives in Context
+static void obfuscate(FileJob &Job, StringRef Name) {
+  LLVMContext Context;
+  SMDiagnostic Err;
+  unique_ptr<Module> M = parseIR(Job.Input->getMemBufferRef(), Err, Context);
+  Job.Input.reset();
+  if (!M) {
+    raw_string_ostream OS(Job.Error);
+    Err.print(Name.data(), OS);
+    return;
+  }
+  runScheduler(*M);
+  raw_svector_ostream OS(Job.Output);
+#if LLVM_VERSION_MAJOR >= 7
+  WriteBitcodeToFile(*M, OS);
+#else
+  WriteBitcodeToFile(M.get(), OS);
+#endif
+}
+
+// Local constants that can be copied into every partition using them instead
+// of being shared through partition 0: string literals and other constants
+// whose address doesn't matter, and CFStrings, which the linker coalesces
+static bool isDuplicable(const GlobalValue &GV) {
+  const GlobalVariable *Var = dyn_cast<GlobalVariable>(&GV);
+  if (Var == nullptr || !Var->hasLocalLinkage() ||
+      !Var->hasDefinitiveInitializer() || Var->isThreadLocal() ||
+      Var->hasComdat() || Var->getSection() == "llvm.metadata") {
+    return false;
+  }
+  return (Var->isConstant() && Var->hasAtLeastLocalUnnamedAddr()) ||
+         Var->getSection().find("__cfstring") != StringRef::npos;
+}
+
+// Adds the duplicable constants C refers to, directly or through other ones
+static void collectDuplicable(const Constant *C,
+                              DenseSet<const GlobalValue *> &Used) {
+  if (const GlobalVariable *GV = dyn_cast<GlobalVariable>(C)) {
+    if (isDuplicable(*GV) && Used.insert(GV).second) {
+      collectDuplicable(GV->getInitializer(), Used);
+    }
+    return;
+  }
+  if (isa<GlobalValue>(C)) {
+    return;
+  }
+  for (const Use &Op : C->operands()) {
+    if (const Constant *OpC = dyn_cast<Constant>(Op)) {
+      collectDuplicable(OpC, Used);
+    }
+  }
+}
+
+// Gives every local symbol a name that is unique across the inputs and makes
+// it hidden, so partitions can reference each other's symbols. Symbols only
+// used by the compiler itself and duplicable constants stay as they are.
+// Returns the number of constant strings that had to be promoted, which
+// StringEncryption can't encrypt in the partitions only declaring them
+static unsigned promoteLocals(Module &M, StringRef Suffix) {
+  unsigned SharedStrings = 0;
+  for (GlobalValue &GV : M.global_values()) {
+    if (!GV.hasLocalLinkage() || GV.getName().startswith("llvm.") ||
+        isDuplicable(GV)) {
+      continue;
+    }
+    if (const GlobalObject *GO = dyn_cast<GlobalObject>(&GV)) {
+      if (GO->getSection() == "llvm.metadata") {
+        continue;
+      }
+    }
+    if (const GlobalVariable *Var = dyn_cast<GlobalVariable>(&GV)) {
+      SharedStrings += Var->isConstant() && Var->hasInitializer() &&
+                       isa<ConstantDataSequential>(Var->getInitializer());
+    }
+    GV.setName((GV.hasName() ? GV.getName() : "hikari.anon") + ".hikari." +
+               Suffix);
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    GV.setVisibility(GlobalValue::HiddenVisibility);
+  }
+  return SharedStrings;
+}
+
+// Whether the options enable StringEncryption for every function
+static bool stringEncryptionEnabled() {
+  StringMap<cl::Option *> &Options = cl::getRegisteredOptions();
+  for (StringRef Name : {"enable-strcry", "enable-allobf"}) {
+    StringMap<cl::Option *>::iterator It = Options.find(Name);
+    if (It != Options.end() &&
+        static_cast<cl::opt<bool> *>(It->second)->getValue()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Aliases and ifuncs
+template <typename T> static const GlobalObject *getBase(const T &GIS) {
+#if LLVM_VERSION_MAJOR >= 14
+  return GIS.getAliaseeObject();
+#else
+  return GIS.getBaseObject();
+#endif
+}
+
+// Functions are grouped in source order. Comdats stay in one partition.
+// Comdats with variables, and functions whose blocks are addressed from
+// elsewhere, go to partition 0 with the variables
+static unsigned assignPartitions(Module &M,
+                                 DenseMap<const GlobalValue *, unsigned> &Part) {
+  DenseMap<const Comdat *, unsigned> ComdatPart;
+  for (GlobalVariable &GV : M.globals()) {
+    if (const Comdat *C = GV.getComdat()) {
+      ComdatPart[C] = 0;
+    }
+  }
+  unsigned Current = 0, InCurrent = 0;
+  for (Function &F : M) {
+    if (F.isDeclaration() && !F.isMaterializable()) {
+      continue;
+    }
+    bool Addressed = false;
+    for (const User *U : F.users()) {
+      Addressed |= isa<BlockAddress>(U);
+    }
+    const Comdat *C = F.getComdat();
+    if (Addressed) {
+      Part[&F] = 0;
+    } else if (C != nullptr && ComdatPart.count(C)) {
+      Part[&F] = ComdatPart[C];
+    } else {
+      if (InCurrent == std::max(1u, unsigned(LazyPartitionSize))) {
+        Current++;
+        InCurrent = 0;
+      }
+      Part[&F] = Current;
+      InCurrent++;
+    }
+    if (C != nullptr) {
+      ComdatPart.insert(make_pair(C, Part[&F]));
+    }
+  }
+  for (GlobalAlias &GA : M.aliases()) {
+    const GlobalObject *Base = getBase(GA);
+    Part[&GA] = Base != nullptr && Part.count(Base) ? Part[Base] : 0;
+  }
+  for (GlobalIFunc &GI : M.ifuncs()) {
+    const GlobalObject *Resolver = getBase(GI);
+    Part[&GI] =
+        Resolver != nullptr && Part.count(Resolver) ? Part[Resolver] : 0;
+  }
+  return Current + 1;
+}
+
+// -lazy: one partition of the input is materialized and obfuscated at a
+// time, and written out before the next one is loaded
+static void obfuscateLazily(FileJob &Job, StringRef Name) {
+  LLVMContext Context;
+  MD5 Hash;
+  Hash.update(Job.Input->getBuffer());
+  MD5::MD5Result Digest;
+  Hash.final(Digest);
+  string Suffix = StringRef(Digest.digest()).substr(0, 16).str();
+  unique_ptr<Module> M;
+  if (isBitcode((const unsigned char *)Job.Input->getBufferStart(),
+                (const unsigned char *)Job.Input->getBufferEnd())) {
+    Expected<unique_ptr<Module>> LazyModule =
+        getOwningLazyBitcodeModule(std::move(Job.Input), Context);
+    if (!LazyModule) {
+      Job.Error = toString(LazyModule.takeError());
+      return;
+    }
+    M = std::move(*LazyModule);
+  } else {
+    // Textual IR can't be loaded lazily, it is still obfuscated and written
+    // a partition at a time
+    SMDiagnostic Err;
+    M = parseIR(Job.Input->getMemBufferRef(), Err, Context);
+    Job.Input.reset();
+    if (!M) {
+      raw_string_ostream OS(Job.Error);
+      Err.print(Name.data(), OS);
+      return;
+    }
+  }
+  if (unsigned Shared = promoteLocals(*M, Suffix)) {
+    if (stringEncryptionEnabled()) {
+      Job.Warning = to_string(Shared) +
+                    " constant strings have a significant address and are "
+                    "shared between partitions, StringEncryption leaves "
+                    "them in plaintext";
+    }
+  }
+  DenseMap<const GlobalValue *, unsigned> Part;
+  unsigned NumPartitions = assignPartitions(*M, Part);
+  for (unsigned P = 0; P < NumPartitions; P++) {
+    vector<Function *> Functions;
+    // Duplicable constants this partition defines: the ones its functions,
+    // aliases and ifuncs use, and for partition 0 the ones the other
+    // globals use
+    DenseSet<const GlobalValue *> Used;
+    for (Function &F : *M) {
+      DenseMap<const GlobalValue *, unsigned>::iterator It = Part.find(&F);
+      if (It != Part.end() && It->second == P) {
+        if (Error E = F.materialize()) {
+          Job.Error = toString(std::move(E));
+          return;
+        }
+        Functions.push_back(&F);
+        for (const Value *Op : F.operands()) {
+          collectDuplicable(cast<Constant>(Op), Used);
+        }
+        for (const Instruction &I : instructions(F)) {
+          for (const Value *Op : I.operands()) {
+            if (const Constant *C = dyn_cast<Constant>(Op)) {
+              collectDuplicable(C, Used);
+            }
+          }
+        }
+      }
+    }
+    for (GlobalValue &GV : M->global_values()) {
+      if (isa<Function>(GV) || isDuplicable(GV)) {
+        continue;
+      }
+      DenseMap<const GlobalValue *, unsigned>::iterator It = Part.find(&GV);
+      if ((It != Part.end() ? It->second : 0) == P) {
+        // Initializers, aliasees and resolvers
+        for (const Value *Op : GV.operands()) {
+          collectDuplicable(cast<Constant>(Op), Used);
+        }
+      }
+    }
+    ValueToValueMapTy VMap;
+    unique_ptr<Module> MPart =
+        CloneModule(*M, VMap, [&](const GlobalValue *GV) {
+          DenseMap<const GlobalValue *, unsigned>::const_iterator It =
+              Part.find(GV);
+          if (It != Part.end()) {
+            return It->second == P;
+          }
+          if (isDuplicable(*GV)) {
+            return Used.count(GV) != 0;
+          }
+          // Annotations are read in every partition and never emitted
+          if (GV->getName() == "llvm.global.annotations") {
+            return true;
+          }
+          if (const GlobalObject *GO = dyn_cast<GlobalObject>(GV)) {
+            if (GO->getSection() == "llvm.metadata") {
+              return true;
+            }
+          }
+          return P == 0;
+        });
+    // The source bodies were cloned, release them before obfuscating
+    for (Function *F : Functions) {
+      F->deleteBody();
+    }
+    // Duplicable constants the partition doesn't use were only declared
+    for (GlobalVariable &GV : M->globals()) {
+      if (isDuplicable(GV) && !Used.count(&GV)) {
+        GlobalValue *Copy = cast<GlobalValue>(VMap[&GV]);
+        if (Copy->use_empty()) {
+          Copy->eraseFromParent();
+        }
+      }
+    }
+    if (P != 0) {
+      MPart->setModuleInlineAsm("");
+      // llvm.used and friends became declarations, the passes expect them
+      // to be either defined or absent
+      for (Module::global_iterator GI = MPart->global_begin();
+           GI != MPart->global_end();) {
+        GlobalVariable &GV = *GI++;
+        if (GV.isDeclaration() && GV.getName().startswith("llvm.") &&
+            GV.use_empty()) {
+          GV.eraseFromParent();
+        }
+      }
+    }
+    runScheduler(*MPart);
+    // Every partition declares all the globals of the input, only keep the
+    // ones it references
+    for (Module::iterator FI = MPart->begin(); FI != MPart->end();) {
+      Function &F = *FI++;
+      if (F.isDeclaration() && F.use_empty()) {
+        F.eraseFromParent();
+      }
+    }
+    for (Module::global_iterator GI = MPart->global_begin();
+         GI != MPart->global_end();) {
+      GlobalVariable &GV = *GI++;
+      if (GV.isDeclaration() && GV.use_empty()) {
+        GV.eraseFromParent();
+      }
+    }
+    if (std::error_code EC =
+            writeBitcode(*MPart, partitionPathFor(Name, P), Job.WrittenBytes)) {
+      Job.Error = EC.message();
+      return;
+    }
+  }
+  Job.Partitions = NumPartitions;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Hikari batch obfuscator\n");
+  initializeObfuscationPass(*PassRegistry::getPassRegistry());
+  vector<string> Inputs;
+  if (!collectInputs(Inputs)) {
+    return 1;
+  }
+  if (std::error_code EC = sys::fs::create_directories(OutputDirectory)) {
+    errs() << OutputDirectory << ": " << EC.message() << "\n";
+    return 1;
+  }
+  // Outputs are named after the inputs, two inputs can't share a name
+  StringMap<size_t> Outputs;
+  for (size_t i = 0; i < Inputs.size(); i++) {
+    if (!Outputs.insert(make_pair(outputPathFor(Inputs[i]), i)).second) {
+      errs() << Inputs[i] << " has the same filename as "
+             << Inputs[Outputs[outputPathFor(Inputs[i])]] << "\n";
+      return 1;
+    }
+  }
+  unsigned NumWorkers = Threads;
+  if (NumWorkers == 0) {
+    NumWorkers = std::max(1u, thread::hardware_concurrency());
+  }
+
+  vector<FileStats> Stats(Inputs.size());
+  BoundedQueue<unique_ptr<FileJob>> Loaded(2 * NumWorkers);
+  BoundedQueue<unique_ptr<FileJob>> Obfuscated(2 * NumWorkers);
+  mutex ReportLock;
+  Clock::time_point Start = Clock::now();
+
+  thread Reader([&] {
+    for (size_t i = 0; i < Inputs.size(); i++) {
+      Clock::time_point T = Clock::now();
+      unique_ptr<FileJob> Job(new FileJob());
+      Job->Index = i;
+      ErrorOr<unique_ptr<MemoryBuffer>> Buffer =
+          MemoryBuffer::getFile(Inputs[i]);
+      if (Buffer) {
+        Job->Input = std::move(*Buffer);
+        Stats[i].InputBytes = Job->Input->getBufferSize();
+      } else {
+        Job->Error = Buffer.getError().message();
+      }
+      Stats[i].ReadMs = msSince(T);
+      Loaded.push(std::move(Job));
+    }
+    Loaded.close();
+  });
+
+#if LLVM_VERSION_MAJOR >= 12
+  // The trace is written through the main thread's profiler, which merges
+  // the ones the workers hand over in timeTraceProfilerFinishThread
+  if (!TimeTrace.empty()) {
+    timeTraceProfilerInitialize(TimeTraceGranularity, "hikari-batch");
+  }
+#endif
+  vector<thread> Workers;
+  for (unsigned w = 0; w < NumWorkers; w++) {
+    Workers.emplace_back([&] {
+#if LLVM_VERSION_MAJOR >= 12
+      // Each thread records its own trace, merged by timeTraceProfilerWrite
+      if (!TimeTrace.empty()) {
+        timeTraceProfilerInitialize(TimeTraceGranularity, "hikari-batch");
+      }
+#endif
+      unique_ptr<FileJob> Job;
+      while (Loaded.pop(Job)) {
+        if (Job->Error.empty()) {
+          Clock::time_point T = Clock::now();
+#if LLVM_VERSION_MAJOR >= 12
+          TimeTraceScope FileScope("HikariFile", Inputs[Job->Index]);
+#endif
+          if (Lazy) {
+            obfuscateLazily(*Job, Inputs[Job->Index]);
+          } else {
+            obfuscate(*Job, Inputs[Job->Index]);
+          }
+          Stats[Job->Index].ObfuscateMs = msSince(T);
+        }
+        Obfuscated.push(std::move(Job));
+      }
+#if LLVM_VERSION_MAJOR >= 12
+      if (!TimeTrace.empty()) {
+        timeTraceProfilerFinishThread();
+      }
+#endif
+    });
+  }
+
+  thread Writer([&] {
+    unique_ptr<FileJob> Job;
+    while (Obfuscated.pop(Job)) {
+      FileStats &S = Stats[Job->Index];
+      StringRef Name = Inputs[Job->Index];
+      if (Job->Error.empty() && Job->Partitions != 0) {
+        S.OutputBytes = Job->WrittenBytes;
+      } else if (Job->Error.empty()) {
+        Clock::time_point T = Clock::now();
+        std::error_code EC;
+#if LLVM_VERSION_MAJOR >= 9
+        raw_fd_ostream OS(outputPathFor(Name), EC, sys::fs::OF_None);
+#else
+        raw_fd_ostream OS(outputPathFor(Name), EC, sys::fs::F_None);
+#endif
+        if (!EC) {
+          OS.write(Job->Output.data(), Job->Output.size());
+          OS.close();
+          EC = OS.error();
+        }
+        if (EC) {
+          Job->Error = EC.message();
+        }
+        S.OutputBytes = Job->Output.size();
+        S.WriteMs = msSince(T);
+      }
+      lock_guard<mutex> Lock(ReportLock);
+      if (Job->Error.empty() && !Job->Warning.empty()) {
+        errs() << Name << ": warning: " << Job->Warning << "\n";
+      }
+      if (!Job->Error.empty()) {
+        S.Failed = true;
+        errs() << Name << ": " << Job->Error << "\n";
+      } else if (!Quiet) {
+        outs() << format("%10.1f KB  read %8.2f ms  obfuscate %9.2f ms  "
+                         "write %8.2f ms  ",
+                         S.InputBytes / 1024.0, S.ReadMs, S.ObfuscateMs,
+                         S.WriteMs)
+               << Name;
+        if (Job->Partitions != 0) {
+          outs() << " (" << Job->Partitions << " partitions)";
+        }
+        outs() << "\n";
+      }
+    }
+  });
+
+  Reader.join();
+  for (thread &T : Workers) {
+    T.join();
+  }
+  Obfuscated.close();
+  Writer.join();
+#if LLVM_VERSION_MAJOR >= 12
+  if (!TimeTrace.empty()) {
+    if (Error E = timeTraceProfilerWrite(TimeTrace, OutputDirectory)) {
+      errs() << TimeTrace << ": " << toString(std::move(E)) << "\n";
+    }
+    timeTraceProfilerCleanup();
+  }
+#endif
+
+  double Seconds = msSince(Start) / 1000.0;
+  uint64_t InputBytes = 0, OutputBytes = 0;
+  double ObfuscateMs = 0;
+  size_t Failed = 0;
+  for (const FileStats &S : Stats) {
+    InputBytes += S.InputBytes;
+    OutputBytes += S.OutputBytes;
+    ObfuscateMs += S.ObfuscateMs;
+    Failed += S.Failed;
+  }
+  double MB = InputBytes / (1024.0 * 1024.0);
+  outs() << format("%zu files (%zu failed), %.1f MB in, %.1f MB out, "
+                   "%u workers\n",
+                   Inputs.size(), Failed, MB,
+                   OutputBytes / (1024.0 * 1024.0), NumWorkers)
+         << format("%.3f s wall, %.3f s obfuscating, %.1f files/s, "
+                   "%.2f MB/s\n",
+                   Seconds, ObfuscateMs / 1000.0, Inputs.size() / Seconds,
+                   MB / Seconds)
+         << format("peak RSS %.1f MB\n", getPeakRSS() / (1024.0 * 1024.0));
+  return Failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+/*
+ *  hikari-symcfg
+ *  Compiles a FunctionCallObfuscate SymbolConfig.json into the mmap-able
+ *  layout understood by -fcoconfig, and optionally benchmarks both formats.
+
+    Usage:
+      hikari-symcfg SymbolConfig.json -o SymbolConfig.hksc
+      hikari-symcfg SymbolConfig.json -benchmark=1000
+ */
+#include "Transforms/Obfuscation/SymbolConfig.h"
+#include "json.hpp"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include <fstream>
+using namespace llvm;
+using namespace std;
+using json = nlohmann::json;
+
+static cl::opt<string> InputFilename(cl::Positional, cl::Required,
+                                     cl::desc("<input json>"));
+static cl::opt<string> OutputFilename("o", cl::desc("Output filename"),
+                                      cl::value_desc("filename"));
+static cl::opt<unsigned>
+    Benchmark("benchmark", cl::init(0),
+              cl::desc("Load the configuration N times in each format and "
+                       "look up every symbol, as FunctionCallObfuscate "
+                       "does once per module"));
+
+static int runBenchmark(const vector<pair<string, string>> &Entries) {
+  SmallString<128> CompiledPath;
+  int FD;
+  if (sys::fs::createTemporaryFile("SymbolConfig", "hksc", FD,
+                                   CompiledPath)) {
+    errs() << "Failed To Create Temporary File\n";
+    return 1;
+  }
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    vector<pair<string, string>> Sorted(Entries);
+    SymbolConfig::writeCompiled(Sorted, OS);
+  }
+  size_t Hits = 0;
+  TimerGroup TG("hikari-symcfg", "SymbolConfig Load And Lookup");
+  Timer JSONTimer("json", "nlohmann::json", TG);
+  Timer CompiledTimer("compiled", "Compiled SymbolConfig", TG);
+  JSONTimer.startTimer();
+  for (unsigned i = 0; i < Benchmark; i++) {
+    json Configuration;
+    ifstream infile(InputFilename);
+    infile >> Configuration;
+    for (const pair<string, string> &E : Entries) {
+      if (Configuration.find(E.first) != Configuration.end()) {
+        Hits += Configuration[E.first].get<string>().size() != 0;
+      }
+    }
+  }
+  JSONTimer.stopTimer();
+  CompiledTimer.startTimer();
+  for (unsigned i = 0; i < Benchmark; i++) {
+    unique_ptr<SymbolConfig> Configuration = SymbolConfig::load(CompiledPath);
+    for (const pair<string, string> &E : Entries) {
+      StringRef Value;
+      if (Configuration->lookup(E.first, Value)) {
+        Hits += Value.size() != 0;
+      }
+    }
+  }
+  CompiledTimer.stopTimer();
+  sys::fs::remove(CompiledPath);
+  outs() << Entries.size() << " symbols, " << Benchmark << " iterations, "
+         << Hits << " hits\n";
+  // Timings are reported when TG goes out of scope
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Hikari SymbolConfig compiler\n");
+  ErrorOr<unique_ptr<MemoryBuffer>> Input =
+      MemoryBuffer::getFile(InputFilename);
+  if (!Input) {
+    errs() << "Failed To Read " << InputFilename << "\n";
+    return 1;
+  }
+  vector<pair<string, string>> Entries;
+  if (!SymbolConfig::parseJSON((*Input)->getBuffer(), Entries)) {
+    errs() << InputFilename
+           << " is not a JSON object of \"symbol\":\"replacement\" pairs\n";
+    return 1;
+  }
+  if (Benchmark != 0) {
+    return runBenchmark(Entries);
+  }
+  if (OutputFilename.empty()) {
+    errs() << "No Output File Specified\n";
+    return 1;
+  }
+  std::error_code EC;
+#if LLVM_VERSION_MAJOR >= 9
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::OF_None);
+#else
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::F_None);
+#endif
+  if (EC) {
+    errs() << EC.message() << "\n";
+    return 1;
+  }
+  SymbolConfig::writeCompiled(Entries, Out.os());
+  Out.keep();
+  return 0;
+}
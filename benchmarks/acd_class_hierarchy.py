@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+"""
+Synthetic ObjC class hierarchy for timing AntiClassDump's class ordering.
+
+Emits textual IR shaped like clang's output for an Apple target: every class
+has one instance method and derives from the previous one. Classes are listed
+in OBJC_LABEL_CLASS_$ from the most derived to the root, which is the worst
+case for dependency ordering.
+
+    ./acd_class_hierarchy.py -n 10000 -o classes.ll
+    time opt -load ../build/Hikari/libHikari.so -acd classes.ll -o /dev/null
+"""
+import argparse
+import sys
+
+HEADER = """target datalayout = "e-m:o-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-apple-macosx10.14.0"
+
+%struct._class_t = type { %struct._class_t*, %struct._class_t*, %struct._objc_cache*, i8* (i8*, i8*)**, %struct._class_ro_t* }
+%struct._objc_cache = type opaque
+%struct._class_ro_t = type { i32, i32, i32, i8*, i8*, %struct.__method_list_t*, %struct._objc_protocol_list*, %struct._ivar_list_t*, i8*, %struct._prop_list_t* }
+%struct.__method_list_t = type { i32, i32, [0 x %struct._objc_method] }
+%struct._objc_method = type { i8*, i8*, i8* }
+%struct._objc_protocol_list = type { i64, [0 x %struct._protocol_t*] }
+%struct._protocol_t = type { i8*, i8*, %struct._objc_protocol_list*, %struct.__method_list_t*, %struct.__method_list_t*, %struct.__method_list_t*, %struct.__method_list_t*, %struct._prop_list_t*, i32, i32, i8**, i8*, %struct._prop_list_t* }
+%struct._ivar_list_t = type { i32, i32, [0 x %struct._ivar_t] }
+%struct._ivar_t = type { i64*, i8*, i8*, i32, i32 }
+%struct._prop_list_t = type { i32, i32, [0 x %struct._prop_t] }
+%struct._prop_t = type { i8*, i8* }
+
+@_objc_empty_cache = external global %struct._objc_cache
+@"OBJC_CLASS_$_NSObject" = external global %struct._class_t
+@"OBJC_METACLASS_$_NSObject" = external global %struct._class_t
+@OBJC_METH_VAR_NAME_ = private unnamed_addr constant [7 x i8] c"method\\00", section "__TEXT,__objc_methname,cstring_literals", align 1
+@OBJC_METH_VAR_TYPE_ = private unnamed_addr constant [8 x i8] c"v16@0:8\\00", section "__TEXT,__objc_methtype,cstring_literals", align 1
+"""
+
+CLASS = """
+@OBJC_CLASS_NAME_{i} = private unnamed_addr constant [{len} x i8] c"{name}\\00", section "__TEXT,__objc_classname,cstring_literals", align 1
+@"\\01l_OBJC_METACLASS_RO_$_{name}" = private global %struct._class_ro_t {{ i32 1, i32 40, i32 40, i8* null, i8* getelementptr inbounds ([{len} x i8], [{len} x i8]* @OBJC_CLASS_NAME_{i}, i32 0, i32 0), %struct.__method_list_t* null, %struct._objc_protocol_list* null, %struct._ivar_list_t* null, i8* null, %struct._prop_list_t* null }}, section "__DATA, __objc_const", align 8
+@"OBJC_METACLASS_$_{name}" = global %struct._class_t {{ %struct._class_t* @"OBJC_METACLASS_$_NSObject", %struct._class_t* @"OBJC_METACLASS_$_{supermeta}", %struct._objc_cache* @_objc_empty_cache, i8* (i8*, i8*)** null, %struct._class_ro_t* @"\\01l_OBJC_METACLASS_RO_$_{name}" }}, section "__DATA, __objc_data", align 8
+@"\\01l_OBJC_$_INSTANCE_METHODS_{name}" = private global {{ i32, i32, [1 x %struct._objc_method] }} {{ i32 24, i32 1, [1 x %struct._objc_method] [%struct._objc_method {{ i8* getelementptr inbounds ([7 x i8], [7 x i8]* @OBJC_METH_VAR_NAME_, i32 0, i32 0), i8* getelementptr inbounds ([8 x i8], [8 x i8]* @OBJC_METH_VAR_TYPE_, i32 0, i32 0), i8* bitcast (void (i8*, i8*)* @"\\01-[{name} method]" to i8*) }}] }}, section "__DATA, __objc_const", align 8
+@"\\01l_OBJC_CLASS_RO_$_{name}" = private global %struct._class_ro_t {{ i32 0, i32 8, i32 8, i8* null, i8* getelementptr inbounds ([{len} x i8], [{len} x i8]* @OBJC_CLASS_NAME_{i}, i32 0, i32 0), %struct.__method_list_t* bitcast ({{ i32, i32, [1 x %struct._objc_method] }}* @"\\01l_OBJC_$_INSTANCE_METHODS_{name}" to %struct.__method_list_t*), %struct._objc_protocol_list* null, %struct._ivar_list_t* null, i8* null, %struct._prop_list_t* null }}, section "__DATA, __objc_const", align 8
+@"OBJC_CLASS_$_{name}" = global %struct._class_t {{ %struct._class_t* @"OBJC_METACLASS_$_{name}", %struct._class_t* @"OBJC_CLASS_$_{super}", %struct._objc_cache* @_objc_empty_cache, i8* (i8*, i8*)** null, %struct._class_ro_t* @"\\01l_OBJC_CLASS_RO_$_{name}" }}, section "__DATA, __objc_data", align 8
+
+define internal void @"\\01-[{name} method]"(i8* %self, i8* %_cmd) {{
+  ret void
+}}
+"""
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split("\n")[0])
+    parser.add_argument("-n", "--classes", type=int, default=10000)
+    parser.add_argument("-o", "--output", default="-")
+    args = parser.parse_args()
+    out = sys.stdout if args.output == "-" else open(args.output, "w")
+    out.write(HEADER)
+    names = ["HKBenchClass%d" % i for i in range(args.classes)]
+    for i, name in enumerate(names):
+        super_name = names[i - 1] if i > 0 else "NSObject"
+        out.write(CLASS.format(i=i, name=name, len=len(name) + 1,
+                               super=super_name, supermeta=super_name))
+    labels = ", ".join('i8* bitcast (%%struct._class_t* @"OBJC_CLASS_$_%s" to i8*)'
+                       % name for name in reversed(names))
+    out.write('\n@"OBJC_LABEL_CLASS_$" = private global [%d x i8*] [%s], '
+              'section "__DATA,__objc_classlist,regular,no_dead_strip", '
+              'align 8\n' % (args.classes, labels))
+    out.write('@llvm.compiler.used = appending global [1 x i8*] [i8* bitcast '
+              '([%d x i8*]* @"OBJC_LABEL_CLASS_$" to i8*)], '
+              'section "llvm.metadata"\n' % args.classes)
+
+
+if __name__ == "__main__":
+    main()
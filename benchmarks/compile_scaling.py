@@ -0,0 +1,233 @@
+#!/usr/bin/env python3
+"""
+Compile-time scalability of every obfuscation pass.
+
+Generates modules with gen_ir.py, growing one dimension at a time (blocks,
+instructions, strings, call sites) from a common base, and runs each pass of
+each plugin given on the command line over them with `opt -load`. Every run
+records wall time, peak RSS and how much the pass grew the IR. A run with no
+pass is recorded too, so parsing and printing can be subtracted.
+
+    ./compile_scaling.py --opt opt-9 --hikari libHikari.so --ollvm \\
+        libollvm.so --armariris libArmariris.so -o results.json
+    ./compile_scaling.py --compare before.json after.json
+
+Results are JSON with the commit they were measured at, so runs from two
+commits can be compared with --compare, which exits non-zero on regressions.
+"""
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+import gen_ir  # noqa: E402
+
+# Legacy pass names, as registered by each plugin
+PASSES = {
+    "hikari": [("bcf", "bcfobf"), ("fla", "cffobf"), ("sub", "subobf"),
+               ("split", "splitobf"), ("strenc", "strcry"),
+               ("indibr", "indibran"), ("fw", "funcwra")],
+    "ollvm": [("bcf", "boguscf"), ("fla", "flattening"),
+              ("sub", "substitution"), ("split", "splitbbl")],
+    "armariris": [("fla", "flattening"), ("sub", "substitution"),
+                  ("strenc", "GVDiv")],
+}
+
+BASE = {"functions": 4, "blocks": 64, "insts": 1024, "strings": 16,
+        "calls": 16}
+SWEEP = {
+    "blocks": [16, 64, 256, 1024],
+    "insts": [256, 1024, 4096, 16384],
+    "strings": [4, 16, 64, 256],
+    "calls": [4, 16, 64, 256],
+}
+KEY_FIELDS = ("plugin", "pass", "dimension", "size")
+
+
+def opt_major(opt):
+    output = subprocess.run([opt, "--version"], stdout=subprocess.PIPE,
+                            universal_newlines=True).stdout
+    match = re.search(r"LLVM version (\d+)", output)
+    return int(match.group(1)) if match else 0
+
+
+def count_instructions(path):
+    count = 0
+    in_function = False
+    with open(path) as f:
+        for line in f:
+            if line.startswith("define "):
+                in_function = True
+            elif line.startswith("}"):
+                in_function = False
+            elif in_function and line.startswith("  ") and \
+                    not line.lstrip().startswith(";"):
+                count += 1
+    return count
+
+
+def run_opt(cmd, stderr_path):
+    """Returns (exit status, wall seconds, peak RSS in KB) of one opt run."""
+    with open(stderr_path, "w") as err:
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=err)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.perf_counter() - start
+    proc.returncode = status  # Already reaped, keep Popen from waiting again
+    rss = usage.ru_maxrss
+    if sys.platform == "darwin":
+        rss //= 1024
+    code = os.WEXITSTATUS(status) if os.WIFEXITED(status) else -1
+    return code, wall, rss
+
+
+def measure(args, legacy_flags, tmp):
+    plugins = [(name, getattr(args, name)) for name in PASSES
+               if getattr(args, name)]
+    results = []
+    for dimension, sizes in SWEEP.items():
+        for size in sizes[:args.points]:
+            params = dict(BASE)
+            params[dimension] = size * args.scale
+            params["insts"] = max(params["insts"], 4 * params["blocks"])
+            source = os.path.join(tmp, "%s-%d.ll" % (dimension, size))
+            with open(source, "w") as out:
+                gen_ir.generate(out, params["functions"], params["blocks"],
+                                params["insts"], params["strings"],
+                                params["calls"], True)
+            insts_in = count_instructions(source)
+            runs = [("none", "none", None, [])]
+            for plugin, library in plugins:
+                for name, flag in PASSES[plugin]:
+                    if args.passes and name not in args.passes:
+                        continue
+                    runs.append((plugin, name, flag,
+                                 ["-load", os.path.abspath(library)]))
+            for plugin, name, flag, load in runs:
+                output = os.path.join(tmp, "out.ll")
+                cmd = [args.opt] + legacy_flags + load
+                if flag:
+                    cmd.append("-" + flag)
+                cmd += [source, "-S", "-o", output]
+                best = None
+                for _ in range(args.repeat):
+                    code, wall, rss = run_opt(cmd, output + ".err")
+                    if code != 0:
+                        best = (code, wall, rss)
+                        break
+                    if best is None or wall < best[1]:
+                        best = (code, wall, rss)
+                code, wall, rss = best
+                row = {"plugin": plugin, "pass": name, "dimension": dimension,
+                       "size": params[dimension], "wall_s": round(wall, 4),
+                       "peak_rss_kb": rss, "insts_in": insts_in}
+                row.update({k: params[k] for k in BASE})
+                if code == 0:
+                    insts_out = count_instructions(output)
+                    row["insts_out"] = insts_out
+                    row["growth"] = round(insts_out / max(insts_in, 1), 3)
+                    row["status"] = "ok"
+                else:
+                    with open(output + ".err") as err:
+                        lines = err.read().strip().splitlines()
+                    row["status"] = "failed: " + lines[-1] if lines \
+                        else "failed"
+                results.append(row)
+                if not args.quiet:
+                    sys.stderr.write(
+                        "%-9s %-6s %-7s %6d  %8.3fs %8d KB  x%s  %s\n" %
+                        (plugin, name, dimension, params[dimension], wall, rss,
+                         row.get("growth", "-"), row["status"]))
+    return results
+
+
+def commit_of(path):
+    try:
+        return subprocess.run(["git", "-C", path, "rev-parse", "HEAD"],
+                              stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                              universal_newlines=True).stdout.strip()
+    except OSError:
+        return ""
+
+
+def compare(old_path, new_path, threshold):
+    with open(old_path) as f:
+        old = {tuple(r[k] for k in KEY_FIELDS): r for r in json.load(f)["results"]}
+    with open(new_path) as f:
+        new = json.load(f)["results"]
+    regressions = 0
+    print("%-9s %-6s %-7s %6s  %-11s %9s %9s %7s" %
+          ("plugin", "pass", "dim", "size", "metric", "before", "after",
+           "change"))
+    for row in new:
+        before = old.get(tuple(row[k] for k in KEY_FIELDS))
+        if before is None or row["status"] != "ok" or \
+                before["status"] != "ok":
+            continue
+        for metric in ("wall_s", "peak_rss_kb", "growth"):
+            a, b = before[metric], row[metric]
+            change = (b - a) / a if a else 0.0
+            if change > threshold:
+                regressions += 1
+                print("%-9s %-6s %-7s %6d  %-11s %9s %9s %+6.1f%%" %
+                      (row["plugin"], row["pass"], row["dimension"],
+                       row["size"], metric, a, b, change * 100))
+    print("%d regressions above %.0f%%" % (regressions, threshold * 100))
+    return 1 if regressions else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--opt", default="opt")
+    for plugin in PASSES:
+        parser.add_argument("--" + plugin, metavar="PLUGIN",
+                            help="path to the %s plugin" % plugin)
+    parser.add_argument("--passes", type=lambda s: s.split(","),
+                        help="only these passes, e.g. bcf,fla")
+    parser.add_argument("--points", type=int, default=4,
+                        help="sizes per dimension, at most 4")
+    parser.add_argument("--scale", type=int, default=1,
+                        help="multiply every size by this")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs per measurement, the fastest is kept")
+    parser.add_argument("-o", "--output", default="-")
+    parser.add_argument("-q", "--quiet", action="store_true")
+    parser.add_argument("--compare", nargs=2, metavar=("OLD", "NEW"))
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="relative change reported by --compare")
+    args = parser.parse_args()
+    if args.compare:
+        sys.exit(compare(args.compare[0], args.compare[1], args.threshold))
+    if not any(getattr(args, name) for name in PASSES):
+        parser.error("no plugin given")
+
+    major = opt_major(args.opt)
+    legacy_flags = ["-enable-new-pm=0"] if major >= 13 else []
+    with tempfile.TemporaryDirectory() as tmp:
+        results = measure(args, legacy_flags, tmp)
+    document = {
+        "meta": {
+            "commit": commit_of(HERE),
+            "date": datetime.datetime.now().isoformat(timespec="seconds"),
+            "opt": args.opt,
+            "llvm_major": major,
+            "host": platform.node(),
+            "base": BASE,
+        },
+        "results": results,
+    }
+    out = sys.stdout if args.output == "-" else open(args.output, "w")
+    json.dump(document, out, indent=1, sort_keys=True)
+    out.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""
+Runtime cost of each obfuscation extension point (-ollvm-ep, -armariris-ep,
+-hikari-ep).
+
+Builds every kernel once without obfuscation and once per extension point,
+runs each binary several times and reports the median wall time and the
+slowdown relative to the plain build.
+
+    ./extension_points.py --cc clang-9 --plugin ../build/ollvm/libollvm.so
+    ./extension_points.py --cc clang --plugin libHikari.so --option hikari-ep \\
+        --new-pm --csv ep.csv kernels/ep_kernel.c
+
+The lto-late placement is built with -flto and needs a linker that loads the
+plugin, e.g. --lto-linker-flags="-fuse-ld=lld -Wl,-mllvm,-load=libollvm.so".
+Without --lto-linker-flags it is skipped.
+"""
+import argparse
+import csv
+import os
+import shlex
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PLACEMENTS = ["early", "scalar-late", "optimizer-last", "lto-late"]
+
+
+def plugin_option(plugin):
+    name = os.path.basename(plugin).lower()
+    for prefix in ("hikari", "armariris", "ollvm"):
+        if prefix in name:
+            return prefix + "-ep"
+    sys.exit("can't tell the plugin from %s, pass --option" % plugin)
+
+
+def compile_flags(args, placement):
+    if placement is None:
+        return []
+    flags = ["-Xclang", "-load", "-Xclang", args.plugin,
+             "-mllvm", "-%s=%s" % (args.option, placement)]
+    if args.new_pm:
+        flags.append("-fpass-plugin=" + args.plugin)
+    elif not args.no_legacy_flag:
+        flags.append("-flegacy-pass-manager")
+    if placement == "lto-late":
+        flags += ["-flto"] + shlex.split(args.lto_linker_flags)
+        flags += ["-Wl,-mllvm,-%s=%s" % (args.option, placement)]
+    return flags
+
+
+def build(args, source, placement, output):
+    cmd = [args.cc, "-O" + args.opt, source, "-o", output]
+    cmd += compile_flags(args, placement) + shlex.split(args.cflags)
+    start = time.perf_counter()
+    result = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                            universal_newlines=True)
+    elapsed = time.perf_counter() - start
+    if result.returncode != 0:
+        sys.stderr.write(" ".join(cmd) + "\n" + result.stderr)
+        return None
+    return elapsed
+
+
+def run(args, binary):
+    times = []
+    output = None
+    for _ in range(args.runs):
+        start = time.perf_counter()
+        result = subprocess.run([binary, str(args.iterations)],
+                                stdout=subprocess.PIPE, check=True)
+        times.append(time.perf_counter() - start)
+        output = result.stdout
+    return statistics.median(times), output
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("sources", nargs="*",
+                        default=[os.path.join(HERE, "kernels", "ep_kernel.c")])
+    parser.add_argument("--cc", default="clang")
+    parser.add_argument("--plugin", required=True)
+    parser.add_argument("--option", help="defaults to <plugin>-ep")
+    parser.add_argument("--opt", default="2", help="optimization level")
+    parser.add_argument("--cflags", default="")
+    parser.add_argument("--new-pm", action="store_true",
+                        help="load with -fpass-plugin instead of the legacy PM")
+    parser.add_argument("--no-legacy-flag", action="store_true",
+                        help="don't pass -flegacy-pass-manager (clang < 13)")
+    parser.add_argument("--lto-linker-flags", default=None)
+    parser.add_argument("--placements", default=",".join(PLACEMENTS))
+    parser.add_argument("--iterations", type=int, default=20000)
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--csv", help="also write the results to this file")
+    args = parser.parse_args()
+    args.plugin = os.path.abspath(args.plugin)
+    if args.option is None:
+        args.option = plugin_option(args.plugin)
+    placements = args.placements.split(",")
+    if "lto-late" in placements and args.lto_linker_flags is None:
+        sys.stderr.write("skipping lto-late, no --lto-linker-flags\n")
+        placements.remove("lto-late")
+
+    rows = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for source in args.sources:
+            kernel = os.path.splitext(os.path.basename(source))[0]
+            baseline = None
+            expected = None
+            for placement in [None] + placements:
+                label = placement or "none"
+                binary = os.path.join(tmp, "%s.%s" % (kernel, label))
+                compile_time = build(args, source, placement, binary)
+                if compile_time is None:
+                    rows.append([kernel, label, "", "", "", "build failed"])
+                    continue
+                runtime, output = run(args, binary)
+                if placement is None:
+                    baseline, expected = runtime, output
+                note = "" if output == expected else "output differs"
+                rows.append([kernel, label, "%.3f" % compile_time,
+                             "%.4f" % runtime,
+                             "%.2f" % (runtime / baseline) if baseline else "",
+                             note])
+
+    header = ["kernel", "placement", "compile_s", "run_s", "slowdown", "note"]
+    widths = [max(len(str(r[i])) for r in rows + [header])
+              for i in range(len(header))]
+    for row in [header] + rows:
+        print("  ".join(str(c).ljust(w) for c, w in zip(row, widths)).rstrip())
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.writer(f)
+            writer.writerow(header)
+            writer.writerows(rows)
+
+
+if __name__ == "__main__":
+    main()
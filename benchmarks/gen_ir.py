@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""
+Synthetic IR for timing the obfuscation passes.
+
+Every function has N basic blocks, about M instructions, K string literals
+and C call sites, shaped like clang -O0 output: locals live in allocas and
+every block ends in a conditional branch. Functions are annotated with all
+the obfuscation attributes so passes obfuscate them without extra flags.
+
+    ./gen_ir.py --blocks 256 --insts 4096 --strings 32 --calls 64 -o f.ll
+"""
+import argparse
+import sys
+
+HEADER = """target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+
+declare i32 @puts(i8*)
+declare i32 @external_callee(i32)
+"""
+
+OPS = ["add", "sub", "xor", "mul", "and", "or", "shl", "lshr"]
+ANNOTATION = "bcf fla sub split indibr strenc fw"
+
+
+def string_literal(index):
+    text = "benchmark string %d" % index
+    return text, len(text) + 1
+
+
+def generate(out, functions, blocks, insts, strings, calls, annotate):
+    blocks = max(blocks, 1)
+    out.write(HEADER)
+    for f in range(functions):
+        for k in range(strings):
+            text, size = string_literal(k)
+            out.write('@.str.%d.%d = private unnamed_addr constant [%d x i8] '
+                      'c"%s\\00", align 1\n' % (f, k, size, text))
+    if annotate:
+        size = len(ANNOTATION) + 1
+        out.write('@.annotation = private unnamed_addr constant [%d x i8] '
+                  'c"%s\\00", section "llvm.metadata"\n' % (size, ANNOTATION))
+        out.write('@.annotation.file = private unnamed_addr constant [6 x i8] '
+                  'c"gen.c\\00", section "llvm.metadata"\n')
+    out.write("\n")
+    # Spread the instructions, strings and calls over the blocks
+    per_block = max((insts - 4 * blocks) // blocks, 1)
+    for f in range(functions):
+        out.write("define i32 @bench%d(i32 %%arg) {\nentry:\n" % f)
+        out.write("  %acc = alloca i32, align 4\n")
+        out.write("  store i32 %arg, i32* %acc, align 4\n")
+        out.write("  br label %b0\n")
+        for b in range(blocks):
+            out.write("b%d:\n" % b)
+            out.write("  %%v%d.0 = load i32, i32* %%acc, align 4\n" % b)
+            last = "%%v%d.0" % b
+            for i in range(per_block):
+                op = OPS[(b + i) % len(OPS)]
+                operand = (i % 7) + 1 if op in ("shl", "lshr") else b * 31 + i
+                out.write("  %%v%d.%d = %s i32 %s, %d\n" %
+                          (b, i + 1, op, last, operand))
+                last = "%%v%d.%d" % (b, i + 1)
+            for k in range(b, strings, blocks):
+                _, size = string_literal(k)
+                out.write("  %%s%d.%d = call i32 @puts(i8* getelementptr "
+                          "inbounds ([%d x i8], [%d x i8]* @.str.%d.%d, "
+                          "i32 0, i32 0))\n" % (b, k, size, size, f, k))
+            for c in range(b, calls, blocks):
+                # Alternate between calls inside the module and outside it
+                if c % 2 == 0 and functions > 1:
+                    callee = "@helper%d" % ((f + c) % functions)
+                else:
+                    callee = "@external_callee"
+                out.write("  %%c%d.%d = call i32 %s(i32 %s)\n" %
+                          (b, c, callee, last))
+                last = "%%c%d.%d" % (b, c)
+            out.write("  store i32 %s, i32* %%acc, align 4\n" % last)
+            out.write("  %%cond%d = icmp slt i32 %s, %d\n" % (b, last, b))
+            if b + 1 < blocks:
+                skip = min(b + 2, blocks - 1)
+                out.write("  br i1 %%cond%d, label %%b%d, label %%b%d\n" %
+                          (b, b + 1, skip))
+            else:
+                out.write("  br i1 %%cond%d, label %%exit, label %%exit\n" %
+                          b)
+        out.write("exit:\n  %ret = load i32, i32* %acc, align 4\n"
+                  "  ret i32 %ret\n}\n\n")
+        out.write("define internal i32 @helper%d(i32 %%x) {\nentry:\n"
+                  "  %%r = add i32 %%x, %d\n  ret i32 %%r\n}\n\n" % (f, f))
+    if annotate:
+        size = len(ANNOTATION) + 1
+        entries = ", ".join(
+            "{ i8*, i8*, i8*, i32 } { i8* bitcast (i32 (i32)* @bench%d to "
+            "i8*), i8* getelementptr inbounds ([%d x i8], [%d x i8]* "
+            "@.annotation, i32 0, i32 0), i8* getelementptr inbounds "
+            "([6 x i8], [6 x i8]* @.annotation.file, i32 0, i32 0), i32 1 }"
+            % (f, size, size) for f in range(functions))
+        out.write('@llvm.global.annotations = appending global [%d x { i8*, '
+                  'i8*, i8*, i32 }] [%s], section "llvm.metadata"\n' %
+                  (functions, entries))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--functions", type=int, default=4)
+    parser.add_argument("--blocks", type=int, default=64,
+                        help="basic blocks per function (N)")
+    parser.add_argument("--insts", type=int, default=1024,
+                        help="instructions per function (M)")
+    parser.add_argument("--strings", type=int, default=16,
+                        help="string literals per function (K)")
+    parser.add_argument("--calls", type=int, default=16,
+                        help="call sites per function (C)")
+    parser.add_argument("--no-annotate", action="store_true")
+    parser.add_argument("-o", "--output", default="-")
+    args = parser.parse_args()
+    out = sys.stdout if args.output == "-" else open(args.output, "w")
+    generate(out, args.functions, args.blocks, args.insts, args.strings,
+             args.calls, not args.no_annotate)
+
+
+if __name__ == "__main__":
+    main()
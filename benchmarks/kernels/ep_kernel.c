@@ -0,0 +1,85 @@
+/*
+ * Kernel for extension_points.py. Each loop depends on an optimization that
+ * obfuscating too early gets in the way of: small helpers that need to be
+ * inlined, a struct that SROA keeps in registers, a loop the vectorizer
+ * handles and a switch-driven state machine.
+ *
+ *     ./ep_kernel [iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 4096
+
+struct vec2 {
+  int32_t x, y;
+};
+
+static struct vec2 vadd(struct vec2 a, struct vec2 b) {
+  struct vec2 r = {a.x + b.x, a.y + b.y};
+  return r;
+}
+
+static int32_t clamp(int32_t v, int32_t lo, int32_t hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static uint32_t rotl(uint32_t v, int n) { return (v << n) | (v >> (32 - n)); }
+
+static int32_t sum(const int32_t *a, int n) {
+  int32_t s = 0;
+  for (int i = 0; i < n; i++) {
+    s += a[i];
+  }
+  return s;
+}
+
+static uint32_t machine(const uint8_t *in, int n) {
+  uint32_t state = 0, acc = 0;
+  for (int i = 0; i < n; i++) {
+    switch ((state + in[i]) & 3) {
+    case 0:
+      acc += in[i];
+      state = 1;
+      break;
+    case 1:
+      acc ^= rotl(acc, 5);
+      state = 2;
+      break;
+    case 2:
+      acc -= in[i] * 3;
+      state = 3;
+      break;
+    default:
+      acc = rotl(acc, 1) + state;
+      state = 0;
+      break;
+    }
+  }
+  return acc;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 20000;
+  static int32_t data[N];
+  static uint8_t bytes[N];
+  for (int i = 0; i < N; i++) {
+    data[i] = (i * 2654435761u) >> 16;
+    bytes[i] = (uint8_t)(i * 31 + 7);
+  }
+  uint64_t check = 0;
+  for (long it = 0; it < iterations; it++) {
+    struct vec2 p = {0, 0};
+    for (int i = 0; i < N; i++) {
+      struct vec2 d = {clamp(data[i], -1000, 1000), (int32_t)it};
+      p = vadd(p, d);
+    }
+    check += (uint32_t)p.x + (uint32_t)p.y;
+    check += (uint32_t)sum(data, N);
+    check += machine(bytes, N);
+    data[it % N] ^= (int32_t)check;
+  }
+  printf("%llu\n", (unsigned long long)check);
+  return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Hashing kernel for runtime_overhead.py: FNV-1a, a table-driven CRC-32 and
+ * a murmur-style mixer over the same buffer. Tight arithmetic loops, the
+ * kind of code Substitution and BogusControlFlow make the most of.
+ *
+ *     ./hash [iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 16384
+
+static uint32_t crc_table[256];
+
+static void crc32_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32(const uint8_t *buf, size_t len) {
+  uint32_t c = 0xFFFFFFFFu;
+  for (size_t i = 0; i < len; i++) {
+    c = crc_table[(c ^ buf[i]) & 0xFF] ^ (c >> 8);
+  }
+  return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t fnv1a(const uint8_t *buf, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= buf[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint64_t mix64(const uint8_t *buf, size_t len, uint64_t seed) {
+  uint64_t h = seed ^ (len * 0xC6A4A7935BD1E995ull);
+  for (size_t i = 0; i + 8 <= len; i += 8) {
+    uint64_t k = 0;
+    for (int b = 0; b < 8; b++) {
+      k |= (uint64_t)buf[i + b] << (8 * b);
+    }
+    k *= 0xC6A4A7935BD1E995ull;
+    k ^= k >> 47;
+    k *= 0xC6A4A7935BD1E995ull;
+    h ^= k;
+    h *= 0xC6A4A7935BD1E995ull;
+  }
+  h ^= h >> 47;
+  return h;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 2000;
+  static uint8_t buf[N];
+  for (int i = 0; i < N; i++) {
+    buf[i] = (uint8_t)(i * 131 + (i >> 3));
+  }
+  crc32_init();
+  uint64_t check = 0;
+  for (long it = 0; it < iterations; it++) {
+    check += crc32(buf, N);
+    check += fnv1a(buf, N);
+    check ^= mix64(buf, N, check);
+    buf[it % N] ^= (uint8_t)check;
+  }
+  printf("%llu\n", (unsigned long long)check);
+  return 0;
+}
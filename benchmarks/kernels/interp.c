@@ -0,0 +1,103 @@
+/*
+ * Interpreter kernel for runtime_overhead.py: a stack-based bytecode VM
+ * running a small program (nested counting loops with arithmetic). The
+ * dispatch switch is the hottest indirect branch in the benchmark set.
+ *
+ *     ./interp [iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum op { PUSH, LOAD, STORE, ADD, SUB, MUL, XOR, SHR, JNZ, JMP, DUP, POP,
+          HALT };
+
+struct insn {
+  uint8_t op;
+  int32_t arg;
+};
+
+static uint64_t run(const struct insn *code, uint64_t *vars) {
+  uint64_t stack[64];
+  int sp = 0;
+  int pc = 0;
+  for (;;) {
+    const struct insn *i = &code[pc++];
+    switch (i->op) {
+    case PUSH:
+      stack[sp++] = i->arg;
+      break;
+    case LOAD:
+      stack[sp++] = vars[i->arg];
+      break;
+    case STORE:
+      vars[i->arg] = stack[--sp];
+      break;
+    case ADD:
+      sp--;
+      stack[sp - 1] += stack[sp];
+      break;
+    case SUB:
+      sp--;
+      stack[sp - 1] -= stack[sp];
+      break;
+    case MUL:
+      sp--;
+      stack[sp - 1] *= stack[sp];
+      break;
+    case XOR:
+      sp--;
+      stack[sp - 1] ^= stack[sp];
+      break;
+    case SHR:
+      stack[sp - 1] >>= i->arg;
+      break;
+    case JNZ:
+      if (stack[--sp] != 0) {
+        pc = i->arg;
+      }
+      break;
+    case JMP:
+      pc = i->arg;
+      break;
+    case DUP:
+      stack[sp] = stack[sp - 1];
+      sp++;
+      break;
+    case POP:
+      sp--;
+      break;
+    case HALT:
+    default:
+      return vars[0];
+    }
+  }
+}
+
+/*
+ * acc = seed; for (i = 1000; i; i--) for (j = 16; j; j--)
+ *   acc = (acc * 31 + i) ^ (acc >> 7) - j;
+ */
+static const struct insn program[] = {
+    /* 0 */ {PUSH, 1000}, {STORE, 1},
+    /* 2 */ {PUSH, 16},   {STORE, 2},
+    /* 4 */ {LOAD, 0},    {PUSH, 31},  {MUL, 0},  {LOAD, 1},   {ADD, 0},
+    /* 9 */ {LOAD, 0},    {SHR, 7},    {XOR, 0},  {LOAD, 2},   {SUB, 0},
+    /* 14 */ {STORE, 0},
+    /* 15 */ {LOAD, 2},   {PUSH, 1},   {SUB, 0},  {DUP, 0},    {STORE, 2},
+    /* 20 */ {JNZ, 4},
+    /* 21 */ {LOAD, 1},   {PUSH, 1},   {SUB, 0},  {DUP, 0},    {STORE, 1},
+    /* 26 */ {JNZ, 2},
+    /* 27 */ {HALT, 0},
+};
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 300;
+  uint64_t check = 0;
+  for (long it = 0; it < iterations; it++) {
+    uint64_t vars[3] = {check ^ (uint64_t)it, 0, 0};
+    check += run(program, vars);
+  }
+  printf("%llu\n", (unsigned long long)check);
+  return 0;
+}
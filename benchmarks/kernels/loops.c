@@ -0,0 +1,88 @@
+/*
+ * Loop kernel for runtime_overhead.py: matrix multiply, a 5-point stencil
+ * with clamping and a saxpy/dot pair. Counted loops that the optimizer
+ * unrolls and vectorizes, which whole-function Flattening hides from it and
+ * region flattening (-fla_region) leaves in place.
+ *
+ *     ./loops [iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define M 96
+#define W 256
+#define N 16384
+
+static void matmul(const float *a, const float *b, float *c) {
+  for (int i = 0; i < M; i++) {
+    for (int j = 0; j < M; j++) {
+      c[i * M + j] = 0.0f;
+    }
+    for (int k = 0; k < M; k++) {
+      float aik = a[i * M + k];
+      for (int j = 0; j < M; j++) {
+        c[i * M + j] += aik * b[k * M + j];
+      }
+    }
+  }
+}
+
+static void stencil(const int32_t *in, int32_t *out) {
+  for (int y = 1; y < W - 1; y++) {
+    for (int x = 1; x < W - 1; x++) {
+      int32_t v = 4 * in[y * W + x] - in[(y - 1) * W + x] -
+                  in[(y + 1) * W + x] - in[y * W + x - 1] - in[y * W + x + 1];
+      if (v < 0) {
+        v = 0;
+      } else if (v > 255) {
+        v = 255;
+      }
+      out[y * W + x] = v;
+    }
+  }
+}
+
+static float saxpy_dot(float alpha, const float *x, float *y) {
+  for (int i = 0; i < N; i++) {
+    y[i] = alpha * x[i] + y[i];
+  }
+  float dot = 0.0f;
+  for (int i = 0; i < N; i++) {
+    dot += x[i] * y[i];
+  }
+  return dot;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 2000;
+  static float a[M * M], b[M * M], c[M * M], x[N], y[N];
+  static int32_t img[W * W], edges[W * W];
+  uint32_t seed = 12345;
+  for (int i = 0; i < M * M; i++) {
+    seed = seed * 1103515245u + 12345u;
+    a[i] = (float)(seed >> 24) / 256.0f;
+    b[i] = (float)((seed >> 16) & 0xFF) / 256.0f;
+  }
+  for (int i = 0; i < W * W; i++) {
+    seed = seed * 1103515245u + 12345u;
+    img[i] = (int32_t)(seed >> 24);
+  }
+  for (int i = 0; i < N; i++) {
+    x[i] = (float)(i % 17) / 17.0f;
+    y[i] = 0.0f;
+  }
+  uint64_t check = 0;
+  for (long it = 0; it < iterations; it++) {
+    matmul(a, b, c);
+    check += (uint64_t)(c[it % (M * M)] * 16.0f);
+    stencil(img, edges);
+    check += (uint32_t)edges[W + 1 + it % (W * (W - 2) - 2)];
+    img[it % (W * W)] ^= (int32_t)check & 0xFF;
+    // Keeps y bounded so the result stays exact in float
+    float dot = saxpy_dot(it % 2 ? -0.5f : 0.5f, x, y);
+    check += (uint64_t)(int64_t)dot;
+  }
+  printf("%llu\n", (unsigned long long)check);
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Parsing kernel for runtime_overhead.py: a tokenizer and recursive-descent
+ * evaluator for integer expressions, fed one long generated input. A
+ * switch on the current character and small recursive functions, like a
+ * real front end.
+ *
+ *     ./parse [iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 32768
+
+enum token { T_NUM, T_PLUS, T_MINUS, T_STAR, T_LPAREN, T_RPAREN, T_SEMI,
+             T_END };
+
+struct lexer {
+  const char *p;
+  enum token tok;
+  int64_t value;
+};
+
+static void next(struct lexer *lx) {
+  for (;;) {
+    char c = *lx->p;
+    switch (c) {
+    case ' ':
+    case '\n':
+    case '\t':
+      lx->p++;
+      continue;
+    case '+':
+      lx->tok = T_PLUS;
+      break;
+    case '-':
+      lx->tok = T_MINUS;
+      break;
+    case '*':
+      lx->tok = T_STAR;
+      break;
+    case '(':
+      lx->tok = T_LPAREN;
+      break;
+    case ')':
+      lx->tok = T_RPAREN;
+      break;
+    case ';':
+      lx->tok = T_SEMI;
+      break;
+    case '\0':
+      lx->tok = T_END;
+      return;
+    default:
+      lx->value = 0;
+      while (*lx->p >= '0' && *lx->p <= '9') {
+        lx->value = lx->value * 10 + (*lx->p++ - '0');
+      }
+      lx->tok = T_NUM;
+      return;
+    }
+    lx->p++;
+    return;
+  }
+}
+
+static int64_t expr(struct lexer *lx);
+
+static int64_t primary(struct lexer *lx) {
+  if (lx->tok == T_LPAREN) {
+    next(lx);
+    int64_t v = expr(lx);
+    next(lx); // ')'
+    return v;
+  }
+  if (lx->tok == T_MINUS) {
+    next(lx);
+    return -primary(lx);
+  }
+  int64_t v = lx->value;
+  next(lx);
+  return v;
+}
+
+static int64_t term(struct lexer *lx) {
+  int64_t v = primary(lx);
+  while (lx->tok == T_STAR) {
+    next(lx);
+    v = (v * primary(lx)) % 1000003;
+  }
+  return v;
+}
+
+static int64_t expr(struct lexer *lx) {
+  int64_t v = term(lx);
+  while (lx->tok == T_PLUS || lx->tok == T_MINUS) {
+    enum token op = lx->tok;
+    next(lx);
+    v = op == T_PLUS ? v + term(lx) : v - term(lx);
+  }
+  return v;
+}
+
+static int generate(char *out, int size) {
+  static const char *pieces[] = {"+12",  "+(7*3)", "-(4*19)", "+853",
+                                 "*2",   "-61",    "+(9-2)",  "*(5+(6*7))"};
+  int n = 0;
+  unsigned i = 0;
+  while (n < size - 32) {
+    out[n++] = '1';
+    for (int k = 0; k < 6; k++) {
+      for (const char *s = pieces[(i * 5 + k) % 8]; *s; s++) {
+        out[n++] = *s;
+      }
+    }
+    out[n++] = ';';
+    out[n++] = '\n';
+    i++;
+  }
+  out[n] = '\0';
+  return n;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 2000;
+  static char input[N];
+  generate(input, N);
+  uint64_t check = 0;
+  for (long it = 0; it < iterations; it++) {
+    struct lexer lx = {input, T_END, 0};
+    next(&lx);
+    while (lx.tok != T_END) {
+      check = check * 31 + (uint64_t)expr(&lx);
+      while (lx.tok != T_SEMI && lx.tok != T_END) {
+        next(&lx);
+      }
+      if (lx.tok == T_SEMI) {
+        next(&lx);
+      }
+    }
+  }
+  printf("%llu\n", (unsigned long long)check);
+  return 0;
+}
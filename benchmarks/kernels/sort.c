@@ -0,0 +1,97 @@
+/*
+ * Sorting kernel for runtime_overhead.py: quicksort with an insertion sort
+ * cutoff and a bottom-up merge sort. Data-dependent branches that the
+ * branch predictor has to learn, and that Flattening routes through its
+ * dispatcher.
+ *
+ *     ./sort [iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N 8192
+
+static void insertion_sort(int32_t *a, int lo, int hi) {
+  for (int i = lo + 1; i <= hi; i++) {
+    int32_t v = a[i];
+    int j = i - 1;
+    while (j >= lo && a[j] > v) {
+      a[j + 1] = a[j];
+      j--;
+    }
+    a[j + 1] = v;
+  }
+}
+
+static void quick_sort(int32_t *a, int lo, int hi) {
+  while (hi - lo > 16) {
+    int32_t pivot = a[lo + (hi - lo) / 2];
+    int i = lo, j = hi;
+    while (i <= j) {
+      while (a[i] < pivot) {
+        i++;
+      }
+      while (a[j] > pivot) {
+        j--;
+      }
+      if (i <= j) {
+        int32_t t = a[i];
+        a[i++] = a[j];
+        a[j--] = t;
+      }
+    }
+    // Recurse into the smaller half to bound the stack
+    if (j - lo < hi - i) {
+      quick_sort(a, lo, j);
+      lo = i;
+    } else {
+      quick_sort(a, i, hi);
+      hi = j;
+    }
+  }
+  insertion_sort(a, lo, hi);
+}
+
+static void merge_sort(int32_t *a, int32_t *tmp, int n) {
+  for (int width = 1; width < n; width *= 2) {
+    for (int lo = 0; lo < n; lo += 2 * width) {
+      int mid = lo + width < n ? lo + width : n;
+      int hi = lo + 2 * width < n ? lo + 2 * width : n;
+      int i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) {
+        tmp[k++] = a[i] <= a[j] ? a[i++] : a[j++];
+      }
+      while (i < mid) {
+        tmp[k++] = a[i++];
+      }
+      while (j < hi) {
+        tmp[k++] = a[j++];
+      }
+    }
+    memcpy(a, tmp, n * sizeof(*a));
+  }
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 200;
+  static int32_t data[N], work[N], tmp[N];
+  uint32_t seed = 12345;
+  for (int i = 0; i < N; i++) {
+    seed = seed * 1103515245u + 12345u;
+    data[i] = (int32_t)(seed >> 8);
+  }
+  uint64_t check = 0;
+  for (long it = 0; it < iterations; it++) {
+    memcpy(work, data, sizeof(work));
+    quick_sort(work, 0, N - 1);
+    check += (uint32_t)work[it % N];
+    memcpy(work, data, sizeof(work));
+    merge_sort(work, tmp, N);
+    check += (uint32_t)work[(it * 7) % N];
+    data[it % N] ^= (int32_t)check;
+  }
+  printf("%llu\n", (unsigned long long)check);
+  return 0;
+}
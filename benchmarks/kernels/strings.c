@@ -0,0 +1,90 @@
+/*
+ * String kernel for runtime_overhead.py: many short string literals that are
+ * searched, compared, copied and formatted. StringEncryption decrypts every
+ * literal on first use and FunctionCallObfuscate and FunctionWrapper sit
+ * between the kernel and the C library calls.
+ *
+ *     ./strings [iterations]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *keywords[] = {
+    "auto",     "break",  "case",    "char",   "const",    "continue",
+    "default",  "do",     "double",  "else",   "enum",     "extern",
+    "float",    "for",    "goto",    "if",     "inline",   "int",
+    "long",     "register", "restrict", "return", "short", "signed",
+    "sizeof",   "static", "struct",  "switch", "typedef",  "union",
+    "unsigned", "void",   "volatile", "while",
+};
+#define NKEYWORDS (sizeof(keywords) / sizeof(keywords[0]))
+
+static int keyword_index(const char *word) {
+  int lo = 0, hi = NKEYWORDS - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    int c = strcmp(word, keywords[mid]);
+    if (c == 0) {
+      return mid;
+    }
+    if (c < 0) {
+      hi = mid - 1;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return -1;
+}
+
+static const char *severity(unsigned n) {
+  switch (n % 4) {
+  case 0:
+    return "note";
+  case 1:
+    return "warning";
+  case 2:
+    return "error";
+  default:
+    return "fatal error";
+  }
+}
+
+static uint32_t count_words(const char *text) {
+  uint32_t keywords_seen = 0;
+  char word[32];
+  while (*text) {
+    size_t n = strcspn(text, " ;(){}");
+    if (n > 0 && n < sizeof(word)) {
+      memcpy(word, text, n);
+      word[n] = '\0';
+      keywords_seen += keyword_index(word) >= 0;
+    }
+    text += n;
+    text += *text != '\0';
+  }
+  return keywords_seen;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 200000;
+  static const char source[] =
+      "static inline int f(const char *s) { if (s) return 1; else "
+      "return 0; } struct point { long x; long y; }; typedef unsigned "
+      "int uint; for (int i = 0; i < n; i++) { switch (i) { default: "
+      "break; } } while (volatile_flag) continue; goto done;";
+  char message[128];
+  uint64_t check = 0;
+  for (long it = 0; it < iterations; it++) {
+    check += count_words(source);
+    snprintf(message, sizeof(message), "%s: %s at line %ld",
+             severity((unsigned)it), keywords[it % NKEYWORDS], it);
+    check = check * 33 + strlen(message);
+    if (strstr(message, "error") != NULL) {
+      check ^= 0x5bd1e995u;
+    }
+  }
+  printf("%llu\n", (unsigned long long)check);
+  return 0;
+}
@@ -0,0 +1,303 @@
+#!/usr/bin/env python3
+"""
+Runtime overhead of each obfuscation pass and of common combinations.
+
+Builds every kernel without obfuscation and once per configuration, runs
+each binary under `perf stat` and reports cycles, instructions, the branch
+miss rate and L1 I-cache misses per thousand instructions, with cycles,
+instructions and .text size relative to the plain build and the .rodata and
+.data sizes in bytes.
+
+    ./runtime_overhead.py --cc clang-9 --hikari libHikari.so \\
+        --ollvm libollvm.so --armariris libArmariris.so --json rt.json
+    ./runtime_overhead.py --cc clang --hikari libHikari.so \\
+        --configs 'hikari-fla*' kernels/interp.c
+    ./runtime_overhead.py --cc clang --hikari libHikari.so \\
+        --configs 'hikari-fla,hikari-fla-region' kernels/loops.c
+
+The hikari-fla-k* configurations split the flattening dispatcher into K
+shards. Compare their branch_miss_pct against hikari-fla (K = 1) with
+--configs 'hikari-fla,hikari-fla-k*'.
+
+On kernels/loops.c the hikari-sub* configurations show what Substitution
+costs vectorized loops: hikari-sub runs before the vectorizers,
+hikari-sub-skipvec leaves their innermost loops alone and hikari-sub-last
+substitutes the vector code after them. hikari-sub-cost substitutes as many
+instructions as hikari-sub but picks cheap rewrites in hot blocks, its
+cycles_x against hikari-sub is the overhead the cost model saves.
+
+hikari-strenc-pool encrypts the strings of all functions into one
+deduplicated pool instead of a copy per function, compare its rodata, data
+and text_x against hikari-strenc on kernels/strings.c.
+
+Hikari configurations are built by clang with the -enable-* options. The
+ollvm and Armariris plugins always run all of their passes inside clang, so
+their single-pass configurations are built in three steps instead: clang
+emits unoptimized bitcode, opt runs the pass through the new pass manager
+pipeline names and clang optimizes and links the result.
+
+Without perf (or with --no-perf) only wall time and .text size are reported.
+"""
+import argparse
+import csv
+import fnmatch
+import json
+import os
+import shlex
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+KERNELS = ["hash", "sort", "parse", "interp", "strings", "loops"]
+EVENTS = ["cycles", "instructions", "branches", "branch-misses",
+          "L1-icache-load-misses"]
+
+# name -> -mllvm options
+HIKARI = [
+    ("hikari-bcf", ["-enable-bcfobf"]),
+    ("hikari-fla", ["-enable-cffobf"]),
+    ("hikari-fla-region", ["-enable-cffobf", "-fla_region"]),
+    ("hikari-fla-k2", ["-enable-cffobf", "-fla_dispatchers=2"]),
+    ("hikari-fla-k4", ["-enable-cffobf", "-fla_dispatchers=4"]),
+    ("hikari-fla-k8", ["-enable-cffobf", "-fla_dispatchers=8"]),
+    ("hikari-sub", ["-enable-subobf"]),
+    ("hikari-sub-skipvec", ["-enable-subobf", "-sub_skip_vectorizable"]),
+    ("hikari-sub-last", ["-enable-subobf", "-hikari-ep=optimizer-last"]),
+    ("hikari-sub-cost", ["-enable-subobf", "-sub_cost_model"]),
+    ("hikari-split", ["-enable-splitobf"]),
+    ("hikari-strenc", ["-enable-strcry"]),
+    ("hikari-strenc-pool", ["-enable-strcry", "-strcry_pool"]),
+    ("hikari-indibr", ["-enable-indibran"]),
+    ("hikari-fw", ["-enable-funcwra"]),
+    ("hikari-bcf+fla", ["-enable-bcfobf", "-enable-cffobf"]),
+    ("hikari-split+fla+sub",
+     ["-enable-splitobf", "-enable-cffobf", "-enable-subobf"]),
+    ("hikari-all", ["-enable-allobf"]),
+]
+# name -> opt -passes pipeline, None for the plugin's own clang pipeline
+OLLVM = [
+    ("ollvm", None),
+    ("ollvm-bcf", "ollvm-bcf"),
+    ("ollvm-fla", "ollvm-fla"),
+    ("ollvm-split", "ollvm-split"),
+    ("ollvm-sub", "ollvm-sub"),
+    ("ollvm-fla+sub", "ollvm-fla,ollvm-sub"),
+]
+ARMARIRIS = [
+    ("armariris", None),
+    ("armariris-fla", "armariris-fla"),
+    ("armariris-sub", "armariris-sub"),
+    ("armariris-str", "armariris-str"),
+]
+
+
+def configurations(args):
+    configs = [("plain", None, None, [])]
+    if args.hikari:
+        configs += [(name, "clang", args.hikari, flags)
+                    for name, flags in HIKARI]
+    for plugin, table in ((args.ollvm, OLLVM), (args.armariris, ARMARIRIS)):
+        if plugin:
+            configs += [(name, "opt" if pipeline else "clang", plugin,
+                         pipeline) for name, pipeline in table]
+    if args.configs:
+        patterns = args.configs.split(",")
+        configs = [c for c in configs if c[0] == "plain" or
+                   any(fnmatch.fnmatch(c[0], p) for p in patterns)]
+    return configs
+
+
+def plugin_flags(args, plugin):
+    flags = ["-Xclang", "-load", "-Xclang", plugin]
+    if args.new_pm:
+        flags.append("-fpass-plugin=" + plugin)
+    elif not args.no_legacy_flag:
+        flags.append("-flegacy-pass-manager")
+    return flags
+
+
+def call(cmd):
+    result = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                            universal_newlines=True)
+    if result.returncode != 0:
+        sys.stderr.write(" ".join(cmd) + "\n" + result.stderr)
+        return False
+    return True
+
+
+def build(args, source, config, binary):
+    name, kind, plugin, extra = config
+    base = [args.cc, "-O" + args.opt] + shlex.split(args.cflags)
+    if kind is None:
+        return call(base + [source, "-o", binary])
+    if kind == "clang":
+        mllvm = [f for option in extra for f in ("-mllvm", option)]
+        return call(base + plugin_flags(args, plugin) + mllvm +
+                    [source, "-o", binary])
+    plain_bc = binary + ".plain.bc"
+    obfuscated_bc = binary + ".bc"
+    return call(base + ["-Xclang", "-disable-llvm-passes", "-emit-llvm",
+                        "-c", source, "-o", plain_bc]) and \
+        call([args.opt_tool, "-load-pass-plugin", plugin, "-passes=" + extra,
+              plain_bc, "-o", obfuscated_bc]) and \
+        call(base + [obfuscated_bc, "-o", binary])
+
+
+def section_sizes(args, binary):
+    """.text, .rodata* and .data* (relocated data included) in bytes"""
+    result = subprocess.run([args.size, "-A", binary], stdout=subprocess.PIPE,
+                            universal_newlines=True)
+    sizes = {"text": None, "rodata": 0, "data": 0}
+    for line in result.stdout.splitlines():
+        fields = line.split()
+        if len(fields) < 2 or not fields[1].isdigit():
+            continue
+        if fields[0] == ".text":
+            sizes["text"] = int(fields[1])
+        elif fields[0].startswith(".rodata"):
+            sizes["rodata"] += int(fields[1])
+        elif fields[0].startswith(".data"):
+            sizes["data"] += int(fields[1])
+    return sizes
+
+
+def parse_perf(path):
+    counters = {}
+    with open(path) as f:
+        for line in f:
+            fields = line.strip().split(",")
+            if len(fields) < 3 or line.startswith("#"):
+                continue
+            event = fields[2].split(":")[0]
+            try:
+                counters[event] = float(fields[0])
+            except ValueError:
+                counters[event] = None  # <not counted> / <not supported>
+    return counters
+
+
+def run(args, binary, tmp):
+    samples = {event: [] for event in EVENTS}
+    times = []
+    output = None
+    for _ in range(args.runs):
+        cmd = [binary, str(args.iterations)] if args.iterations else [binary]
+        if args.perf:
+            stat = os.path.join(tmp, "perf.csv")
+            cmd = ["perf", "stat", "-x,", "-o", stat, "-e",
+                   ",".join(EVENTS), "--"] + cmd
+        start = time.perf_counter()
+        result = subprocess.run(cmd, stdout=subprocess.PIPE, check=True)
+        times.append(time.perf_counter() - start)
+        output = result.stdout
+        if args.perf:
+            for event, value in parse_perf(stat).items():
+                if event in samples and value is not None:
+                    samples[event].append(value)
+    counters = {event: statistics.median(values) if values else None
+                for event, values in samples.items()}
+    return statistics.median(times), counters, output
+
+
+def ratio(value, baseline):
+    if value is None or not baseline:
+        return None
+    return round(value / baseline, 3)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("sources", nargs="*",
+                        default=[os.path.join(HERE, "kernels", k + ".c")
+                                 for k in KERNELS])
+    parser.add_argument("--cc", default="clang")
+    parser.add_argument("--opt-tool", default="opt",
+                        help="opt used for the ollvm/Armariris single passes")
+    parser.add_argument("--size", default="size", help="size or llvm-size")
+    parser.add_argument("--hikari", metavar="PLUGIN")
+    parser.add_argument("--ollvm", metavar="PLUGIN")
+    parser.add_argument("--armariris", metavar="PLUGIN")
+    parser.add_argument("--configs",
+                        help="comma separated name patterns, e.g. 'hikari-*'")
+    parser.add_argument("--opt", default="2", help="optimization level")
+    parser.add_argument("--cflags", default="")
+    parser.add_argument("--new-pm", action="store_true",
+                        help="load with -fpass-plugin instead of the legacy PM")
+    parser.add_argument("--no-legacy-flag", action="store_true",
+                        help="don't pass -flegacy-pass-manager (clang < 13)")
+    parser.add_argument("--iterations", type=int, default=0,
+                        help="passed to every kernel, 0 keeps its default")
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--no-perf", dest="perf", action="store_false")
+    parser.add_argument("--csv", help="also write the results to this file")
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+    for plugin in ("hikari", "ollvm", "armariris"):
+        if getattr(args, plugin):
+            setattr(args, plugin, os.path.abspath(getattr(args, plugin)))
+    if args.perf and shutil.which("perf") is None:
+        sys.stderr.write("perf not found, reporting wall time only\n")
+        args.perf = False
+
+    results = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for source in args.sources:
+            kernel = os.path.splitext(os.path.basename(source))[0]
+            baseline = None
+            for config in configurations(args):
+                binary = os.path.join(tmp, "%s.%s" % (kernel, config[0]))
+                row = {"kernel": kernel, "config": config[0]}
+                results.append(row)
+                if not build(args, source, config, binary):
+                    row["note"] = "build failed"
+                    if baseline is None:
+                        break  # Nothing to compare against
+                    continue
+                runtime, counters, output = run(args, binary, tmp)
+                row["run_s"] = round(runtime, 4)
+                row.update(section_sizes(args, binary))
+                row.update(counters)
+                if baseline is None:
+                    baseline = dict(row, output=output)
+                cycles, insts = row["cycles"], row["instructions"]
+                if row["branches"] and row["branch-misses"] is not None:
+                    row["branch_miss_pct"] = round(
+                        100.0 * row["branch-misses"] / row["branches"], 3)
+                if insts and row["L1-icache-load-misses"] is not None:
+                    row["icache_mpki"] = round(
+                        1000.0 * row["L1-icache-load-misses"] / insts, 3)
+                row["cycles_x"] = ratio(cycles, baseline["cycles"])
+                row["instructions_x"] = ratio(insts, baseline["instructions"])
+                row["run_x"] = ratio(runtime, baseline["run_s"])
+                row["text_x"] = ratio(row["text"], baseline["text"])
+                row["note"] = "" if output == baseline["output"] \
+                    else "output differs"
+
+    columns = ["kernel", "config", "cycles_x", "instructions_x",
+               "branch_miss_pct", "icache_mpki", "text_x", "rodata", "data",
+               "run_s", "run_x", "note"]
+    table = [[("" if r.get(c) is None else str(r.get(c))) for c in columns]
+             for r in results]
+    widths = [max(len(row[i]) for row in table + [columns])
+              for i in range(len(columns))]
+    for row in [columns] + table:
+        print("  ".join(c.ljust(w) for c, w in zip(row, widths)).rstrip())
+    fields = ["kernel", "config", "run_s", "text"] + EVENTS + columns[2:]
+    fields = list(dict.fromkeys(fields))
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.DictWriter(f, fields, extrasaction="ignore")
+            writer.writeheader()
+            writer.writerows(results)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=1)
+            f.write("\n")
+
+
+if __name__ == "__main__":
+    main()
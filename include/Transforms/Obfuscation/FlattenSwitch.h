@@ -0,0 +1,108 @@
+#ifndef _OBFUSCATION_FLATTEN_SWITCH_H_
+#define _OBFUSCATION_FLATTEN_SWITCH_H_
+// Shared by the Flattening passes of Hikari, ollvm and Armariris
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include <vector>
+
+namespace llvm {
+// Tables are used for switches whose case values are dense, at most this many
+// entries and at least one case per this many entries
+static const uint64_t MaxSwitchTable = 4096;
+static const uint64_t MinSwitchDensity = 4;
+
+// Replaces the switch terminating its block by an update of switchVar to the
+// state of the case taken, then a branch to the dispatcher of its
+// destinations. Dense case values index a constant table of states, so the
+// block keeps its O(1) dispatch without LowerSwitch turning it into a chain
+// of compares. Sparse ones, and dense ones whose destinations belong to
+// different dispatchers, keep the switch, retargeted to one small block per
+// destination that stores its state.
+static inline void
+flattenSwitch(SwitchInst *SI, Value *switchVar,
+              function_ref<BasicBlock *(BasicBlock *)> dispatcherOf,
+              function_ref<ConstantInt *(BasicBlock *)> stateOf) {
+  BasicBlock *BB = SI->getParent();
+  Function *F = BB->getParent();
+  BasicBlock *dispatcher = dispatcherOf(SI->getDefaultDest());
+  ConstantInt *defaultState = stateOf(SI->getDefaultDest());
+  IRBuilder<> IRB(SI);
+  if (SI->getNumCases() == 0) {
+    IRB.CreateStore(defaultState, switchVar);
+    IRB.CreateBr(dispatcher);
+    SI->eraseFromParent();
+    return;
+  }
+
+  APInt Min = SI->case_begin()->getCaseValue()->getValue(), Max = Min;
+  for (auto Case : SI->cases()) {
+    const APInt &V = Case.getCaseValue()->getValue();
+    if (V.slt(Min))
+      Min = V;
+    if (V.sgt(Max))
+      Max = V;
+  }
+  // Max - Min can't wrap as an unsigned value of the condition's width
+  APInt Range = Max - Min;
+  for (auto Case : SI->cases()) {
+    if (dispatcherOf(Case.getCaseSuccessor()) != dispatcher) {
+      dispatcher = nullptr;
+      break;
+    }
+  }
+  if (dispatcher != nullptr && Range.ult(MaxSwitchTable) &&
+      Range.getZExtValue() < MinSwitchDensity * SI->getNumCases()) {
+    uint64_t Size = Range.getZExtValue() + 1;
+    std::vector<Constant *> States(Size, defaultState);
+    for (auto Case : SI->cases())
+      States[(Case.getCaseValue()->getValue() - Min).getZExtValue()] =
+          stateOf(Case.getCaseSuccessor());
+    ArrayType *TableTy = ArrayType::get(defaultState->getType(), Size);
+    GlobalVariable *Table = new GlobalVariable(
+        *F->getParent(), TableTy, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(TableTy, States), F->getName() + ".switchTable");
+    Value *Cond = SI->getCondition();
+    Value *Index = IRB.CreateSub(Cond, ConstantInt::get(Cond->getType(), Min));
+    Value *InRange =
+        IRB.CreateICmpULT(Index, ConstantInt::get(Cond->getType(), Size));
+    // Out of range values read the first entry, which is then discarded
+    Index = IRB.CreateSelect(InRange, Index,
+                             ConstantInt::get(Cond->getType(), 0));
+    Index = IRB.CreateZExtOrTrunc(Index, IRB.getInt64Ty());
+    Value *State = IRB.CreateLoad(
+        defaultState->getType(),
+        IRB.CreateInBoundsGEP(TableTy, Table, {IRB.getInt64(0), Index}));
+    IRB.CreateStore(IRB.CreateSelect(InRange, State, defaultState), switchVar);
+    IRB.CreateBr(dispatcher);
+    SI->eraseFromParent();
+    return;
+  }
+
+  DenseMap<BasicBlock *, BasicBlock *> Setters;
+  auto setterOf = [&](BasicBlock *Dest) {
+    BasicBlock *&Setter = Setters[Dest];
+    if (Setter == nullptr) {
+      BasicBlock *target = dispatcherOf(Dest);
+      Setter = BasicBlock::Create(F->getContext(), "switchCase", F, target);
+      IRBuilder<> SetterIRB(Setter);
+      SetterIRB.SetCurrentDebugLocation(SI->getDebugLoc());
+      SetterIRB.CreateStore(stateOf(Dest), switchVar);
+      SetterIRB.CreateBr(target);
+    }
+    return Setter;
+  };
+  SI->setDefaultDest(setterOf(SI->getDefaultDest()));
+  for (auto Case : SI->cases())
+    Case.setSuccessor(setterOf(Case.getCaseSuccessor()));
+}
+} // namespace llvm
+
+#endif
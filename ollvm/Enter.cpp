@@ -7,6 +7,7 @@
 #include "Transforms/Obfuscation/Split.h"
 #include "Transforms/Obfuscation/Substitution.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 using namespace llvm;
@@ -14,13 +15,264 @@ using namespace llvm;
 static void registerOllvmPass(const PassManagerBuilder &,
                               legacy::PassManagerBase &PM) {
     PM.add(createBogus(true));
-#if LLVM_VERSION_MAJOR >= 9
-    PM.add(createLowerSwitchPass());
-#endif
     PM.add(createFlattening(true));
     PM.add(createSplitBasicBlock(true));
     PM.add(createSubstitution(true));
 }
+enum ObfuscationExtensionPoint {
+    EP_Early,
+    EP_ScalarLate,
+    EP_Last,
+    EP_LTOLate
+};
+static cl::opt<ObfuscationExtensionPoint> ollvmExtensionPoint(
+        "ollvm-ep", cl::init(EP_Early),
+        cl::desc("[ollvm]Where the function obfuscation passes run"),
+        cl::values(
+                clEnumValN(EP_Early, "early",
+                           "Before any optimization, so the optimizer can "
+                           "undo some of it (default)"),
+                clEnumValN(EP_ScalarLate, "scalar-late",
+                           "After the scalar optimizations, before "
+                           "vectorization and unrolling"),
+                clEnumValN(EP_Last, "optimizer-last",
+                           "After the whole per-TU optimization pipeline"),
+                clEnumValN(EP_LTOLate, "lto-late",
+                           "At the end of full LTO, nothing runs per TU")));
+
+enum ObfuscationThinLTOPhase {
+    Phase_PreLink,
+    Phase_Backend
+};
+static cl::opt<ObfuscationThinLTOPhase> ollvmThinLTOPhase(
+        "ollvm-thinlto", cl::init(Phase_PreLink),
+        cl::desc("[ollvm]Where ThinLTO builds are obfuscated"),
+        cl::values(
+                clEnumValN(Phase_PreLink, "prelink",
+                           "When each TU is compiled (default)"),
+                clEnumValN(Phase_Backend, "backend",
+                           "In the ThinLTO backends, after importing. The "
+                           "plugin has to be loaded by the linker")));
+
+// Both ThinLTO phases reach most extension points, so without this check
+// the passes would run twice. Builds without ThinLTO have one phase.
+static bool isollvmPhase(const PassManagerBuilder &Builder) {
+    if (Builder.PrepareForThinLTO) {
+        return ollvmThinLTOPhase == Phase_PreLink;
+    }
+    if (Builder.PerformThinLTO) {
+        return ollvmThinLTOPhase == Phase_Backend;
+    }
+    return true;
+}
+
+// Registered at every candidate extension point, only the selected one adds
+// the passes. Options are parsed by the time the pipeline is populated.
+template <ObfuscationExtensionPoint EP>
+static void registerOllvmPassAt(const PassManagerBuilder &Builder,
+                              legacy::PassManagerBase &PM) {
+    if (ollvmExtensionPoint == EP && isollvmPhase(Builder)) {
+        registerOllvmPass(Builder, PM);
+    }
+}
+
+// ThinLTO backends don't run EP_EarlyAsPossible, the module optimizer is
+// the earliest point after importing
+static bool isEarlyInBackend(const PassManagerBuilder &Builder) {
+    return Builder.PerformThinLTO && ollvmExtensionPoint == EP_Early;
+}
+
+static void registerOllvmPassThinLTOEarly(const PassManagerBuilder &Builder,
+                              legacy::PassManagerBase &PM) {
+    if (isEarlyInBackend(Builder) && isollvmPhase(Builder)) {
+        registerOllvmPass(Builder, PM);
+    }
+}
+
+// -O0 pipelines only run EP_EarlyAsPossible and EP_EnabledOnOptLevel0
+static void registerOllvmPassO0(const PassManagerBuilder &Builder,
+                              legacy::PassManagerBase &PM) {
+    if ((ollvmExtensionPoint == EP_ScalarLate ||
+         ollvmExtensionPoint == EP_Last || isEarlyInBackend(Builder)) &&
+        isollvmPhase(Builder)) {
+        registerOllvmPass(Builder, PM);
+    }
+}
+
 static RegisterStandardPasses
         RegisterMyPass(PassManagerBuilder::EP_EarlyAsPossible,
-                       registerOllvmPass);
+                       registerOllvmPassAt<EP_Early>);
+static RegisterStandardPasses
+        RegisterMyPass1(PassManagerBuilder::EP_ScalarOptimizerLate,
+                        registerOllvmPassAt<EP_ScalarLate>);
+static RegisterStandardPasses
+        RegisterMyPass2(PassManagerBuilder::EP_OptimizerLast,
+                        registerOllvmPassAt<EP_Last>);
+static RegisterStandardPasses
+        RegisterMyPass3(PassManagerBuilder::EP_FullLinkTimeOptimizationLast,
+                        registerOllvmPassAt<EP_LTOLate>);
+static RegisterStandardPasses
+        RegisterMyPass4(PassManagerBuilder::EP_EnabledOnOptLevel0,
+                        registerOllvmPassO0);
+static RegisterStandardPasses
+        RegisterMyPass5(PassManagerBuilder::EP_ModuleOptimizerEarly,
+                        registerOllvmPassThinLTOEarly);
+
+#if __has_include("llvm/Passes/PassPlugin.h")
+// New pass manager entry point, used with -fpass-plugin / opt -load-pass-plugin
+#include "Transforms/Obfuscation/NewPassManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+struct BogusPass : ObfuscationFunctionPass<BogusPass> {
+    BogusPass()
+        : ObfuscationFunctionPass(
+              static_cast<FunctionPass *>(createBogus(true)), false) {}
+};
+struct FlatteningPass : ObfuscationFunctionPass<FlatteningPass> {
+    FlatteningPass()
+        : ObfuscationFunctionPass(
+              static_cast<FunctionPass *>(createFlattening(true)), false) {}
+};
+struct SplitBasicBlockPass : ObfuscationFunctionPass<SplitBasicBlockPass> {
+    SplitBasicBlockPass()
+        : ObfuscationFunctionPass(
+              static_cast<FunctionPass *>(createSplitBasicBlock(true)), false) {}
+};
+struct SubstitutionPass : ObfuscationFunctionPass<SubstitutionPass> {
+    SubstitutionPass()
+        : ObfuscationFunctionPass(
+              static_cast<FunctionPass *>(createSubstitution(true)), true) {}
+};
+} // namespace
+
+// Same passes and order as registerOllvmPass
+static void addOllvmPasses(FunctionPassManager &FPM) {
+    FPM.addPass(BogusPass());
+    FPM.addPass(FlatteningPass());
+    FPM.addPass(SplitBasicBlockPass());
+    FPM.addPass(SubstitutionPass());
+}
+
+// -ollvm-thinlto for the new pass manager, see ThinLTOPhaseGate
+static bool isollvmPhase(ThinLTOPhase Phase) {
+    if (Phase == ThinLTOPhase::PreLink) {
+        return ollvmThinLTOPhase == Phase_PreLink;
+    }
+    if (Phase == ThinLTOPhase::Backend) {
+        return ollvmThinLTOPhase == Phase_Backend;
+    }
+    return true;
+}
+
+// ThinLTO backends don't run PipelineStart, early simplification is the
+// earliest point after importing
+static bool isEarlyInBackend(ThinLTOPhase Phase) {
+    return Phase == ThinLTOPhase::Backend &&
+           ollvmThinLTOPhase == Phase_Backend;
+}
+
+static void addOllvmPassesAt(ModulePassManager &MPM,
+                             bool (*Filter)(ThinLTOPhase)) {
+    FunctionPassManager FPM;
+    addOllvmPasses(FPM);
+    ModulePassManager Passes;
+    Passes.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+    MPM.addPass(ThinLTOPhaseGate<Module>(std::move(Passes), Filter));
+}
+
+#if LLVM_VERSION_MAJOR < 15
+// The new pass manager has no full LTO extension point before LLVM 15.
+// lto-late runs the passes at optimizer-last there instead of leaving every
+// function unobfuscated
+static bool fallBackFromLTOLate() {
+    if (ollvmExtensionPoint != EP_LTOLate) {
+        return false;
+    }
+    static bool Warned = false;
+    if (!Warned) {
+        errs() << "warning: -ollvm-ep=lto-late needs LLVM 15 with the new "
+                  "pass manager, running the passes at optimizer-last\n";
+        Warned = true;
+    }
+    return true;
+}
+#endif
+
+static void registerOllvmPassBuilderCallbacks(PassBuilder &PB) {
+    PB.registerPipelineParsingCallback(
+        [](StringRef Name, FunctionPassManager &FPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name == "ollvm-bcf") {
+                FPM.addPass(BogusPass());
+            } else if (Name == "ollvm-fla") {
+                FPM.addPass(FlatteningPass());
+            } else if (Name == "ollvm-split") {
+                FPM.addPass(SplitBasicBlockPass());
+            } else if (Name == "ollvm-sub") {
+                FPM.addPass(SubstitutionPass());
+            } else {
+                return false;
+            }
+            return true;
+        });
+#if LLVM_VERSION_MAJOR >= 12
+    PB.registerPipelineStartEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+#else
+    PB.registerPipelineStartEPCallback([](ModulePassManager &MPM) {
+#endif
+            startThinLTOPipeline();
+            if (ollvmExtensionPoint == EP_Early) {
+                addOllvmPassesAt(MPM, isollvmPhase);
+            }
+        });
+#if LLVM_VERSION_MAJOR >= 12
+    PB.registerPipelineEarlySimplificationEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+            if (ollvmExtensionPoint == EP_Early) {
+                addOllvmPassesAt(MPM, isEarlyInBackend);
+            }
+        });
+#endif
+    PB.registerScalarOptimizerLateEPCallback(
+        [](FunctionPassManager &FPM, ObfuscationOptLevel) {
+            if (ollvmExtensionPoint == EP_ScalarLate) {
+                FunctionPassManager Passes;
+                addOllvmPasses(Passes);
+                FPM.addPass(ThinLTOPhaseGate<Function>(std::move(Passes),
+                                                       isollvmPhase));
+            }
+        });
+    PB.registerVectorizerStartEPCallback(
+        [](FunctionPassManager &, ObfuscationOptLevel) {
+            getThinLTOPipeline()->SawVectorizer = true;
+        });
+    PB.registerOptimizerLastEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+#if LLVM_VERSION_MAJOR >= 15
+            if (ollvmExtensionPoint == EP_Last) {
+#else
+            if (ollvmExtensionPoint == EP_Last || fallBackFromLTOLate()) {
+#endif
+                addOllvmPassesAt(MPM, isollvmPhase);
+            }
+            endThinLTOPipeline();
+        });
+#if LLVM_VERSION_MAJOR >= 15
+    PB.registerFullLinkTimeOptimizationLastEPCallback(
+        [](ModulePassManager &MPM, ObfuscationOptLevel) {
+            if (ollvmExtensionPoint == EP_LTOLate) {
+                FunctionPassManager FPM;
+                addOllvmPasses(FPM);
+                MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+            }
+        });
+#endif
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "ollvm", LLVM_VERSION_STRING,
+            registerOllvmPassBuilderCallbacks};
+}
+#endif
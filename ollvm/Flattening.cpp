@@ -12,7 +12,9 @@
 //===----------------------------------------------------------------------===//
 
 #include "Transforms/Obfuscation/Flattening.h"
+#include "Transforms/Obfuscation/FlattenSwitch.h"
 #include "Transforms/Obfuscation/Utils.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/CryptoUtils.h"
 
@@ -46,6 +48,7 @@ bool Flattening::runOnFunction(Function &F) {
   if (toObfuscate(flag, tmp, "fla")) {
     if (flatten(tmp)) {
       ++Flattened;
+      return true;
     }
   }
 
@@ -65,15 +68,6 @@ bool Flattening::flatten(Function *f) {
   llvm::cryptoutils->get_bytes(scrambling_key, 16);
   // END OF SCRAMBLER
 
-  // Lower switch
-#if LLVM_VERSION_MAJOR >= 9
-    // >=9.0, LowerSwitchPass depends on LazyValueInfoWrapperPass, which cause AssertError.
-    // So I move LowerSwitchPass into register function, just before FlatteningPass.
-#else
-  FunctionPass *lower = createLowerSwitchPass();
-  lower->runOnFunction(*f);
-#endif
-
   // Save all original BB
   for (Function::iterator i = f->begin(); i != f->end(); ++i) {
     BasicBlock *tmp = &*i;
@@ -169,6 +163,19 @@ bool Flattening::flatten(Function *f) {
     switchI->addCase(numCase, i);
   }
 
+  // State of the dispatcher case that jumps to BB
+  auto stateOf = [&](BasicBlock *BB) {
+    ConstantInt *numCase = switchI->findCaseDest(BB);
+    // If next case == default case (switchDefault)
+    if (numCase == NULL) {
+      numCase = cast<ConstantInt>(
+          ConstantInt::get(switchI->getCondition()->getType(),
+                           llvm::cryptoutils->scramble32(
+                               switchI->getNumCases() - 1, scrambling_key)));
+    }
+    return numCase;
+  };
+
   // Recalculate switchVar
   for (vector<BasicBlock *>::iterator b = origBB.begin(); b != origBB.end();
        ++b) {
@@ -180,6 +187,14 @@ bool Flattening::flatten(Function *f) {
       continue;
     }
 
+    // Switches map each case to its state without being lowered
+    if (SwitchInst *SI = dyn_cast<SwitchInst>(i->getTerminator())) {
+      flattenSwitch(
+          SI, load->getPointerOperand(),
+          [&](BasicBlock *) { return loopEnd; }, stateOf);
+      continue;
+    }
+
     // If it's a non-conditional jump
     if (i->getTerminator()->getNumSuccessors() == 1) {
       // Get successor and delete terminator
@@ -66,6 +66,7 @@ bool SplitBasicBlock::runOnFunction(Function &F) {
   if (toObfuscate(flag, tmp, "split")) {
     split(tmp);
     ++Split;
+    return true;
   }
 
   return false;
@@ -2,6 +2,22 @@
 #include "llvm/Support/raw_ostream.h"
 #include <sstream>
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Compiler.h"
+#include <chrono>
+
+static cl::opt<unsigned> MaxInstructions(
+    "ollvm-max-insts", cl::init(0),
+    cl::desc("[ollvm]Functions with more instructions get neither bcf nor fla, "
+             "0 for no limit"));
+static cl::opt<unsigned> MaxBlocks(
+    "ollvm-max-blocks", cl::init(0),
+    cl::desc("[ollvm]Functions with more basic blocks get neither bcf nor fla, "
+             "0 for no limit"));
+static cl::opt<unsigned> TimeBudget(
+    "ollvm-time-budget", cl::init(0), cl::value_desc("ms"),
+    cl::desc("[ollvm]Soft per-function budget, the passes still left when it "
+             "runs out are skipped, 0 for no budget"));
 
 // Shamefully borrowed from ../Scalar/RegToMem.cpp :(
 bool valueEscapes(Instruction *Inst) {
@@ -97,7 +113,7 @@ std::string readAnnotate(Function *f) {
   return annotation;
 }
 
-bool toObfuscate(bool flag, Function *f, std::string attribute) {
+static bool isEnabled(bool flag, Function *f, std::string attribute) {
   std::string attr = attribute;
   std::string attrNo = "no" + attr;
 
@@ -146,3 +162,49 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
   return false;
 }
 
+// Compile-time guardrails. Every pass asks toObfuscate() right before it
+// runs, and the pass manager runs all of them on one function before moving
+// to the next, so a new function restarts the budget. ThinLTO backends run
+// on parallel threads, each one tracks its own function.
+static bool withinGuardrails(Function *f, const std::string &attribute) {
+  typedef std::chrono::steady_clock Clock;
+  static LLVM_THREAD_LOCAL const Function *Current = nullptr;
+  // A tick count, __thread takes only trivial types
+  static LLVM_THREAD_LOCAL Clock::rep Start = 0;
+  if (f != Current) {
+    Current = f;
+    Start = Clock::now().time_since_epoch().count();
+  }
+  if (TimeBudget != 0) {
+    Clock::time_point Begin{Clock::duration(Start)};
+    long long Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            Clock::now() - Begin)
+                            .count();
+    if (Elapsed > TimeBudget) {
+      errs() << "Guardrail: " << f->getName() << " took " << Elapsed
+             << " ms, over -ollvm-time-budget=" << TimeBudget << ", skipping "
+             << attribute << "\n";
+      return false;
+    }
+  }
+  // bcf and fla grow faster than the function, above the limits only the
+  // linear passes run
+  if (attribute != "bcf" && attribute != "fla") {
+    return true;
+  }
+  unsigned Instructions = f->getInstructionCount();
+  if ((MaxInstructions != 0 && Instructions > MaxInstructions) ||
+      (MaxBlocks != 0 && f->size() > MaxBlocks)) {
+    errs() << "Guardrail: " << f->getName() << " has " << Instructions
+           << " instructions in " << f->size()
+           << " blocks, over -ollvm-max-insts=" << MaxInstructions
+           << " / -ollvm-max-blocks=" << MaxBlocks << ", skipping "
+           << attribute << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool toObfuscate(bool flag, Function *f, std::string attribute) {
+  return isEnabled(flag, f, attribute) && withinGuardrails(f, attribute);
+}
@@ -1,4 +1,5 @@
 #include "BogusControlFlow.h"
+#include "OpcodeCounter.h"
 #include "Utils.h"
 
 // Stats
@@ -50,6 +51,7 @@ struct BogusControlFlow : public FunctionPass {
    * 入口函数
    */
   virtual bool runOnFunction(Function &F) {
+    OpcodeCounterScope Metrics(F, "boguscf");
     // 检查混效率是否合法
     if (ObfTimes <= 0) {
       errs() << "BogusControlFlow application number -bcf_loop=x must be x > 0";
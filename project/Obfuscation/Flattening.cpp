@@ -12,6 +12,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "Flattening.h"
+#include "OpcodeCounter.h"
 #include "Utils.h"
 #include "llvm/Transforms/Scalar.h"
 #include "CryptoUtils.h"
@@ -41,6 +42,7 @@ static RegisterPass<Flattening> X("flattening", "Call graph flattening");
 Pass *llvm::createFlattening(bool flag) { return new Flattening(flag); }
 
 bool Flattening::runOnFunction(Function &F) {
+    OpcodeCounterScope Metrics(F, "flattening");
     Function *tmp = &F;
     // Do we obfuscate
 
@@ -2,42 +2,390 @@
 //
 //  Count the number of operators in a function
 //
+//  Besides the opcode histogram, every function gets its blocks,
+//  instructions, CFG edges, cyclomatic complexity (edges - blocks + 2),
+//  loads, stores and calls, and every module the sums of those. With
+//  -oc-format=jsonl or csv one record per function and one per module is
+//  appended to -oc-output, so the numbers from a whole build end up in one
+//  file.
+//
+//  Each record names its position in the pipeline, e.g. "after flattening,
+//  before substitution". Put -oc around the obfuscation passes to track how
+//  much each one grows the IR:
+//
+//    opt -load LLVMObfuscation.so -oc -flattening -oc -substitution -oc \
+//        -oc-format=jsonl -oc-output=metrics.jsonl in.bc -o out.bc
+//
+//  or let the obfuscation passes of this library emit the records around
+//  themselves with -oc-each, see OpcodeCounterScope. Hikari's scheduler
+//  runs its passes inside one module pass, -oc only sees it as a whole.
+//
 //===----------------------------------------------------------------------===//
-#include "llvm/Pass.h"
+#include "OpcodeCounter.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LegacyPassManagers.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
 #include "llvm/Support/raw_ostream.h"
+#include <memory>
 
 using namespace llvm;
+
+enum MetricsFormat { FormatText, FormatJSONL, FormatCSV };
+
+static cl::opt<MetricsFormat> Format(
+	"oc-format", cl::init(FormatText), cl::desc("Output format of -oc"),
+	cl::values(clEnumValN(FormatText, "text", "Opcode counts, readable"),
+			   clEnumValN(FormatJSONL, "jsonl", "One JSON object per line"),
+			   clEnumValN(FormatCSV, "csv", "One CSV row per line")));
+static cl::opt<std::string> Output(
+	"oc-output", cl::init("-"),
+	cl::desc("File -oc appends its records to, - for stdout"));
+static cl::opt<bool> Each(
+	"oc-each", cl::init(false),
+	cl::desc("Emit -oc records before and after every obfuscation pass"));
+
 namespace{
+	// Dense per-opcode counts plus the CFG numbers derived from them
+	struct IRMetrics{
+		unsigned Opcodes[Instruction::OtherOpsEnd] = {};
+		uint64_t Functions = 0, Blocks = 0, Instructions = 0, Edges = 0;
+		// Unreachable blocks can make it negative
+		int64_t Cyclomatic = 0;
+
+		void add(const IRMetrics &Other){
+			for(unsigned i = 0; i < Instruction::OtherOpsEnd; i++){
+				Opcodes[i] += Other.Opcodes[i];
+			}
+			Functions += Other.Functions;
+			Blocks += Other.Blocks;
+			Instructions += Other.Instructions;
+			Edges += Other.Edges;
+			Cyclomatic += Other.Cyclomatic;
+		}
+		uint64_t calls() const {
+			uint64_t Calls = Opcodes[Instruction::Call] +
+							 Opcodes[Instruction::Invoke];
+#if LLVM_VERSION_MAJOR >= 9
+			Calls += Opcodes[Instruction::CallBr];
+#endif
+			return Calls;
+		}
+	};
+
 	struct OpcodeCounter : public FunctionPass{
 		static char ID;
 		OpcodeCounter() : FunctionPass(ID){}
 
-		bool runOnFunction(Function &F) override {
-			std::map<std::string, int> opcodeCounter;
-			errs() << "Function name: " << F.getName() << '\n'; 
-			for(Function::iterator fun = F.begin(); fun != F.end(); fun++){
-				for(BasicBlock::iterator bb = fun->begin(); bb != fun->end(); bb++){
-					if(opcodeCounter.find(bb->getOpcodeName()) == opcodeCounter.end()){
-						opcodeCounter[bb->getOpcodeName()] = 1;
-					} else {
-						opcodeCounter[bb->getOpcodeName()] += 1;
-					}
-				}
+		bool doInitialization(Module &M) override;
+		bool runOnFunction(Function &F) override;
+		bool doFinalization(Module &M) override;
+
+	private:
+		std::string stage();
+
+		std::string ModuleName;
+		std::string Stage;
+		IRMetrics ModuleTotal;
+	};
+}
+
+static const char *CSVColumns[] = {"module",     "stage",   "kind",
+								   "name",       "functions", "blocks",
+								   "instructions", "edges", "cyclomatic",
+								   "loads",      "stores",  "calls"};
+
+static void writeCSVHeader(raw_ostream &OS){
+	for(const char *Column : CSVColumns){
+		OS << Column << ',';
+	}
+	for(unsigned i = 1; i < Instruction::OtherOpsEnd; i++){
+		OS << Instruction::getOpcodeName(i)
+		   << (i + 1 < Instruction::OtherOpsEnd ? "," : "\n");
+	}
+}
+
+// Opens -oc-output for appending. Many opt processes of a build, and every
+// instance in one of them, append to the same file, so exactly one of them
+// may create it with the CSV header: the header is written to a temporary
+// file which is then hard linked to the output, failing if it exists.
+static std::error_code openOutput(int &FD){
+	while(Format == FormatCSV && !sys::fs::exists(Output)){
+		int TempFD;
+		SmallString<128> TempPath;
+		std::error_code EC = sys::fs::createUniqueFile(
+			Output + "-%%%%%%.tmp", TempFD, TempPath);
+		if(EC){
+			return EC;
+		}
+		{
+			raw_fd_ostream Temp(TempFD, true);
+			writeCSVHeader(Temp);
+		}
+		EC = sys::fs::create_hard_link(TempPath, Output);
+		sys::fs::remove(TempPath);
+		if(EC && EC != std::errc::file_exists){
+			// No hard links on this file system, only create the file
+			// exclusively
+			EC = sys::fs::openFileForWrite(Output, FD, sys::fs::CD_CreateNew,
+										   sys::fs::OF_Append |
+											   sys::fs::OF_Text);
+			if(!EC){
+				raw_fd_ostream New(FD, false, true);
+				writeCSVHeader(New);
+				return EC;
+			}
+			if(EC != std::errc::file_exists){
+				return EC;
 			}
+		}
+	}
+	return sys::fs::openFileForWrite(Output, FD, sys::fs::CD_OpenAlways,
+									 sys::fs::OF_Append | sys::fs::OF_Text);
+}
+
+// Where every record of this process goes, opened on first use.
+// Unbuffered, emitRecord() hands each record over in one write so the
+// records of concurrent writers don't interleave
+static raw_ostream &output(){
+	static std::unique_ptr<raw_fd_ostream> File;
+	static raw_ostream *OS = nullptr;
+	if(OS != nullptr){
+		return *OS;
+	}
+	if(Output == "-"){
+		OS = &outs();
+		if(Format == FormatCSV){
+			writeCSVHeader(*OS);
+		}
+		return *OS;
+	}
+	int FD;
+	if(std::error_code EC = openOutput(FD)){
+		errs() << "Failed To Open " << Output << ": " << EC.message() << "\n";
+		OS = &outs();
+		return *OS;
+	}
+	File.reset(new raw_fd_ostream(FD, true, true));
+	OS = File.get();
+	return *OS;
+}
 
-			std::map<std::string, int>::iterator b = opcodeCounter.begin();
-			std::map<std::string, int>::iterator e = opcodeCounter.end();
-			while(b != e){
-				llvm::outs() << b->first << " : " << b->second << '\n';
-				b++;
+static IRMetrics measure(Function &F){
+	IRMetrics Metrics;
+	Metrics.Functions = 1;
+	for(BasicBlock &BB : F){
+		Metrics.Blocks++;
+		for(Instruction &I : BB){
+			Metrics.Opcodes[I.getOpcode()]++;
+			Metrics.Instructions++;
+		}
+		if(const Instruction *Term = BB.getTerminator()){
+			Metrics.Edges += Term->getNumSuccessors();
+		}
+	}
+	Metrics.Cyclomatic = (int64_t)Metrics.Edges - (int64_t)Metrics.Blocks + 2;
+	return Metrics;
+}
+
+static void writeRecord(raw_ostream &Out, StringRef ModuleName,
+						StringRef Stage, StringRef Kind, StringRef Name,
+						const IRMetrics &Metrics){
+	uint64_t Loads = Metrics.Opcodes[Instruction::Load];
+	uint64_t Stores = Metrics.Opcodes[Instruction::Store];
+	if(Format == FormatText){
+		Out << (Kind == "module" ? "Module: " : "Function name: ") << Name
+			<< " (" << Stage << ")\n";
+		Out << "blocks : " << Metrics.Blocks << ", edges : " << Metrics.Edges
+			<< ", cyclomatic : " << Metrics.Cyclomatic << "\n";
+		for(unsigned i = 1; i < Instruction::OtherOpsEnd; i++){
+			if(Metrics.Opcodes[i] != 0){
+				Out << Instruction::getOpcodeName(i) << " : "
+					<< Metrics.Opcodes[i] << '\n';
+			}
+		}
+		Out << '\n';
+		return;
+	}
+	if(Format == FormatJSONL){
+		json::Object Opcodes;
+		for(unsigned i = 1; i < Instruction::OtherOpsEnd; i++){
+			if(Metrics.Opcodes[i] != 0){
+				Opcodes[Instruction::getOpcodeName(i)] = Metrics.Opcodes[i];
+			}
+		}
+		json::Object Record{{"module", ModuleName},
+							{"stage", Stage},
+							{"kind", Kind},
+							{"name", Name},
+							{"functions", Metrics.Functions},
+							{"blocks", Metrics.Blocks},
+							{"instructions", Metrics.Instructions},
+							{"edges", Metrics.Edges},
+							{"cyclomatic", Metrics.Cyclomatic},
+							{"loads", Loads},
+							{"stores", Stores},
+							{"calls", Metrics.calls()},
+							{"opcodes", std::move(Opcodes)}};
+		Out << json::Value(std::move(Record)) << '\n';
+		return;
+	}
+	// CSV, text fields are quoted and every opcode has its own column
+	auto quote = [](StringRef S){
+		std::string Quoted = "\"";
+		for(char C : S){
+			Quoted += C;
+			if(C == '"'){
+				Quoted += '"';
 			}
-			llvm::outs() << '\n';
-			opcodeCounter.clear();
-			return false;
 		}
+		return Quoted + "\"";
+	};
+	Out << quote(ModuleName) << ',' << quote(Stage) << ',' << Kind << ','
+		<< quote(Name) << ',' << Metrics.Functions << ',' << Metrics.Blocks
+		<< ',' << Metrics.Instructions << ',' << Metrics.Edges << ','
+		<< Metrics.Cyclomatic << ',' << Loads << ',' << Stores << ','
+		<< Metrics.calls();
+	for(unsigned i = 1; i < Instruction::OtherOpsEnd; i++){
+		Out << ',' << Metrics.Opcodes[i];
+	}
+	Out << '\n';
+}
+
+// Writes one record to output() in a single write
+static void emitRecord(StringRef ModuleName, StringRef Stage, StringRef Kind,
+					   StringRef Name, const IRMetrics &Metrics){
+	std::string Buffer;
+	raw_string_ostream Record(Buffer);
+	writeRecord(Record, ModuleName, Stage, Kind, Name, Metrics);
+	Record.flush();
+	output().write(Buffer.data(), Buffer.size());
+}
 
+// Nearest transformations before and after this instance, by their
+// -arguments. Analyses, the verifier and other counters are skipped.
+std::string OpcodeCounter::stage(){
+	PMDataManager &PMD = getResolver()->getPMDataManager();
+	if(PMD.getPassManagerType() != PMT_FunctionPassManager){
+		return "standalone";
+	}
+	FPPassManager &FPM = static_cast<FPPassManager &>(PMD);
+	int N = FPM.getNumContainedPasses();
+	int Self = 0;
+	while(Self < N && FPM.getContainedPass(Self) != this){
+		Self++;
+	}
+	auto argumentOf = [&](int i) -> std::string {
+		Pass *P = FPM.getContainedPass(i);
+		if(P->getPassID() == &ID){
+			return "";
+		}
+		const PassInfo *PI = PassRegistry::getPassRegistry()->getPassInfo(
+			P->getPassID());
+		if(PI == nullptr){
+			return P->getPassName().str();
+		}
+		if(PI->isAnalysis() || PI->getPassArgument() == "verify"){
+			return "";
+		}
+		return PI->getPassArgument().str();
 	};
+	std::string Before, After;
+	for(int i = Self - 1; i >= 0 && Before.empty(); i--){
+		Before = argumentOf(i);
+	}
+	for(int i = Self + 1; i < N && After.empty(); i++){
+		After = argumentOf(i);
+	}
+	std::string Result;
+	if(!Before.empty()){
+		Result = "after " + Before;
+	}
+	if(!After.empty()){
+		Result += (Result.empty() ? "before " : ", before ") + After;
+	}
+	return Result.empty() ? "standalone" : Result;
+}
+
+bool OpcodeCounter::doInitialization(Module &M){
+	ModuleName = M.getModuleIdentifier();
+	ModuleTotal = IRMetrics();
+	Stage.clear();
+	return false;
+}
+
+bool OpcodeCounter::runOnFunction(Function &F){
+	if(F.isDeclaration()){
+		return false;
+	}
+	if(Stage.empty()){
+		Stage = stage();
+	}
+	IRMetrics Metrics = measure(F);
+	emitRecord(ModuleName, Stage, "function", F.getName(), Metrics);
+	ModuleTotal.add(Metrics);
+	return false;
+}
+
+bool OpcodeCounter::doFinalization(Module &M){
+	if(ModuleTotal.Functions != 0){
+		emitRecord(ModuleName, Stage, "module", ModuleName, ModuleTotal);
+	}
+	output().flush();
+	return false;
+}
+
+OpcodeCounterScope::OpcodeCounterScope(Function &F, StringRef Pass)
+	: F(&F), M(F.getParent()), Pass(Pass.str()){
+	if(Each){
+		record("before ");
+	}
+}
+
+OpcodeCounterScope::OpcodeCounterScope(Module &M, StringRef Pass)
+	: F(nullptr), M(&M), Pass(Pass.str()){
+	if(Each){
+		record("before ");
+	}
+}
+
+OpcodeCounterScope::~OpcodeCounterScope(){
+	if(Each){
+		record("after ");
+	}
+}
+
+// A function scope records its function, a module scope every function of
+// the module and their sum
+void OpcodeCounterScope::record(StringRef When){
+	std::string ModuleName = M->getModuleIdentifier();
+	std::string Stage = (When + Pass).str();
+	if(F != nullptr){
+		if(!F->isDeclaration()){
+			emitRecord(ModuleName, Stage, "function", F->getName(), measure(*F));
+		}
+		return;
+	}
+	IRMetrics Total;
+	for(Function &Fn : *M){
+		if(Fn.isDeclaration()){
+			continue;
+		}
+		IRMetrics Metrics = measure(Fn);
+		emitRecord(ModuleName, Stage, "function", Fn.getName(), Metrics);
+		Total.add(Metrics);
+	}
+	if(Total.Functions != 0){
+		emitRecord(ModuleName, Stage, "module", ModuleName, Total);
+	}
 }
 
 char OpcodeCounter::ID = 0;
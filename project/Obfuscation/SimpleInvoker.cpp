@@ -2,31 +2,160 @@
 //
 //  Check to see if the main function exists, create it if it doesn't exist
 //
+//  With -si-bench the generated main is a benchmark harness instead: every
+//  function without arguments is called -si-iterations times in a timed
+//  loop and the timings are printed as CSV, so any module, obfuscated or
+//  not, can be turned into a microbenchmark.
+//
+//    opt -load LLVMObfuscation.so -si -si-bench -si-iterations=100000 \
+//        -si-timer=clock in.bc -o bench.bc
+//    clang bench.bc -o bench && ./bench > timings.csv
+//
 //===----------------------------------------------------------------------===//
 
-#include "llvm/Pass.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/IR/IRBuilder.h"
-
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
 
 using namespace llvm;
+
+enum InvokerTimer { TimerCycles, TimerClock };
+
+static cl::opt<bool> Bench("si-bench", cl::init(false),
+                           cl::desc("Generate a main that times every "
+                                    "function without arguments"));
+static cl::opt<unsigned> Iterations("si-iterations", cl::init(1000),
+                                    cl::desc("Calls per function in the "
+                                             "timed loop of -si-bench"));
+static cl::opt<InvokerTimer> Timer(
+    "si-timer", cl::init(TimerCycles),
+    cl::desc("Timer used by -si-bench"),
+    cl::values(clEnumValN(TimerCycles, "rdtsc",
+                          "Cycle counter (rdtsc on x86, llvm.readcyclecounter)"),
+               clEnumValN(TimerClock, "clock",
+                          "clock_gettime(CLOCK_MONOTONIC), in nanoseconds")));
+
 namespace{
     struct SimpleInvoker: public ModulePass{
         static char ID;
         SimpleInvoker() : ModulePass(ID){}
         bool runOnModule(Module &M) override;
+        void createHarness(Module &M, Function *Main);
+        Value *readTimer(Module &M, IRBuilder<> &IRB);
     };
 }
 char SimpleInvoker::ID = 0;
+
+static bool isBenchmarkable(Function &F){
+    return !F.isDeclaration() && !F.hasAvailableExternallyLinkage() &&
+           F.arg_empty() && !F.isVarArg() && F.getName() != "main";
+}
+
+Value *SimpleInvoker::readTimer(Module &M, IRBuilder<> &IRB){
+    Type *Int64Ty = IRB.getInt64Ty();
+    if(Timer == TimerCycles){
+        return IRB.CreateCall(
+            Intrinsic::getDeclaration(&M, Intrinsic::readcyclecounter));
+    }
+    // struct timespec { time_t tv_sec; long tv_nsec; }, both are long sized
+    Type *LongTy = M.getDataLayout().getIntPtrType(M.getContext());
+    StructType *TimespecTy = StructType::get(LongTy, LongTy);
+    FunctionCallee ClockGettime = M.getOrInsertFunction(
+        "clock_gettime", IRB.getInt32Ty(), IRB.getInt32Ty(),
+        TimespecTy->getPointerTo());
+    // CLOCK_MONOTONIC
+    unsigned ClockId = Triple(M.getTargetTriple()).isOSDarwin() ? 6 : 1;
+    BasicBlock &Entry = IRB.GetInsertBlock()->getParent()->getEntryBlock();
+    IRBuilder<> AllocaBuilder(&Entry, Entry.begin());
+    Value *TS = AllocaBuilder.CreateAlloca(TimespecTy);
+    IRB.CreateCall(ClockGettime, {IRB.getInt32(ClockId), TS});
+    Value *Sec = IRB.CreateLoad(LongTy, IRB.CreateStructGEP(TimespecTy, TS, 0));
+    Value *NSec = IRB.CreateLoad(LongTy, IRB.CreateStructGEP(TimespecTy, TS, 1));
+    Sec = IRB.CreateSExtOrTrunc(Sec, Int64Ty);
+    NSec = IRB.CreateSExtOrTrunc(NSec, Int64Ty);
+    return IRB.CreateAdd(IRB.CreateMul(Sec, IRB.getInt64(1000000000)), NSec);
+}
+
+// 为每个无参函数生成计时循环 (fp 和 sink 是 volatile 变量):
+//   fp = f; start = timer();
+//   for (i = 0; i < N; i++) sink = (*fp)(); end = timer();
+//   printf("f,N,end-start,(end-start)/N\n");
+void SimpleInvoker::createHarness(Module &M, Function *Main){
+    LLVMContext &Ctx = M.getContext();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    FunctionCallee Printf = M.getOrInsertFunction(
+        "printf", FunctionType::get(Type::getInt32Ty(Ctx),
+                                    {Type::getInt8PtrTy(Ctx)}, true));
+    BasicBlock *BB = BasicBlock::Create(Ctx, "EntryBlock", Main);
+    IRBuilder<> IRB(BB);
+    const char *Unit = Timer == TimerCycles ? "cycles" : "ns";
+    IRB.CreateCall(Printf, {IRB.CreateGlobalStringPtr(
+                               "function,iterations,total_" + std::string(Unit) +
+                               ",per_call_" + Unit + "\n")});
+    Value *Format = IRB.CreateGlobalStringPtr("%s,%llu,%llu,%llu\n");
+    Value *Count = ConstantInt::get(Int64Ty, Iterations);
+    for(Function &FF : M){
+        if(!isBenchmarkable(FF)){
+            continue;
+        }
+        IRBuilder<> AllocaBuilder(&Main->getEntryBlock(),
+                                  Main->getEntryBlock().begin());
+        // 返回值写入 volatile 变量, 防止调用被优化掉
+        Value *Sink = nullptr;
+        if(!FF.getReturnType()->isVoidTy()){
+            Sink = AllocaBuilder.CreateAlloca(FF.getReturnType());
+        }
+        // 每次迭代都从 volatile 变量重新读取函数指针再间接调用:
+        // 优化器不知道被调函数, 无法内联, 也不能把 readnone/readonly
+        // 的调用当作循环不变量由 LICM/GVN 提到循环外
+        Value *Callee = AllocaBuilder.CreateAlloca(FF.getType());
+        IRB.CreateStore(&FF, Callee, /*isVolatile=*/true);
+        Value *Start = readTimer(M, IRB);
+        BasicBlock *Preheader = IRB.GetInsertBlock();
+        BasicBlock *Loop = BasicBlock::Create(Ctx, FF.getName() + ".loop", Main);
+        BasicBlock *Exit = BasicBlock::Create(Ctx, FF.getName() + ".done", Main);
+        IRB.CreateBr(Loop);
+        IRB.SetInsertPoint(Loop);
+        PHINode *I = IRB.CreatePHI(Int64Ty, 2);
+        I->addIncoming(ConstantInt::get(Int64Ty, 0), Preheader);
+        CallInst *CI = IRB.CreateCall(
+            FF.getFunctionType(),
+            IRB.CreateLoad(FF.getType(), Callee, /*isVolatile=*/true));
+        if(Sink){
+            IRB.CreateStore(CI, Sink, /*isVolatile=*/true);
+        }
+        Value *Next = IRB.CreateAdd(I, ConstantInt::get(Int64Ty, 1));
+        I->addIncoming(Next, Loop);
+        IRB.CreateCondBr(IRB.CreateICmpULT(Next, Count), Loop, Exit);
+        IRB.SetInsertPoint(Exit);
+        Value *Total = IRB.CreateSub(readTimer(M, IRB), Start);
+        IRB.CreateCall(Printf, {Format, IRB.CreateGlobalStringPtr(FF.getName()),
+                                Count, Total, IRB.CreateUDiv(Total, Count)});
+    }
+    IRB.CreateRet(ConstantInt::get(Type::getInt32Ty(Ctx), 0));
+}
+
 bool SimpleInvoker::runOnModule(Module &M){
     Function *F = M.getFunction("main");
     if(F){
         errs() << "Main function found, so return \n";
         return true;
     }
+    if(Bench && Iterations == 0){
+        errs() << "-si-iterations must be at least 1\n";
+        return false;
+    }
     errs() << "Main function not found, so create\n";
     FunctionType *FT = FunctionType::get(Type::getInt32Ty(M.getContext()), false);
     // 创建函数: 函数类型、连接类型、函数名、所在模块
     F = Function    ::Create(FT, GlobalValue::LinkageTypes::ExternalLinkage,"main", &M);
+    if(Bench){
+        createHarness(M, F);
+        return true;
+    }
     // 为函数创建BasicBlock
     BasicBlock *EntryBB = BasicBlock::Create(M.getContext(), "EntryBlock", F);
     // 使用IRBuilder 快速完成指令插入
@@ -43,4 +172,4 @@ bool SimpleInvoker::runOnModule(Module &M){
     IRB.CreateRet(ConstantInt::get(Type::getInt32Ty(M.getContext()), 0));
     return true;
 }
-static RegisterPass<SimpleInvoker> X("si", "create main function");
\ No newline at end of file
+static RegisterPass<SimpleInvoker> X("si", "create main function");
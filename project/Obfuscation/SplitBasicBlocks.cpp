@@ -12,6 +12,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "CryptoUtils.h"
+#include "OpcodeCounter.h"
 #include "Split.h"
 #include "Utils.h"
 
@@ -49,6 +50,7 @@ Pass *llvm::createSplitBasicBlock(bool flag) {
 }
 
 bool SplitBasicBlock::runOnFunction(Function &F) {
+  OpcodeCounterScope Metrics(F, "splitbbl");
   // Check if the number of applications is correct
   if (!((SplitNum > 1) && (SplitNum <= 10))) {
     errs() << "Split application basic block percentage\
@@ -10,6 +10,7 @@
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
 #include "CryptoUtils.h"
+#include "OpcodeCounter.h"
 #include "StringObfuscation.h"
 #include "Utils.h"
 #include "llvm/IR/IRBuilder.h"
@@ -40,6 +41,7 @@ namespace llvm {
                 virtual bool runOnModule(Module &M) {
                         if(!is_flag)
                             return false;
+                        OpcodeCounterScope Metrics(M, "GVDiv");
                         std::vector<GlobalVariable*> toDelConstGlob;
                         //std::vector<GlobalVariable*> encGlob;
                         std::vector<encVar*> encGlob;
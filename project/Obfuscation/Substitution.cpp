@@ -15,6 +15,7 @@
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/raw_ostream.h"
+#include "OpcodeCounter.h"
 #include "Utils.h"
 
 #define DEBUG_TYPE "substitution"
@@ -105,6 +106,7 @@ static RegisterPass<Substitution> X("substitution", "operators substitution");
 Pass *llvm::createSubstitution(bool flag) { return new Substitution(flag); }
 
 bool Substitution::runOnFunction(Function &F) {
+  OpcodeCounterScope Metrics(F, "substitution");
   // Check if the percentage is correct
   if (ObfTimes <= 0) {
     errs() << "Substitution application number -sub_loop=x must be x > 0";
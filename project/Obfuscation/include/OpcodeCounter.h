@@ -0,0 +1,26 @@
+#ifndef _OBFUSCATION_OPCODE_COUNTER_H_
+#define _OBFUSCATION_OPCODE_COUNTER_H_
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include <string>
+
+// With -oc-each an obfuscation pass emits the -oc records of what it works
+// on before and after it ran, staged "before <pass>" and "after <pass>".
+// Put one at the top of runOnFunction or runOnModule.
+class OpcodeCounterScope {
+public:
+  OpcodeCounterScope(llvm::Function &F, llvm::StringRef Pass);
+  OpcodeCounterScope(llvm::Module &M, llvm::StringRef Pass);
+  ~OpcodeCounterScope();
+
+private:
+  void record(llvm::StringRef When);
+
+  llvm::Function *F;
+  llvm::Module *M;
+  std::string Pass;
+};
+
+#endif
@@ -11,6 +11,7 @@
 /// This file contains the module pass class and decrypt function.
 ///
 //===----------------------------------------------------------------------===//
+#include "OpcodeCounter.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GlobalVariable.h"
@@ -42,6 +43,7 @@ struct ObfuscatePass : public ModulePass {
   ObfuscatePass() : ModulePass(ID) {}
 
   virtual bool runOnModule(Module &M) {
+    OpcodeCounterScope Metrics(M, "obfstr");
     for (GlobalValue &GV : M.globals()) {
       GlobalVariable *GVar = dyn_cast<GlobalVariable>(&GV);
       if (GVar == nullptr) {
@@ -28,3 +28,38 @@ static void registerSkeletonPass(const PassManagerBuilder &,
 static RegisterStandardPasses
   RegisterMyPass(PassManagerBuilder::EP_EarlyAsPossible,
                  registerSkeletonPass);
+
+#if __has_include("llvm/Passes/PassPlugin.h")
+// The same pass for the new pass manager, which clang uses by default
+// since LLVM 13. Load it with -fpass-plugin or opt -load-pass-plugin.
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+namespace {
+  struct NewSkeletonPass : public PassInfoMixin<NewSkeletonPass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &) {
+      errs() << "I saw a function called " << F.getName() << "!\n";
+      return PreservedAnalyses::all();
+    }
+  };
+}
+
+static void registerSkeletonPassBuilderCallbacks(PassBuilder &PB) {
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, FunctionPassManager &FPM,
+         ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "skeleton") {
+          FPM.addPass(NewSkeletonPass());
+          return true;
+        }
+        return false;
+      });
+  PB.registerVectorizerStartEPCallback(
+      [](FunctionPassManager &FPM, auto) { FPM.addPass(NewSkeletonPass()); });
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Skeleton", LLVM_VERSION_STRING,
+          registerSkeletonPassBuilderCallbacks};
+}
+#endif